@@ -0,0 +1,101 @@
+#!/bin/bash
+#
+# bench.sh - measures the proxy under load. Writes an object set, serves
+#     it with tiny, starts the proxy in front of it and drives the proxy
+#     with loadgen. Everything runs on localhost.
+#
+#     usage: ./bench.sh [-n objects] [-s size-distribution] [loadgen options]
+#                       [-- proxy options]
+#     e.g.   ./bench.sh -c 32 -t 5 -z 1.1 -- -m epoll -p s3fifo
+#
+
+TIMEOUT=5
+NOBJECTS=1000
+SIZES="pareto:1024:1.2"
+LOADGEN_ARGS=""
+PROXY_ARGS=""
+HOME_DIR=`pwd`
+
+#
+# probe_port - succeeds if something listens on the port passed as an
+#     argument. It gets a whole request and its answer is read, since
+#     tiny dies of SIGPIPE when a client hangs up before the answer.
+#
+function probe_port {
+    (exec 3<> /dev/tcp/localhost/$1 && printf 'GET / HTTP/1.0\r\n\r\n' >&3 &&
+     timeout ${TIMEOUT} cat <&3 > /dev/null) 2> /dev/null
+}
+
+#
+# wait_for_port - spins until something listens on the port passed as
+#     an argument. Gives up after TIMEOUT seconds.
+#
+function wait_for_port {
+    for i in `seq $((TIMEOUT * 10))`
+    do
+        probe_port $1 && return 0
+        sleep 0.1
+    done
+    echo "Error: nothing listens on port $1"
+    return 1
+}
+
+#
+# free_port - prints a port nothing listens on, starting at a random one
+#     and skipping the port passed as an argument
+#
+function free_port {
+    port=$(( (RANDOM % 30000) + 20000 ))
+    while [ "${port}" == "$1" ] || probe_port ${port}
+    do
+        port=$((port + 1))
+    done
+    echo ${port}
+}
+
+function cleanup {
+    [ -n "${PROXY_PID}" ] && kill ${PROXY_PID} 2> /dev/null
+    [ -n "${TINY_PID}" ] && kill ${TINY_PID} 2> /dev/null
+    rm -rf ${OBJ_DIR}
+}
+
+while [ $# -gt 0 ]
+do
+    case "$1" in
+    -n) NOBJECTS=$2; shift 2;;
+    -s) SIZES=$2; shift 2;;
+    --) shift; PROXY_ARGS="$*"; break;;
+    -k) LOADGEN_ARGS="${LOADGEN_ARGS} $1"; shift;;
+    *)  LOADGEN_ARGS="${LOADGEN_ARGS} $1 $2"; shift 2;;
+    esac
+done
+
+if [ ! -x ./proxy ] || [ ! -x ./loadgen ] || [ ! -x ./tiny/tiny ]
+then
+    echo "Error: build proxy, loadgen and tiny/tiny first (make, make -C tiny)"
+    exit 1
+fi
+
+OBJ_DIR=`mktemp -d`
+trap cleanup EXIT
+./loadgen -g ${OBJ_DIR} -n ${NOBJECTS} -s ${SIZES} || exit 1
+ln -s ${HOME_DIR}/tiny/cgi-bin ${OBJ_DIR}/cgi-bin
+
+TINY_PORT=`free_port`
+(cd ${OBJ_DIR}; exec ${HOME_DIR}/tiny/tiny ${TINY_PORT} &> /dev/null) &
+TINY_PID=$!
+wait_for_port ${TINY_PORT} || exit 1
+
+PROXY_PORT=`free_port ${TINY_PORT}`
+./proxy ${PROXY_ARGS} ${PROXY_PORT} &> /dev/null &
+PROXY_PID=$!
+wait_for_port ${PROXY_PORT} || exit 1
+if ! kill -0 ${PROXY_PID} 2> /dev/null
+then
+    echo "Error: the proxy didn't start"
+    exit 1
+fi
+
+echo "proxy ${PROXY_ARGS:-(defaults)}, sizes ${SIZES}"
+./loadgen -n ${NOBJECTS} -D ${OBJ_DIR} -P ${PROXY_PID} ${LOADGEN_ARGS} \
+    localhost:${PROXY_PORT} localhost:${TINY_PORT}
@@ -1,96 +1,430 @@
 #include "cache.h"
+#include "policy.h"
+#include "http.h"
 
-//global variable to keep track of the cache size
-size_t total_size;
+#if CACHE_ARENA_SIZE > MAX_CACHE_SIZE / CACHE_NSHARDS
+#error "the shard arenas must fit in MAX_CACHE_SIZE"
+#endif
+#if CACHE_ARENA_SIZE < MAX_OBJECT_SIZE + MAXLINE + 256
+#error "each shard arena must be able to hold MAX_OBJECT_SIZE"
+#endif
 
-//based on key, which is going to be the uri in this project,
-//cache returns the block with the matching key
-cache_block *cache_inquiry(char *key, cache_block *cache)
+//a key for str, FNV-1a hashed once here so lookups and inserts with it
+//don't walk the string again
+void cache_key_init(cache_key *key, char *str)
 {
-    cache_block *temp = cache;
-    cache_block *increment_ucount;
-    while(temp != NULL)
+    unsigned long h = 14695981039346656037UL;
+    char *p;
+
+    for(p = str; *p; p++)
     {
-        //found matching key
-        if(strcmp(key, temp->key) == 0)
+        h ^= (unsigned char)*p;
+        h *= 1099511628211UL;
+    }
+    key->str = str;
+    key->len = p - str;
+    key->hash = h;
+}
+
+//pointer to the bucket slot that holds block, or the slot where a
+//block with this key would go. the bytes are compared only when hash
+//and length match
+static cache_block **find_slot(struct cache_shard *shard, char *key,
+                               size_t len, unsigned long hash)
+{
+    cache_block **slot = &shard->buckets[hash & (shard->nbuckets - 1)];
+    while(*slot != NULL)
+    {
+        if((*slot)->hash == hash && (*slot)->key_len == len &&
+           memcmp((*slot)->key, key, len) == 0)
+            break;
+        slot = &(*slot)->hnext;
+    }
+    return slot;
+}
+
+//double the bucket array once the load factor goes over 1
+static void grow(struct cache_shard *shard)
+{
+    size_t i, n = shard->nbuckets * 2;
+    cache_block **buckets = Calloc(n, sizeof(cache_block *));
+    cache_block *block, *next;
+
+    for(i = 0; i < shard->nbuckets; i++)
+    {
+        for(block = shard->buckets[i]; block != NULL; block = next)
         {
-            //ucount is for keeping track of LRU
-            //most recently used, so set to zero
-            temp->ucount = 0;
-            increment_ucount = temp->next;
-            while(increment_ucount != NULL)
-            {
-                //increment ucount of other elements
-                increment_ucount->ucount++;
-                increment_ucount = increment_ucount->next;
-            }
-            return temp;
+            next = block->hnext;
+            block->hnext = buckets[block->hash & (n - 1)];
+            buckets[block->hash & (n - 1)] = block;
         }
-        temp = temp->next;
     }
-    return NULL;
+    Free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nbuckets = n;
 }
 
-//make and initialize a new block
-cache_block *new_block(char *key, char *buf, size_t size)
+//drop one reference, the last one returns the block's slot
+void cache_release(cache_block *block)
 {
-    cache_block *newcache = malloc(sizeof(cache_block));
-    
-    newcache->key = Malloc(strlen(key)+1);
-    strcpy(newcache->key,key);
-    
-    newcache->buf = Malloc(size);
-    strcpy(newcache->buf, buf);
-    
-    newcache->size = size;
-    newcache->ucount = 0;
-    //newcache->next = NULL;
-    return newcache;
+    if(__atomic_sub_fetch(&block->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        if(block->arena != NULL) slab_free(block->arena, block);
+        else Free(block);
+    }
 }
 
-//insert element to cache
-cache_block *cache_insert(char *key, char *buf, size_t size, cache_block *cache)
+//unlink block from both the index and the policy and drop the
+//cache's reference to it; readers still sending it keep it alive
+static void remove_block(cache_t *cache, struct cache_shard *shard,
+                         cache_block *block, int evicted)
 {
-    cache_block *newcache;
-    cache_block *temp = cache;
-    cache_block *evict = cache;
-    //no eviction
-    if(total_size + size <= MAX_CACHE_SIZE)
+    cache_block **slot = find_slot(shard, block->key, block->key_len,
+                                   block->hash);
+    *slot = block->hnext;
+    cache->policy->remove(shard, block, evicted);
+    shard->count--;
+    cache_release(block);
+}
+
+static void shard_init(cache_t *cache, struct cache_shard *shard,
+                       char *arena)
+{
+    pthread_rwlockattr_t attr;
+
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    //glibc prefers readers by default, which lets a steady stream of
+    //hits starve inserts
+    pthread_rwlockattr_setkind_np(&attr,
+            PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&shard->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&shard->policy_lock, NULL);
+
+    shard->nbuckets = CACHE_MIN_BUCKETS;
+    shard->buckets = Calloc(shard->nbuckets, sizeof(cache_block *));
+    shard->count = 0;
+    shard->capacity = CACHE_ARENA_SIZE;
+    slab_init(&shard->arena, arena, CACHE_ARENA_SIZE);
+    memset(shard->sketch, 0, sizeof(shard->sketch));
+    shard->samples = 0;
+    shard->lookups = shard->hits = shard->hit_bytes = 0;
+    shard->inserts = shard->evictions = shard->rejected = 0;
+    cache->policy->init(shard);
+}
+
+//high bits pick the shard, low bits pick the bucket inside it
+struct cache_shard *cache_shard_for(cache_t *cache, unsigned long hash)
+{
+    return &cache->shards[(hash >> 48) % CACHE_NSHARDS];
+}
+
+//set up an empty cache evicting with the named policy, optionally
+//behind the TinyLFU admission filter. all object memory is mapped
+//here, one arena per shard. returns -1 for an unknown policy
+int cache_init(cache_t *cache, char *policy, int tinylfu)
+{
+    int i;
+    char *region;
+
+    if((cache->policy = policy_lookup(policy)) == NULL) return -1;
+    cache->tinylfu = tinylfu;
+    cache->disk = NULL;
+    region = Mmap(NULL, (size_t)CACHE_ARENA_SIZE * CACHE_NSHARDS,
+                  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    for(i = 0; i < CACHE_NSHARDS; i++)
+        shard_init(cache, &cache->shards[i],
+                   region + (size_t)i * CACHE_ARENA_SIZE);
+    return 0;
+}
+
+//fill t with the object count, size and the hit and eviction
+//counters summed over the shards
+void cache_stats(cache_t *cache, cache_totals *t)
+{
+    struct cache_shard *shard;
+    int i;
+
+    memset(t, 0, sizeof(cache_totals));
+    for(i = 0; i < CACHE_NSHARDS; i++)
+    {
+        shard = &cache->shards[i];
+        pthread_rwlock_rdlock(&shard->lock);
+        t->count += shard->count;
+        pthread_rwlock_unlock(&shard->lock);
+        t->size += slab_used(&shard->arena);
+        t->lookups += __atomic_load_n(&shard->lookups, __ATOMIC_RELAXED);
+        t->hits += __atomic_load_n(&shard->hits, __ATOMIC_RELAXED);
+        t->hit_bytes += __atomic_load_n(&shard->hit_bytes, __ATOMIC_RELAXED);
+        t->inserts += __atomic_load_n(&shard->inserts, __ATOMIC_RELAXED);
+        t->evictions += __atomic_load_n(&shard->evictions, __ATOMIC_RELAXED);
+        t->rejected += __atomic_load_n(&shard->rejected, __ATOMIC_RELAXED);
+    }
+}
+
+void cache_report(cache_t *cache, FILE *fp)
+{
+    cache_totals t;
+
+    cache_stats(cache, &t);
+    fprintf(fp, "cache (%s%s): %lu objects, %lu bytes, "
+            "%lu/%lu hits (%.1f%%), %lu bytes from cache, "
+            "%lu inserted, %lu evicted, %lu not admitted\n",
+            cache->policy->name, cache->tinylfu ? "+tinylfu" : "",
+            (unsigned long)t.count, (unsigned long)t.size,
+            t.hits, t.lookups, t.lookups ? 100.0 * t.hits / t.lookups : 0.0,
+            t.hit_bytes, t.inserts, t.evictions, t.rejected);
+}
+
+//based on key, cache returns the block with the matching key, pinned
+//until the caller passes it to cache_release, and tells the policy
+//about the hit. lookups in a shard run concurrently
+cache_block *cache_inquiry(cache_key *key, cache_t *cache)
+{
+    unsigned long hash = key->hash;
+    struct cache_shard *shard = cache_shard_for(cache, hash);
+    cache_block *block;
+    unsigned long n;
+
+    pthread_rwlock_rdlock(&shard->lock);
+    n = __atomic_add_fetch(&shard->lookups, 1, __ATOMIC_RELAXED);
+    if(cache->tinylfu) tinylfu_record(shard, hash);
+    block = *find_slot(shard, key->str, key->len, hash);
+    if(block != NULL)
+    {
+        __atomic_add_fetch(&block->refcnt, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&block->used, n, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&shard->hits, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&shard->hit_bytes, block->size, __ATOMIC_RELAXED);
+        cache->policy->hit(shard, block);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return block;
+}
+
+//1 until the block's freshness lifetime runs out, a stale block has to
+//be revalidated before it is served again
+int cache_fresh(cache_block *block)
+{
+    return time(NULL) < __atomic_load_n(&block->meta.expires,
+                                        __ATOMIC_RELAXED);
+}
+
+//the server confirmed a stale block is still current, it is fresh for
+//lifetime seconds from a confirmation already age seconds old
+void cache_refresh(cache_block *block, long lifetime, long age)
+{
+    __atomic_store_n(&block->meta.lifetime, lifetime, __ATOMIC_RELAXED);
+    __atomic_store_n(&block->meta.expires, time(NULL) + lifetime - age,
+                     __ATOMIC_RELAXED);
+}
+
+//write evicted blocks to the disk tier and drop the references reserve
+//kept on them, which gives their slots back. called without the shard
+//lock, so readers and other evictions don't wait for the disk
+static void demote(cache_t *cache, cache_block *list)
+{
+    cache_block *next;
+
+    for(; list != NULL; list = next)
     {
-        newcache = new_block(key, buf, size);
-        newcache->next = cache;
-        //total cache size update
-        total_size += size;
-        return newcache;
+        next = list->hnext;
+        disk_put(cache->disk, list->key, list->buf, list->size,
+                 list->framed, list->meta.gzip, list->meta.expires);
+        cache_release(list);
     }
-    //evict
-    else
+}
+
+//carve a slot for an object of size bytes out of the shard's arena,
+//evicting the policy's victims until a slot is free. with a disk tier
+//the victims stay pinned while they are unlinked; once their slots add
+//up to size the lock is dropped, they are written out and released,
+//and the arena is tried again. with TinyLFU in front the new object has
+//to be more popular than the first victim to get in at all. returns
+//NULL if it is not admitted or readers still pin so much of the arena
+//that it can't fit
+static cache_block *reserve(cache_t *cache, struct cache_shard *shard,
+                            unsigned long hash, size_t size)
+{
+    cache_block *block, *victim, *pinned = NULL;
+    size_t pending = 0;
+    int first = 1;
+
+    pthread_rwlock_wrlock(&shard->lock);
+    while((block = slab_alloc(&shard->arena, size)) == NULL &&
+          shard->count > 0)
     {
-        //get block to evict based on ucount (greatest)
-        while(temp != NULL)
+        victim = cache->policy->victim(shard);
+        if(first && cache->tinylfu &&
+           tinylfu_estimate(shard, hash) <=
+           tinylfu_estimate(shard, victim->hash))
+        {
+            __atomic_add_fetch(&shard->rejected, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        first = 0;
+        //the Vary names alone are no response to serve from disk, and
+        //variants stay in memory with them
+        if(cache->disk != NULL && !victim->meta.vary &&
+           !victim->meta.variant)
         {
-            if(evict->ucount < temp->ucount)
-            {
-                evict = temp;
-            }
-            temp = temp->next;
+            __atomic_add_fetch(&victim->refcnt, 1, __ATOMIC_RELAXED);
+            remove_block(cache, shard, victim, 1);
+            //out of the index, so its bucket link is free to chain it
+            victim->hnext = pinned;
+            pinned = victim;
+            pending += victim->slot;
         }
+        //a victim pinned by a reader gives its slot back only once the
+        //reader is done, so this may take more than one
+        else remove_block(cache, shard, victim, 1);
+        __atomic_add_fetch(&shard->evictions, 1, __ATOMIC_RELAXED);
+        if(pinned != NULL && (pending >= size || shard->count == 0))
+        {
+            pthread_rwlock_unlock(&shard->lock);
+            demote(cache, pinned);
+            pinned = NULL;
+            pending = 0;
+            pthread_rwlock_wrlock(&shard->lock);
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    demote(cache, pinned);
+    return block;
+}
+
+//index a filled block, replacing an older copy of the same key
+static void link_block(cache_t *cache, struct cache_shard *shard,
+                       cache_block *newcache)
+{
+    cache_block **slot;
+
+    pthread_rwlock_wrlock(&shard->lock);
+    //a concurrent miss may already have inserted this key
+    if(*(slot = find_slot(shard, newcache->key, newcache->key_len,
+                          newcache->hash)) != NULL)
+        remove_block(cache, shard, *slot, 0);
+
+    if(shard->count >= shard->nbuckets) grow(shard);
+
+    slot = find_slot(shard, newcache->key, newcache->key_len, newcache->hash);
+    *slot = newcache;
+    cache->policy->insert(shard, newcache);
+    shard->count++;
+    __atomic_add_fetch(&shard->inserts, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+//bytes of a validator kept with a block, its '\0' included
+static size_t validator_len(const char *v)
+{
+    return v == NULL ? 1 : strnlen(v, CACHE_VALIDATOR_LEN - 1) + 1;
+}
+
+//copy a validator to dst, returns where the next field goes
+static char *put_validator(char *dst, const char *v, size_t len)
+{
+    if(v != NULL) memcpy(dst, v, len - 1);
+    dst[len - 1] = '\0';
+    return dst + len;
+}
+
+//insert a copy of buf to cache, its head is head_len bytes up to the
+//blank line. the block header, key, validators and response bytes
+//share one arena slot, so a block takes only the bytes it needs. the
+//slot is reserved under the shard lock but filled outside it
+void cache_insert(cache_key *key, char *buf, size_t size, size_t head_len,
+                  int framed, cache_meta *meta, cache_t *cache)
+{
+    unsigned long hash = key->hash;
+    struct cache_shard *shard = cache_shard_for(cache, hash);
+    size_t keylen = key->len + 1, etag_len, lm_len, need;
+    cache_block *newcache;
+    char *p;
 
-        free(evict->buf);
-        free(evict->key);
-        //update total cache size
-        total_size = total_size - evict->size;
-
-        evict->buf = malloc(size);
-        strcpy(evict->buf, buf);
-        evict->key = malloc(strlen(key)+1);
-        strcpy(evict->key, key);
-        
-        evict->size = size;
-        evict->ucount = 0;
-
-        //update total cache size
-        total_size += size;
-        return cache;
+    if(size > MAX_OBJECT_SIZE) return;
+    etag_len = validator_len(meta->etag);
+    lm_len = validator_len(meta->last_modified);
+    need = sizeof(cache_block) + keylen + etag_len + lm_len + size;
+    newcache = reserve(cache, shard, hash, need);
+    if(newcache == NULL) return;
+
+    newcache->meta = *meta;
+    newcache->key = (char *)(newcache + 1);
+    memcpy(newcache->key, key->str, keylen);
+    newcache->key_len = key->len;
+    newcache->meta.etag = p = newcache->key + keylen;
+    p = put_validator(p, meta->etag, etag_len);
+    newcache->meta.last_modified = p;
+    p = put_validator(p, meta->last_modified, lm_len);
+    //response bytes are binary, copy exactly size of them
+    newcache->buf = p;
+    memcpy(newcache->buf, buf, size);
+
+    newcache->arena = &shard->arena;
+    newcache->size = size;
+    newcache->slot = slab_slot_size(need);
+    newcache->framed = framed;
+    newcache->head_len = head_len;
+    newcache->hash = hash;
+    newcache->used = __atomic_load_n(&shard->lookups, __ATOMIC_RELAXED);
+    newcache->hnext = NULL;
+    newcache->refcnt = 1;
+    link_block(cache, shard, newcache);
+}
+
+void cache_fill_init(cache_fill *fill)
+{
+    fill->buf = NULL;
+    fill->len = fill->cap = 0;
+    fill->ok = 1;
+}
+
+//append response bytes as they are relayed. the buffer doubles up to
+//MAX_OBJECT_SIZE and the fill is abandoned as soon as the response
+//outgrows it, so nothing more is copied for an uncacheable object
+void cache_fill_append(cache_fill *fill, char *data, size_t n)
+{
+    if(!fill->ok) return;
+    if(fill->len + n > MAX_OBJECT_SIZE)
+    {
+        cache_fill_abandon(fill);
+        return;
+    }
+    if(fill->len + n > fill->cap)
+    {
+        fill->cap = fill->cap ? fill->cap * 2 : CACHE_FILL_MIN;
+        while(fill->cap < fill->len + n) fill->cap *= 2;
+        if(fill->cap > MAX_OBJECT_SIZE) fill->cap = MAX_OBJECT_SIZE;
+        fill->buf = Realloc(fill->buf, fill->cap);
+    }
+    memcpy(fill->buf + fill->len, data, n);
+    fill->len += n;
+}
+
+void cache_fill_abandon(cache_fill *fill)
+{
+    Free(fill->buf);
+    fill->buf = NULL;
+    fill->len = fill->cap = 0;
+    fill->ok = 0;
+}
+
+//hand a complete fill to the cache, which copies it into its arena.
+//the head is stored without the lines rewritten on every hit. the fill
+//is empty afterwards
+void cache_fill_commit(cache_key *key, cache_fill *fill, int framed,
+                       cache_meta *meta, cache_t *cache)
+{
+    size_t head_len;
+
+    if(fill->ok && fill->len > 0)
+    {
+        fill->len = http_store_head(fill->buf, fill->len, &head_len);
+        cache_insert(key, fill->buf, fill->len, head_len, framed, meta,
+                     cache);
     }
+    cache_fill_abandon(fill);
 }
@@ -1,17 +1,167 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
 #include "csapp.h"
+#include "slab.h"
+#include "disk.h"
 
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
+//initial number of hash buckets per shard, doubled as the shard grows
+#define CACHE_MIN_BUCKETS 64
+//number of independently locked shards, each owns an equal share of
+//MAX_CACHE_SIZE, so a share must still hold one full sized object
+#define CACHE_NSHARDS 8
+//bytes of arena per shard: its share rounded down to whole slab units
+#define CACHE_ARENA_SIZE ((MAX_CACHE_SIZE / CACHE_NSHARDS) & \
+                          ~((1 << SLAB_UNIT_SHIFT) - 1))
+//S3-FIFO: share of a shard for the small probationary queue, in percent
+#define S3FIFO_SMALL_PERCENT 10
+//S3-FIFO: slots of the ghost table remembering recently evicted keys
+#define S3FIFO_GHOSTS 1024
+//seconds a response that says nothing about its freshness is served
+//from the cache before it is revalidated
+#define CACHE_DEFAULT_FRESHNESS 300
+//longest ETag or Last-Modified value kept for revalidation
+#define CACHE_VALIDATOR_LEN 128
+//longest key: a normalized uri and the request header values a
+//response varies with
+#define CACHE_KEY_LEN (2 * MAXLINE)
+//TinyLFU: counters per row of the count-min sketch, must be a power of 2
+#define TINYLFU_WIDTH 4096
+#define TINYLFU_DEPTH 4
+
+struct cache_policy;
+
+//what is kept from a response head to know when the copy goes stale
+//and to revalidate it with the server then
+typedef struct {
+    int status;
+    long lifetime;               //seconds fresh after each validation
+    time_t expires;              //fresh until then
+    //validators, "" if the server sent none. a block keeps them in its
+    //slot next to the key, NULL is taken as "" when one is inserted
+    const char *etag;
+    const char *last_modified;
+    int vary;                    //no response, only the Vary names
+    int variant;                 //stored under a variant or encoding
+                                 //key, kept out of the disk tier,
+                                 //which can't tell them apart
+    int gzip;                    //body stored gzip encoded
+    int expendable;              //a copy the proxy can make again, the
+                                 //policy puts it first in line to go
+} cache_meta;
 
+//a key with its hash worked out once, str is the caller's
+typedef struct {
+    char *str;
+    size_t len;
+    unsigned long hash;
+} cache_key;
+
+//blocks are reference counted: the cache holds one reference while the
+//block is indexed and every reader pinned by cache_inquiry holds one
+//more, so an evicted block is freed only once the last reader is done.
+//a block lives in one arena slot followed by its key, its validators
+//and its response, or for a private copy made for one client, outside
+//any arena
 struct cache_block{
+    slab_arena *arena;           //NULL for a private copy
     size_t size;
-    size_t ucount;
-    struct cache_block* next;
+    size_t slot;                 //arena bytes taken, what the shard's
+                                 //capacity is charged with
+    int refcnt;
+    int framed;                  //response carries its own length
+    size_t head_len;             //head up to its blank line, 0 if unknown
+    unsigned long hash;
+    size_t key_len;
+    unsigned long used;          //shard lookups at the last hit, for
+                                 //ordering blocks by recency
+    struct cache_block *hnext;   //next block in the same hash bucket
+    struct cache_block *prev;    //position in the policy's queue
+    struct cache_block *next;
     char *key;
     char *buf;
+    cache_meta meta;
+    //eviction policy state
+    int queue;                   //S3-FIFO: small or main queue
+    unsigned char freq;          //S3-FIFO: accesses since last move
+    unsigned long hits;          //GDSF: accesses while cached
+    double priority;             //GDSF: inflation + hits / size
+    size_t heap_idx;             //GDSF: position in the shard's heap
 };
 typedef struct cache_block cache_block;
 
-cache_block *cache_inquiry(char *key, cache_block *cache);
-cache_block *newblock(char *key, char *buf, size_t size);
-cache_block *cache_insert(char *key, char *buf, size_t size, cache_block *cache);
+//one shard: hash index plus the state of the eviction policy.
+//lock guards the index and sizes; readers hold it shared and the
+//policy serializes whatever a hit changes itself (usually with
+//policy_lock), writers hold it exclusively
+struct cache_shard{
+    pthread_rwlock_t lock;
+    pthread_mutex_t policy_lock;
+    cache_block **buckets;
+    size_t nbuckets;
+    size_t count;
+    size_t capacity;
+    //memory for blocks, its used bytes are the shard's exact size
+    slab_arena arena;
+    //LRU: queues[0] is the recency list, queues[0].next most recent.
+    //S3-FIFO: queues[0] is the small queue, queues[1] the main one,
+    //both with new blocks at the head
+    cache_block queues[2];
+    size_t queue_size[2];
+    //GDSF: min-heap on priority and the inflation value L
+    cache_block **heap;
+    size_t heap_len, heap_cap;
+    double inflation;
+    //S3-FIFO: hashes of keys recently evicted from the small queue
+    unsigned long ghosts[S3FIFO_GHOSTS];
+    //TinyLFU: count-min sketch of access frequency, halved periodically
+    unsigned char sketch[TINYLFU_DEPTH][TINYLFU_WIDTH];
+    unsigned long samples;
+    //counters, updated atomically
+    unsigned long lookups, hits, hit_bytes, inserts, evictions, rejected;
+};
+
+//URIs are spread over the shards by hash
+struct cache{
+    struct cache_shard shards[CACHE_NSHARDS];
+    const struct cache_policy *policy;
+    int tinylfu;                //TinyLFU admission filter in front
+    disk_t *disk;               //evicted objects are demoted here if set
+};
+typedef struct cache cache_t;
+
+//counters summed over the shards
+typedef struct {
+    size_t count, size;
+    unsigned long lookups, hits, hit_bytes, inserts, evictions, rejected;
+} cache_totals;
+
+//response being collected for the cache while it is relayed
+typedef struct {
+    char *buf;
+    size_t len, cap;
+    int ok;                     //0 once the response outgrew the cache
+} cache_fill;
+//first allocation of a fill buffer
+#define CACHE_FILL_MIN 8192
+
+int cache_init(cache_t *cache, char *policy, int tinylfu);
+void cache_stats(cache_t *cache, cache_totals *t);
+void cache_report(cache_t *cache, FILE *fp);
+struct cache_shard *cache_shard_for(cache_t *cache, unsigned long hash);
+void cache_key_init(cache_key *key, char *str);
+cache_block *cache_inquiry(cache_key *key, cache_t *cache);
+void cache_release(cache_block *block);
+int cache_fresh(cache_block *block);
+void cache_refresh(cache_block *block, long lifetime, long age);
+void cache_insert(cache_key *key, char *buf, size_t size, size_t head_len,
+                  int framed, cache_meta *meta, cache_t *cache);
+void cache_fill_init(cache_fill *fill);
+void cache_fill_append(cache_fill *fill, char *data, size_t n);
+void cache_fill_abandon(cache_fill *fill);
+void cache_fill_commit(cache_key *key, cache_fill *fill, int framed,
+                       cache_meta *meta, cache_t *cache);
+
+#endif /* __CACHE_H__ */
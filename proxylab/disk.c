@@ -0,0 +1,312 @@
+/*on-disk second tier of the cache.
+ * The segment file starts with a superblock telling where the oldest
+ * record and the tail are, followed by records written back to back:
+ *   header | key | response bytes, padded to 8 bytes
+ * When a record doesn't fit before the end of the file a wrap marker is
+ * left and writing continues at the start, overwriting the oldest
+ * records. The index only lives in memory and is rebuilt on startup by
+ * walking the headers from the oldest record to the tail, so the proxy
+ * comes back with whatever it had demoted before it stopped.
+ * Hits are sent with sendfile straight from the file's page cache.*/
+#include <sys/sendfile.h>
+#include "disk.h"
+
+#define DISK_MAGIC 0x50524f58594b4354UL     //superblock, version 2
+#define RECORD_MAGIC 0x43524543U
+#define WRAP_MAGIC 0x57524150U
+
+struct superblock{
+    unsigned long magic;
+    unsigned long size;
+    unsigned long head, tail;
+    unsigned long records;          //head == tail is empty or full
+};
+
+struct record{
+    unsigned int magic;
+    unsigned int keylen;            //including the '\0'
+    unsigned long size;
+    unsigned int framed;
+    unsigned int gzip;              //0 in files from before it was kept
+    long expires;
+    unsigned long sum;              //over key and response bytes
+};
+
+//FNV-1a, used both for the index and the record checksums
+static unsigned long fnv(unsigned long h, const char *p, size_t n)
+{
+    while(n-- > 0)
+    {
+        h ^= (unsigned char)*p++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+#define FNV_INIT 14695981039346656037UL
+
+static size_t record_len(size_t keylen, size_t size)
+{
+    return (sizeof(struct record) + keylen + size + 7) & ~(size_t)7;
+}
+
+static struct superblock *super(disk_t *disk)
+{
+    return (struct superblock *)disk->base;
+}
+
+static disk_entry **find_slot(disk_t *disk, char *key, unsigned long hash)
+{
+    disk_entry **slot = &disk->buckets[hash % DISK_NBUCKETS];
+    while(*slot != NULL)
+    {
+        if((*slot)->hash == hash && strcmp((*slot)->key, key) == 0)
+            break;
+        slot = &(*slot)->hnext;
+    }
+    return slot;
+}
+
+//take e out of the index, its bytes stay until the ring comes around
+static void unindex(disk_t *disk, disk_entry *e)
+{
+    disk_entry **slot = find_slot(disk, e->key, e->hash);
+    *slot = e->hnext;
+    e->live = 0;
+    disk->count--;
+}
+
+//after the ring moved, tell the superblock where it starts and ends
+static void sync_super(disk_t *disk)
+{
+    struct superblock *sb = super(disk);
+    sb->head = disk->oldest ? disk->oldest->off : disk->tail;
+    sb->tail = disk->tail;
+    sb->records = disk->records;
+}
+
+void disk_release(disk_t *disk, disk_entry *e)
+{
+    if(__atomic_sub_fetch(&e->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        Free(e->key);
+        Free(e);
+    }
+}
+
+//record a new youngest entry for the record at off
+static disk_entry *add_entry(disk_t *disk, char *key, size_t off,
+                             size_t size, int framed, int gzip,
+                             time_t expires)
+{
+    disk_entry *e = Malloc(sizeof(disk_entry));
+    disk_entry **slot;
+    size_t keylen = strlen(key) + 1;
+
+    e->key = Malloc(keylen);
+    memcpy(e->key, key, keylen);
+    e->hash = fnv(FNV_INIT, key, keylen - 1);
+    e->off = off;
+    e->len = record_len(keylen, size);
+    e->data_off = off + sizeof(struct record) + keylen;
+    e->size = size;
+    e->framed = framed;
+    e->gzip = gzip;
+    e->expires = expires;
+    e->refcnt = 1;
+    e->next = NULL;
+
+    //an older copy of the key is shadowed from now on
+    if(*(slot = find_slot(disk, key, e->hash)) != NULL) unindex(disk, *slot);
+    e->hnext = NULL;
+    *slot = e;
+    e->live = 1;
+    disk->count++;
+    disk->records++;
+    disk->used += e->len;
+
+    if(disk->youngest != NULL) disk->youngest->next = e;
+    else disk->oldest = e;
+    disk->youngest = e;
+    return e;
+}
+
+//free the file between from and to by dropping the oldest records.
+//returns -1 if one of them is still being sent
+static int make_room(disk_t *disk, size_t from, size_t to)
+{
+    disk_entry *e;
+
+    while((e = disk->oldest) != NULL && e->off < to && e->off + e->len > from)
+    {
+        if(__atomic_load_n(&e->refcnt, __ATOMIC_ACQUIRE) > 1) return -1;
+        disk->oldest = e->next;
+        if(disk->oldest == NULL) disk->youngest = NULL;
+        disk->records--;
+        disk->used -= e->len;
+        if(e->live) unindex(disk, e);
+        disk_release(disk, e);
+    }
+    return 0;
+}
+
+//append a copy of an object evicted from memory. it is dropped if the
+//ring would have to overwrite a record that is still being sent
+void disk_put(disk_t *disk, char *key, char *buf, size_t size, int framed,
+              int gzip, time_t expires)
+{
+    size_t keylen = strlen(key) + 1;
+    size_t len = record_len(keylen, size);
+    struct record *r;
+
+    if(len > (disk->size - DISK_DATA_START) / 2) return;
+    pthread_mutex_lock(&disk->lock);
+    if(disk->tail + len > disk->size)
+    {
+        if(make_room(disk, disk->tail, disk->size) < 0) goto drop;
+        if(disk->tail + sizeof(struct record) <= disk->size)
+            ((struct record *)(disk->base + disk->tail))->magic = WRAP_MAGIC;
+        disk->tail = DISK_DATA_START;
+        sync_super(disk);
+    }
+    if(make_room(disk, disk->tail, disk->tail + len) < 0) goto drop;
+
+    r = (struct record *)(disk->base + disk->tail);
+    memcpy(r + 1, key, keylen);
+    memcpy((char *)(r + 1) + keylen, buf, size);
+    r->keylen = keylen;
+    r->size = size;
+    r->framed = framed;
+    r->gzip = gzip;
+    r->expires = expires;
+    r->sum = fnv(fnv(FNV_INIT, key, keylen), buf, size);
+    //the header goes in last, so a torn record fails its check
+    __atomic_store_n(&r->magic, RECORD_MAGIC, __ATOMIC_RELEASE);
+    add_entry(disk, key, disk->tail, size, framed, gzip, expires);
+    disk->tail += len;
+    sync_super(disk);
+    disk->puts++;
+    pthread_mutex_unlock(&disk->lock);
+    return;
+
+drop:
+    disk->dropped++;
+    pthread_mutex_unlock(&disk->lock);
+}
+
+//walk the superblock's records from its head and index them. the walk
+//stops at the first record that fails its checks and the tail is
+//moved back there
+static void rebuild(disk_t *disk)
+{
+    struct superblock *sb = super(disk);
+    size_t off = sb->head, n;
+    struct record *r;
+    char *key;
+
+    for(n = 0; n < sb->records; n++)
+    {
+        //no room for a marker at the very end also means a wrap
+        if(off + sizeof(struct record) > disk->size ||
+           ((struct record *)(disk->base + off))->magic == WRAP_MAGIC)
+            off = DISK_DATA_START;
+        r = (struct record *)(disk->base + off);
+        key = (char *)(r + 1);
+        if(r->magic != RECORD_MAGIC || r->keylen == 0 ||
+           r->size > disk->size ||
+           off + record_len(r->keylen, r->size) > disk->size ||
+           key[r->keylen - 1] != '\0' ||
+           fnv(fnv(FNV_INIT, key, r->keylen), key + r->keylen, r->size) !=
+           r->sum)
+            break;
+        add_entry(disk, key, off, r->size, r->framed, r->gzip, r->expires);
+        off += record_len(r->keylen, r->size);
+    }
+    disk->recovered = disk->count;
+    disk->tail = off;
+    sync_super(disk);
+}
+
+//map the segment file at path, creating it with size bytes if needed,
+//and index what it already holds. returns -1 if it can't be used
+int disk_open(disk_t *disk, char *path, size_t size)
+{
+    struct stat st;
+    struct superblock *sb;
+
+    memset(disk, 0, sizeof(disk_t));
+    pthread_mutex_init(&disk->lock, NULL);
+    if((disk->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) return -1;
+    if(fstat(disk->fd, &st) < 0) goto fail;
+    //an existing file keeps its size
+    if(st.st_size >= DISK_DATA_START) size = st.st_size;
+    else if(ftruncate(disk->fd, size) < 0) goto fail;
+    if(size <= DISK_DATA_START) goto fail;
+    disk->size = size;
+    disk->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      disk->fd, 0);
+    if(disk->base == MAP_FAILED) goto fail;
+
+    sb = super(disk);
+    if(sb->magic == DISK_MAGIC && sb->size == size &&
+       sb->head >= DISK_DATA_START && sb->head <= size &&
+       sb->tail >= DISK_DATA_START && sb->tail <= size &&
+       sb->records <= size / sizeof(struct record))
+        rebuild(disk);
+    else
+    {
+        sb->magic = DISK_MAGIC;
+        sb->size = size;
+        disk->tail = DISK_DATA_START;
+        sync_super(disk);
+    }
+    return 0;
+
+fail:
+    close(disk->fd);
+    return -1;
+}
+
+//the live entry for key, pinned until the caller passes it to
+//disk_release, or NULL. stale entries are not revalidated from here,
+//they are misses until a fresh copy is demoted over them
+disk_entry *disk_inquiry(disk_t *disk, char *key)
+{
+    unsigned long hash = fnv(FNV_INIT, key, strlen(key));
+    disk_entry *e;
+
+    pthread_mutex_lock(&disk->lock);
+    disk->lookups++;
+    if((e = *find_slot(disk, key, hash)) != NULL && e->expires <= time(NULL))
+        e = NULL;
+    if(e != NULL)
+    {
+        __atomic_add_fetch(&e->refcnt, 1, __ATOMIC_RELAXED);
+        disk->hits++;
+        disk->hit_bytes += e->size;
+    }
+    pthread_mutex_unlock(&disk->lock);
+    return e;
+}
+
+//send the response bytes of a pinned entry from *off on to fd with one
+//sendfile call and advance *off. returns what sendfile returns
+ssize_t disk_send(disk_t *disk, disk_entry *e, int fd, size_t *off)
+{
+    off_t pos = e->data_off + *off;
+    ssize_t n = sendfile(fd, disk->fd, &pos, e->size - *off);
+    if(n > 0) *off += n;
+    return n;
+}
+
+void disk_report(disk_t *disk, FILE *fp)
+{
+    pthread_mutex_lock(&disk->lock);
+    fprintf(fp, "disk: %lu objects, %lu of %lu bytes, %lu/%lu hits, "
+            "%lu bytes from disk, %lu demoted, %lu dropped, "
+            "%lu recovered\n",
+            (unsigned long)disk->count, (unsigned long)disk->used,
+            (unsigned long)(disk->size - DISK_DATA_START),
+            disk->hits, disk->lookups, disk->hit_bytes, disk->puts,
+            disk->dropped, disk->recovered);
+    pthread_mutex_unlock(&disk->lock);
+}
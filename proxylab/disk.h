@@ -0,0 +1,54 @@
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "csapp.h"
+
+//default size of the segment file, in bytes
+#define DISK_DEFAULT_SIZE (64*1024*1024)
+//the superblock takes the first page, records follow
+#define DISK_DATA_START 4096
+#define DISK_NBUCKETS 8192
+
+//one record in the segment. the ring holds a reference until the
+//record is overwritten and every reader sending it holds one more; the
+//bytes of a pinned record are never overwritten. a record shadowed by
+//a newer copy of its key is no longer live but still takes up space
+typedef struct disk_entry {
+    char *key;
+    unsigned long hash;
+    size_t off, len;            //whole record in the file
+    size_t data_off, size;      //response bytes in the file
+    int framed;
+    int gzip;                   //body is gzip encoded
+    time_t expires;             //stale from then on
+    int refcnt;
+    int live;                   //still in the index
+    struct disk_entry *hnext;   //next entry in the same bucket
+    struct disk_entry *next;    //next younger record in the file
+} disk_entry;
+
+//second cache tier: objects evicted from memory are appended to a
+//memory-mapped segment file used as a ring. the oldest records are
+//overwritten as the tail comes around again
+typedef struct disk {
+    pthread_mutex_t lock;
+    int fd;
+    char *base;
+    size_t size;
+    size_t tail;                //where the next record goes
+    disk_entry *oldest, *youngest;
+    disk_entry *buckets[DISK_NBUCKETS];
+    size_t count, records, used;
+    //counters, updated under lock
+    unsigned long lookups, hits, hit_bytes, puts, dropped, recovered;
+} disk_t;
+
+int disk_open(disk_t *disk, char *path, size_t size);
+void disk_put(disk_t *disk, char *key, char *buf, size_t size, int framed,
+              int gzip, time_t expires);
+disk_entry *disk_inquiry(disk_t *disk, char *key);
+void disk_release(disk_t *disk, disk_entry *e);
+ssize_t disk_send(disk_t *disk, disk_entry *e, int fd, size_t *off);
+void disk_report(disk_t *disk, FILE *fp);
+
+#endif /* __DISK_H__ */
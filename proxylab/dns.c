@@ -0,0 +1,417 @@
+/*cached, non-blocking name resolution for connections to origins.
+ * Answers are cached per "host:port" for DNS_TTL seconds and failures
+ * for DNS_NEGATIVE_TTL, for at most DNS_MAX_ENTRIES names, the least
+ * recently used going first. A miss is queued for a small pool of resolver
+ * threads that run getaddrinfo, so /etc/hosts and the system's resolver
+ * configuration apply; concurrent misses on one name wait on the same
+ * lookup. Callers either block in dns_resolve or, like the event loops,
+ * register a waiter whose done callback fires once the answer is in.
+ * dns_connect races connects to the addresses happy eyeballs style: the
+ * next address is tried whenever DNS_ATTEMPT_DELAY passes without any
+ * attempt finishing, and all of them give up after DNS_CONNECT_TIMEOUT.*/
+#include <poll.h>
+#include "dns.h"
+
+enum { ENTRY_PENDING, ENTRY_READY };
+
+struct dns_entry{
+    char *key;
+    char *host, *port;
+    int state;
+    time_t expires;
+    dns_result result;
+    dns_waiter *waiters;
+    struct dns_entry *next;     //bucket chain
+    struct dns_entry *qnext;    //resolver queue
+    struct dns_entry *lru_prev, *lru_next;   //recency list
+};
+
+static struct dns_entry *buckets[DNS_NBUCKETS];
+//recency list, lru.lru_next is the most recently used entry and
+//lru.lru_prev the least
+static struct dns_entry lru = { .lru_prev = &lru, .lru_next = &lru };
+static size_t nentries;
+static struct dns_entry *queue_head, *queue_tail;
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+//counters, updated under dns_lock
+static unsigned long lookups, hits, negative_hits, waits, resolved,
+                     failed, resolve_us, evicted;
+
+static unsigned long hash_name(const char *key)
+{
+    unsigned long h = 5381;
+    while(*key) h = h * 33 + (unsigned char)*key++;
+    return h;
+}
+
+static void lru_unlink(struct dns_entry *e)
+{
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void lru_push(struct dns_entry *e)
+{
+    e->lru_next = lru.lru_next;
+    e->lru_prev = &lru;
+    lru.lru_next->lru_prev = e;
+    lru.lru_next = e;
+}
+
+//the entry for key, NULL if there is none. *slot is set to the bucket
+//it hangs in or would go in. dns_lock held
+static struct dns_entry *lookup_entry(char *key, struct dns_entry ***slot)
+{
+    struct dns_entry *e;
+
+    *slot = &buckets[hash_name(key) % DNS_NBUCKETS];
+    for(e = **slot; e != NULL; e = e->next)
+        if(strcmp(e->key, key) == 0) return e;
+    return NULL;
+}
+
+//drop the least recently used entry no lookup is pending for or
+//waiting on. returns 0 if every entry is in use. dns_lock held
+static int evict_entry(void)
+{
+    struct dns_entry *e, **slot;
+
+    for(e = lru.lru_prev; e != &lru; e = e->lru_prev)
+        if(e->state == ENTRY_READY && e->waiters == NULL) break;
+    if(e == &lru) return 0;
+    slot = &buckets[hash_name(e->key) % DNS_NBUCKETS];
+    while(*slot != e) slot = &(*slot)->next;
+    *slot = e->next;
+    lru_unlink(e);
+    nentries--;
+    evicted++;
+    Free(e->key);
+    Free(e->host);
+    Free(e->port);
+    Free(e);
+    return 1;
+}
+
+//find or create the entry for host:port, NULL if the table is full of
+//names being looked up. dns_lock held
+static struct dns_entry *find_entry(char *host, char *port)
+{
+    char key[MAXLINE];
+    struct dns_entry **slot, *e;
+
+    snprintf(key, MAXLINE, "%s:%s", host, port);
+    if((e = lookup_entry(key, &slot)) != NULL)
+    {
+        lru_unlink(e);
+        lru_push(e);
+        return e;
+    }
+    if(nentries >= DNS_MAX_ENTRIES && !evict_entry()) return NULL;
+    e = Calloc(1, sizeof(struct dns_entry));
+    e->key = Malloc(strlen(key) + 1);
+    strcpy(e->key, key);
+    e->host = Malloc(strlen(host) + 1);
+    strcpy(e->host, host);
+    e->port = Malloc(strlen(port) + 1);
+    strcpy(e->port, port);
+    e->state = ENTRY_READY;
+    e->expires = 0;
+    e->next = *slot;
+    *slot = e;
+    lru_push(e);
+    nentries++;
+    return e;
+}
+
+//copy the answer, taking addresses alternately from each family in
+//the order getaddrinfo preferred them
+static void fill_result(dns_result *res, struct addrinfo *list)
+{
+    struct addrinfo *all[DNS_MAX_ADDRS], *p;
+    int used[DNS_MAX_ADDRS] = { 0 };
+    int n = 0, i, family;
+
+    for(p = list; p != NULL && n < DNS_MAX_ADDRS; p = p->ai_next)
+        all[n++] = p;
+    family = n > 0 ? all[0]->ai_family : 0;
+    for(res->n = 0; res->n < n; res->n++)
+    {
+        //first unused address of the wanted family, or of any
+        for(i = 0; i < n && (used[i] || all[i]->ai_family != family); i++)
+            ;
+        if(i == n)
+            for(i = 0; used[i]; i++)
+                ;
+        used[i] = 1;
+        p = all[i];
+        res->addr[res->n].family = p->ai_family;
+        res->addr[res->n].socktype = p->ai_socktype;
+        res->addr[res->n].protocol = p->ai_protocol;
+        res->addr[res->n].len = p->ai_addrlen;
+        memcpy(&res->addr[res->n].sa, p->ai_addr, p->ai_addrlen);
+        family = (p->ai_family == AF_INET6) ? AF_INET : AF_INET6;
+    }
+}
+
+static void *resolver(void *vargp)
+{
+    struct dns_entry *e;
+    struct addrinfo hints, *list;
+    struct timeval start, end;
+    dns_result res;
+    dns_waiter *w, *next;
+    int rc;
+
+    Pthread_detach(pthread_self());
+    while(1)
+    {
+        pthread_mutex_lock(&dns_lock);
+        while(queue_head == NULL) pthread_cond_wait(&queue_cond, &dns_lock);
+        e = queue_head;
+        if((queue_head = e->qnext) == NULL) queue_tail = NULL;
+        pthread_mutex_unlock(&dns_lock);
+
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+        gettimeofday(&start, NULL);
+        rc = getaddrinfo(e->host, e->port, &hints, &list);
+        gettimeofday(&end, NULL);
+        res.err = rc;
+        res.n = 0;
+        if(rc == 0)
+        {
+            fill_result(&res, list);
+            freeaddrinfo(list);
+        }
+
+        pthread_mutex_lock(&dns_lock);
+        e->result = res;
+        e->state = ENTRY_READY;
+        e->expires = time(NULL) + (rc == 0 ? DNS_TTL : DNS_NEGATIVE_TTL);
+        w = e->waiters;
+        e->waiters = NULL;
+        resolved++;
+        if(rc != 0) failed++;
+        resolve_us += (end.tv_sec - start.tv_sec) * 1000000L +
+                      (end.tv_usec - start.tv_usec);
+        pthread_mutex_unlock(&dns_lock);
+
+        //once off the list a waiter can no longer be cancelled
+        for(; w != NULL; w = next)
+        {
+            next = w->next;
+            w->result = res;
+            w->done(w);
+        }
+    }
+    return NULL;
+}
+
+void dns_init(void)
+{
+    pthread_t tid;
+    int i;
+    for(i = 0; i < DNS_THREADS; i++)
+        Pthread_create(&tid, NULL, resolver, NULL);
+}
+
+//look up host:port for w. returns 1 if the answer was cached and is in
+//w->result already, 0 if w->done will be called with it later
+int dns_resolve_async(char *host, char *port, dns_waiter *w)
+{
+    struct dns_entry *e;
+
+    pthread_mutex_lock(&dns_lock);
+    lookups++;
+    if((e = find_entry(host, port)) == NULL)
+    {
+        //answered right away as a temporary failure
+        w->result.err = EAI_AGAIN;
+        w->result.n = 0;
+        pthread_mutex_unlock(&dns_lock);
+        return 1;
+    }
+    if(e->state == ENTRY_READY && time(NULL) < e->expires)
+    {
+        hits++;
+        if(e->result.err != 0) negative_hits++;
+        w->result = e->result;
+        pthread_mutex_unlock(&dns_lock);
+        return 1;
+    }
+    waits++;
+    w->next = e->waiters;
+    e->waiters = w;
+    if(e->state == ENTRY_READY)
+    {
+        //expired or never looked up: queue it once
+        e->state = ENTRY_PENDING;
+        e->qnext = NULL;
+        if(queue_tail != NULL) queue_tail->qnext = e;
+        else queue_head = e;
+        queue_tail = e;
+        pthread_cond_signal(&queue_cond);
+    }
+    pthread_mutex_unlock(&dns_lock);
+    return 0;
+}
+
+//stop waiting for a lookup. returns 1 if w was removed before its done
+//callback was called, 0 if the callback has been or is being called
+int dns_cancel(char *host, char *port, dns_waiter *w)
+{
+    char key[MAXLINE];
+    struct dns_entry **slot, *e;
+    dns_waiter **pp;
+    int found = 0;
+
+    snprintf(key, MAXLINE, "%s:%s", host, port);
+    pthread_mutex_lock(&dns_lock);
+    //an entry that is gone had no waiters left, w's callback has run
+    if((e = lookup_entry(key, &slot)) == NULL)
+    {
+        pthread_mutex_unlock(&dns_lock);
+        return 0;
+    }
+    for(pp = &e->waiters; *pp != NULL; pp = &(*pp)->next)
+    {
+        if(*pp == w)
+        {
+            *pp = w->next;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dns_lock);
+    return found;
+}
+
+//blocking lookups wait on a condition variable
+struct sync_waiter{
+    dns_waiter w;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+};
+
+static void sync_done(dns_waiter *w)
+{
+    struct sync_waiter *sw = (struct sync_waiter *)w;
+    pthread_mutex_lock(&sw->lock);
+    sw->done = 1;
+    pthread_cond_signal(&sw->cond);
+    pthread_mutex_unlock(&sw->lock);
+}
+
+//look up host:port, waiting for the answer if it isn't cached.
+//returns the getaddrinfo error code, 0 on success
+int dns_resolve(char *host, char *port, dns_result *res)
+{
+    struct sync_waiter sw;
+
+    sw.w.done = sync_done;
+    sw.done = 0;
+    pthread_mutex_init(&sw.lock, NULL);
+    pthread_cond_init(&sw.cond, NULL);
+    if(!dns_resolve_async(host, port, &sw.w))
+    {
+        pthread_mutex_lock(&sw.lock);
+        while(!sw.done) pthread_cond_wait(&sw.cond, &sw.lock);
+        pthread_mutex_unlock(&sw.lock);
+    }
+    pthread_mutex_destroy(&sw.lock);
+    pthread_cond_destroy(&sw.cond);
+    *res = sw.w.result;
+    return res->err;
+}
+
+//start a non-blocking connect to a, -1 if it failed right away
+static int start_connect(dns_addr *a)
+{
+    int fd = socket(a->family, a->socktype | SOCK_NONBLOCK, a->protocol);
+    if(fd < 0) return -1;
+    if(connect(fd, (SA *)&a->sa, a->len) == 0 || errno == EINPROGRESS)
+        return fd;
+    close(fd);
+    return -1;
+}
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+//a blocking connection to host:port, -1 if none of its addresses can
+//be reached within DNS_CONNECT_TIMEOUT. a new attempt starts whenever
+//DNS_ATTEMPT_DELAY passes without one finishing or as soon as one
+//fails, and the first attempt to connect wins
+int dns_connect(char *host, char *port)
+{
+    dns_result res;
+    struct pollfd pfd[DNS_MAX_ADDRS];
+    int nfd = 0, next = 0, fd = -1, i, err, n, wait;
+    long deadline;
+    socklen_t len;
+
+    if(dns_resolve(host, port, &res) != 0)
+    {
+        fprintf(stderr, "can't resolve %s: %s\n", host,
+                gai_strerror(res.err));
+        return -1;
+    }
+    deadline = now_ms() + DNS_CONNECT_TIMEOUT * 1000L;
+    while(fd < 0 && (next < res.n || nfd > 0))
+    {
+        if(next < res.n &&
+           (pfd[nfd].fd = start_connect(&res.addr[next++])) >= 0)
+            pfd[nfd++].events = POLLOUT;
+        if(nfd == 0) continue;
+        if((wait = deadline - now_ms()) <= 0)
+        {
+            errno = ETIMEDOUT;
+            break;
+        }
+        if(next < res.n && wait > DNS_ATTEMPT_DELAY) wait = DNS_ATTEMPT_DELAY;
+        if((n = poll(pfd, nfd, wait)) < 0)
+        {
+            if(errno == EINTR) continue;
+            break;
+        }
+        for(i = 0; i < nfd && n > 0; i++)
+        {
+            if(pfd[i].revents == 0) continue;
+            n--;
+            len = sizeof(err);
+            if(getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 &&
+               err == 0)
+            {
+                fd = pfd[i].fd;
+                pfd[i] = pfd[--nfd];
+                break;
+            }
+            close(pfd[i].fd);
+            pfd[i--] = pfd[--nfd];
+        }
+    }
+    //the attempts that lost
+    for(i = 0; i < nfd; i++) close(pfd[i].fd);
+    if(fd >= 0) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    return fd;
+}
+
+void dns_report(FILE *fp)
+{
+    pthread_mutex_lock(&dns_lock);
+    fprintf(fp, "dns: %lu/%lu lookups cached (%lu negative), %lu waited, "
+            "%lu resolved (%lu failed), %.1f ms per resolve, "
+            "%lu names (%lu evicted)\n",
+            hits, lookups, negative_hits, waits, resolved, failed,
+            resolved ? resolve_us / 1000.0 / resolved : 0.0,
+            (unsigned long)nentries, evicted);
+    pthread_mutex_unlock(&dns_lock);
+}
@@ -0,0 +1,53 @@
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "csapp.h"
+
+//addresses kept per name
+#define DNS_MAX_ADDRS 8
+//getaddrinfo doesn't report record TTLs, so answers are kept this many
+//seconds and failures this many
+#define DNS_TTL 60
+#define DNS_NEGATIVE_TTL 5
+//resolver threads doing the blocking lookups
+#define DNS_THREADS 4
+#define DNS_NBUCKETS 256
+//names cached at most. the least recently used one that no lookup is
+//waiting on makes room for a new name
+#define DNS_MAX_ENTRIES 4096
+//happy eyeballs: milliseconds before the next address is tried in
+//parallel with the ones still connecting
+#define DNS_ATTEMPT_DELAY 250
+//seconds dns_connect waits for any attempt to connect
+#define DNS_CONNECT_TIMEOUT 30
+
+typedef struct {
+    int family, socktype, protocol;
+    socklen_t len;
+    struct sockaddr_storage sa;
+} dns_addr;
+
+//outcome of a lookup. addresses alternate between families in the
+//order they should be tried
+typedef struct {
+    int err;                    //getaddrinfo error code, 0 on success
+    int n;
+    dns_addr addr[DNS_MAX_ADDRS];
+} dns_result;
+
+//a caller waiting for a lookup. done is called from a resolver thread
+//once result is filled in
+typedef struct dns_waiter {
+    void (*done)(struct dns_waiter *w);
+    dns_result result;
+    struct dns_waiter *next;
+} dns_waiter;
+
+void dns_init(void);
+int dns_resolve_async(char *host, char *port, dns_waiter *w);
+int dns_cancel(char *host, char *port, dns_waiter *w);
+int dns_resolve(char *host, char *port, dns_result *res);
+int dns_connect(char *host, char *port);
+void dns_report(FILE *fp);
+
+#endif /* __DNS_H__ */
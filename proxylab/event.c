@@ -0,0 +1,924 @@
+/*event-driven front end for the proxy.
+ * A fixed number of event loop threads each own an epoll instance and
+ * share the non-blocking listening socket. Every connection is a small
+ * state machine driven by readiness events on its client and server
+ * sockets:
+ *   READ_REQUEST -> SEND_HIT                          (cache hit)
+ *   READ_REQUEST -> SEND_LOCAL                        (statistics page)
+ *   READ_REQUEST -> RESOLVING -> CONNECTING -> SEND_REQUEST -> RELAY
+ *                                                     (cache miss)
+ *   READ_REQUEST -> RESOLVING -> CONNECTING -> TUNNEL (CONNECT)
+ * and a cacheable miss is inserted into the cache once the server
+ * closes. A tunnel watches both sockets for whichever of its two
+ * halves (tunnel.c) waits on them. Names are looked up by the resolver
+ * threads of dns.c, which hand finished lookups back to the loop
+ * through an eventfd, and the connection races attempts to the
+ * server's addresses (happy eyeballs) with a timerfd starting the next
+ * one.
+ * Every loop keeps a list of its live connections and sweeps it once a
+ * second: a client that hasn't sent its whole request head within
+ * HTTP_HEAD_TIMEOUT of connecting, or a connection on which nothing
+ * moved for EVENT_IDLE_TIMEOUT, TUNNEL_IDLE_TIMEOUT for a tunnel, is
+ * closed, so slow peers can't pile up.*/
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <netinet/tcp.h>
+#include "proxy.h"
+#include "event.h"
+#include "dns.h"
+#include "stats.h"
+#include "upstream.h"
+#include "gzip.h"
+#include "tunnel.h"
+
+#define MAX_EVENTS 64
+//seconds a connection may go without any progress once its request
+//has been read
+#define EVENT_IDLE_TIMEOUT 30
+
+enum conn_state{
+    READ_REQUEST,
+    SEND_HIT,
+    RESOLVING,
+    CONNECTING,
+    SEND_REQUEST,
+    RELAY,
+    SEND_LOCAL,                 //a page the proxy answers itself
+    TUNNEL                      //CONNECT, bytes relayed both ways
+};
+
+struct conn;
+struct loop;
+
+//one per socket of a connection, registered as the epoll user data
+struct handle{
+    int fd;
+    int registered;
+    uint32_t events;
+    struct conn *conn;
+};
+
+struct conn{
+    enum conn_state state;
+    int closed;
+    struct loop *lp;
+    struct handle client, server;
+    struct conn *next_free;
+    //the loop's live connections, for the timeout sweep
+    struct conn *live_prev, *live_next;
+    time_t accepted, last_active;
+    int admitted;               //holds one of the origin's fetch slots
+    //request bytes read so far and the head parsed in place in them
+    char req[MAXLINE];
+    size_t req_len;
+    http_request request;
+    char *key;                  //normalized uri, the cache key
+    stats_req sr;
+    size_t sent;                //response bytes written to the client
+    //name lookup, then connection attempts to its addresses. race is
+    //the second attempt in flight and timer starts the next one
+    dns_waiter waiter;
+    int resolving;
+    struct conn *next_resolved;
+    int next_addr;
+    struct handle race, timer;
+    //outgoing request, pointing into req, out_i is the first iovec
+    //not fully written yet
+    struct iovec out[HTTP_REQUEST_IOV];
+    int out_n, out_i;
+    //response bytes on their way to the client
+    char buf[MAXBUF];
+    size_t buf_len, buf_off;
+    //cache hit being sent, from memory or from the disk tier
+    cache_block *hit;
+    disk_entry *disk_hit;
+    size_t hit_off;
+    //copy of the response for the cache, dropped once it gets too big
+    cache_fill fill;
+    //a CONNECT: client to server and server to client once connected
+    int tunnel;
+    tunnel_half up, down;
+};
+
+struct loop{
+    int epfd;
+    int listenfd;
+    struct handle listener;
+    //connections closed during the current batch of events, freed
+    //once the batch is done since later events may still point at them
+    struct conn *to_free;
+    //connections whose lookup finished, signalled on resolver's eventfd
+    struct handle resolver;
+    pthread_mutex_t resolved_lock;
+    struct conn *resolved;
+    //live connections and the once a second timer that sweeps them
+    struct conn *live;
+    struct handle sweep;
+    time_t now;
+};
+
+static void try_connect(struct loop *lp, struct conn *c);
+static void send_local(struct loop *lp, struct conn *c);
+static void start_tunnel(struct loop *lp, struct conn *c);
+
+//make fd's epoll registration match events, 0 removes it
+static int set_interest(struct loop *lp, struct handle *h, uint32_t events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if(h->registered && h->events == events) return 0;
+    ev.events = events;
+    ev.data.ptr = h;
+    if(events == 0)
+    {
+        if(!h->registered) return 0;
+        op = EPOLL_CTL_DEL;
+    }
+    else op = h->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+    if(epoll_ctl(lp->epfd, op, h->fd, &ev) < 0) return -1;
+    h->registered = (events != 0);
+    h->events = events;
+    return 0;
+}
+
+static struct conn *conn_new(struct loop *lp, int connfd)
+{
+    struct conn *c = Calloc(1, sizeof(struct conn));
+    c->state = READ_REQUEST;
+    c->lp = lp;
+    c->client.fd = connfd;
+    c->client.conn = c;
+    c->server.fd = -1;
+    c->server.conn = c;
+    c->race.fd = -1;
+    c->race.conn = c;
+    c->timer.fd = -1;
+    c->timer.conn = c;
+    c->accepted = c->last_active = lp->now;
+    http_request_init(&c->request);
+    cache_fill_init(&c->fill);
+    if((c->live_next = lp->live) != NULL) lp->live->live_prev = c;
+    lp->live = c;
+    return c;
+}
+
+//how the request went, for the statistics
+static void conn_done(struct conn *c)
+{
+    switch(c->state)
+    {
+    case SEND_HIT:
+        stats_done(&c->sr, c->hit ? STATS_HITS : STATS_DISK_HITS, c->sent);
+        break;
+    case RELAY:
+        stats_done(&c->sr, STATS_MISSES, c->sent);
+        break;
+    case RESOLVING:
+    case CONNECTING:
+    case SEND_REQUEST:
+        stats_count(STATS_UPSTREAM_FAILURES, 1);
+        //a tunnel is not a request the cache could have answered
+        if(!c->tunnel) stats_done(&c->sr, STATS_FAILED, 0);
+        break;
+    case TUNNEL:
+        stats_count(STATS_BYTES_TUNNELED, c->up.moved + c->down.moved);
+        break;
+    default:
+        break;
+    }
+}
+
+//closing the sockets also drops their epoll registrations
+static void conn_close(struct loop *lp, struct conn *c)
+{
+    if(c->closed) return;
+    c->closed = 1;
+    conn_done(c);
+    if(c->live_prev != NULL) c->live_prev->live_next = c->live_next;
+    else lp->live = c->live_next;
+    if(c->live_next != NULL) c->live_next->live_prev = c->live_prev;
+    if(c->admitted) upstream_leave(c->request.hostname, c->request.port);
+    close(c->client.fd);
+    if(c->server.fd >= 0) close(c->server.fd);
+    if(c->race.fd >= 0) close(c->race.fd);
+    if(c->timer.fd >= 0) close(c->timer.fd);
+    if(c->hit != NULL) cache_release(c->hit);
+    if(c->disk_hit != NULL) disk_release(cache.disk, c->disk_hit);
+    if(c->state == TUNNEL)
+    {
+        tunnel_half_free(&c->up);
+        tunnel_half_free(&c->down);
+    }
+    //a lookup that can't be called off anymore still hands the
+    //connection back to the loop, which frees it then
+    if(c->resolving && !dns_cancel(c->request.hostname, c->request.port,
+                                   &c->waiter))
+        return;
+    c->next_free = lp->to_free;
+    lp->to_free = c;
+}
+
+static void conn_free_closed(struct loop *lp)
+{
+    struct conn *c;
+    while((c = lp->to_free) != NULL)
+    {
+        lp->to_free = c->next_free;
+        cache_fill_abandon(&c->fill);
+        free(c->key);
+        free(c);
+    }
+}
+
+//write as much of a hit as the socket takes. one from memory goes out
+//through out like a request, its rewritten header lines in buf
+static void send_hit(struct loop *lp, struct conn *c)
+{
+    ssize_t n;
+    stats_first_byte(&c->sr);
+    if(c->hit != NULL && c->out_n == 0)
+    {
+        c->out_n = hit_iov(c->out, c->buf, c->hit, 0);
+        c->out_i = 0;
+    }
+    while(c->hit != NULL ? c->out_i < c->out_n :
+          c->hit_off < c->disk_hit->size)
+    {
+        if(c->hit != NULL)
+        {
+            n = writev(c->client.fd, c->out + c->out_i,
+                       c->out_n - c->out_i);
+            if(n > 0)
+            {
+                c->hit_off += n;
+                c->out_i = http_iov_advance(c->out, c->out_i, c->out_n, n);
+            }
+        }
+        else n = disk_send(cache.disk, c->disk_hit, c->client.fd,
+                           &c->hit_off);
+        if(n < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                set_interest(lp, &c->client, EPOLLOUT);
+                return;
+            }
+            if(errno == EINTR) continue;
+            break;
+        }
+        if(n == 0) break;
+    }
+    c->sent = c->hit_off;
+    conn_close(lp, c);
+}
+
+//runs on a resolver thread: queue the connection for its loop
+static void conn_resolved(dns_waiter *w)
+{
+    struct conn *c = (struct conn *)((char *)w - offsetof(struct conn, waiter));
+    struct loop *lp = c->lp;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&lp->resolved_lock);
+    c->next_resolved = lp->resolved;
+    lp->resolved = c;
+    pthread_mutex_unlock(&lp->resolved_lock);
+    if(write(lp->resolver.fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        unix_error("eventfd write error");
+}
+
+//the server can't be reached: the client gets a 502 before its
+//connection is closed, as it would from the other front ends
+static void bad_gateway(struct loop *lp, struct conn *c)
+{
+    client_error(c->client.fd, "502 Bad Gateway",
+                 "The proxy could not reach the server");
+    conn_close(lp, c);
+}
+
+//the server's addresses are known, start connecting
+static void resolved(struct loop *lp, struct conn *c)
+{
+    if(c->waiter.result.err != 0)
+    {
+        fprintf(stderr, "can't resolve %s: %s\n", c->request.hostname,
+                gai_strerror(c->waiter.result.err));
+        bad_gateway(lp, c);
+        return;
+    }
+    c->next_addr = 0;
+    try_connect(lp, c);
+}
+
+//pick up the lookups the resolver threads finished
+static void finish_resolves(struct loop *lp)
+{
+    struct conn *c, *next;
+    uint64_t n;
+
+    if(read(lp->resolver.fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        unix_error("eventfd read error");
+    pthread_mutex_lock(&lp->resolved_lock);
+    c = lp->resolved;
+    lp->resolved = NULL;
+    pthread_mutex_unlock(&lp->resolved_lock);
+    for(; c != NULL; c = next)
+    {
+        next = c->next_resolved;
+        c->resolving = 0;
+        if(c->closed)
+        {
+            c->next_free = lp->to_free;
+            lp->to_free = c;
+        }
+        else resolved(lp, c);
+    }
+}
+
+//look up the server's name, connecting starts once it is known
+static void resolve(struct loop *lp, struct conn *c)
+{
+    c->waiter.done = conn_resolved;
+    c->state = RESOLVING;
+    if(dns_resolve_async(c->request.hostname, c->request.port, &c->waiter))
+        resolved(lp, c);
+    else c->resolving = 1;
+}
+
+//request has been read: answer from the cache or start the miss
+static void start_request(struct loop *lp, struct conn *c)
+{
+    http_request *req = &c->request;
+    char key_buf[CACHE_KEY_LEN], variant_buf[CACHE_KEY_LEN];
+    cache_key key, variant, *k = &key;
+    int json, gzip;
+
+    set_interest(lp, &c->client, 0);
+    stats_start(&c->sr);
+    if(stats_request(req, &json))
+    {
+        c->buf_len = stats_response(c->buf, sizeof(c->buf), &cache, json);
+        c->buf_off = 0;
+        c->state = SEND_LOCAL;
+        send_local(lp, c);
+        return;
+    }
+    //a tunnel skips the cache and the origin's fetch slots, it isn't
+    //a fetch and may stay open for as long as the client likes
+    if(req->connect)
+    {
+        c->tunnel = 1;
+        resolve(lp, c);
+        return;
+    }
+    if(strcmp(req->method.p, "GET") != 0 || req->hostname[0] == '\0')
+    {
+        stats_count(STATS_BAD_REQUESTS, 1);
+        if(req->hostname[0] == '\0')
+            client_error(c->client.fd, "400 Bad Request",
+                         "The proxy only takes absolute http:// URIs");
+        else client_error(c->client.fd, "501 Not Implemented",
+                          "The proxy only forwards GET requests");
+        conn_close(lp, c);
+        return;
+    }
+    if(!request_key(req, &key, key_buf))
+    {
+        stats_count(STATS_BAD_REQUESTS, 1);
+        client_error(c->client.fd, "414 URI Too Long", "The URI is too long");
+        conn_close(lp, c);
+        return;
+    }
+    c->key = Malloc(key.len + 1);
+    memcpy(c->key, key.str, key.len + 1);
+
+    //stale copies are fetched again, only the threaded front ends
+    //revalidate them
+    if((c->hit = lookup(&k, &variant, variant_buf, req)) != NULL &&
+       !cache_fresh(c->hit))
+    {
+        cache_release(c->hit);
+        c->hit = NULL;
+    }
+    //a client that doesn't take gzip gets text inflated, or fetched
+    //again from the disk tier's copy
+    gzip = http_accepts_gzip(req);
+    if(c->hit != NULL) c->hit = gzip_for_client(&cache, k, c->hit, gzip);
+    else if(cache.disk != NULL &&
+            (c->disk_hit = disk_inquiry(cache.disk, k->str)) != NULL &&
+            c->disk_hit->gzip && !gzip)
+    {
+        disk_release(cache.disk, c->disk_hit);
+        c->disk_hit = NULL;
+    }
+    if(c->hit != NULL || c->disk_hit != NULL)
+    {
+        c->state = SEND_HIT;
+        send_hit(lp, c);
+        return;
+    }
+
+    //the origin already has as many fetches going as it may
+    if(!upstream_admit(req->hostname, req->port))
+    {
+        stats_count(STATS_UPSTREAM_FAILURES, 1);
+        client_error(c->client.fd, "503 Service Unavailable",
+                     "The server is too busy, try again later");
+        conn_close(lp, c);
+        return;
+    }
+    c->admitted = 1;
+
+    //responses are delimited by the server closing the connection
+    c->out_n = build_request(c->out, req, 0, NULL);
+    c->out_i = 0;
+    resolve(lp, c);
+}
+
+static void read_request(struct loop *lp, struct conn *c)
+{
+    ssize_t n;
+    int rc;
+    while(1)
+    {
+        //a head that doesn't fit the buffer is refused
+        if(c->req_len == sizeof(c->req))
+        {
+            client_error(c->client.fd, "431 Request Header Fields Too Large",
+                         "The request head is too large");
+            conn_close(lp, c);
+            return;
+        }
+        n = read(c->client.fd, c->req + c->req_len,
+                 sizeof(c->req) - c->req_len);
+        if(n < 0)
+        {
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) conn_close(lp, c);
+            return;
+        }
+        if(n == 0)
+        {
+            conn_close(lp, c);
+            return;
+        }
+        c->req_len += n;
+        //only the new bytes are scanned
+        if((rc = http_parse_request(&c->request, c->req, c->req_len)) < 0)
+        {
+            stats_count(STATS_BAD_REQUESTS, 1);
+            client_error(c->client.fd, "400 Bad Request",
+                         "The proxy could not parse the request");
+            conn_close(lp, c);
+            return;
+        }
+        if(rc > 0)
+        {
+            start_request(lp, c);
+            return;
+        }
+    }
+}
+
+//flush buffered response bytes to fd.
+//returns 1 once the buffer is empty, 0 if fd would block, -1 on error
+static int flush_buf(struct conn *c, int fd)
+{
+    ssize_t n;
+    while(c->buf_off < c->buf_len)
+    {
+        n = write(fd, c->buf + c->buf_off, c->buf_len - c->buf_off);
+        if(n < 0)
+        {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        c->buf_off += n;
+        c->sent += n;
+    }
+    c->buf_off = c->buf_len = 0;
+    return 1;
+}
+
+//write the request with as few writev calls as the socket allows
+static void send_request(struct loop *lp, struct conn *c)
+{
+    ssize_t n;
+    int one = 1;
+    while(c->out_i < c->out_n)
+    {
+        n = writev(c->server.fd, c->out + c->out_i, c->out_n - c->out_i);
+        if(n < 0)
+        {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                set_interest(lp, &c->server, EPOLLOUT);
+            else conn_close(lp, c);
+            return;
+        }
+        c->out_i = http_iov_advance(c->out, c->out_i, c->out_n, n);
+    }
+    c->state = RELAY;
+    //the response is relayed a buffer at a time, corked the client
+    //socket sends only full segments until it is closed
+    setsockopt(c->client.fd, IPPROTO_TCP, TCP_CORK, &one, sizeof(one));
+    set_interest(lp, &c->server, EPOLLIN);
+}
+
+//write out a response the proxy made itself, then close
+static void send_local(struct loop *lp, struct conn *c)
+{
+    int rc = flush_buf(c, c->client.fd);
+    if(rc == 0)
+    {
+        set_interest(lp, &c->client, EPOLLOUT);
+        return;
+    }
+    conn_close(lp, c);
+}
+
+//start a non-blocking connect on h to the next address that takes
+//one. returns 0 if no address is left
+static int start_attempt(struct loop *lp, struct conn *c, struct handle *h)
+{
+    dns_addr *a;
+    int fd;
+
+    while(c->next_addr < c->waiter.result.n)
+    {
+        a = &c->waiter.result.addr[c->next_addr++];
+        fd = socket(a->family, a->socktype | SOCK_NONBLOCK, a->protocol);
+        if(fd < 0) continue;
+        h->fd = fd;
+        h->registered = 0;
+        //a connect that completes at once is reported writable as well
+        if((connect(fd, (SA *)&a->sa, a->len) == 0 || errno == EINPROGRESS) &&
+           set_interest(lp, h, EPOLLOUT) == 0)
+            return 1;
+        close(fd);
+        h->fd = -1;
+    }
+    return 0;
+}
+
+static void drop_handle(struct handle *h)
+{
+    if(h->fd >= 0) close(h->fd);
+    h->fd = -1;
+    h->registered = 0;
+}
+
+//give the next address its own attempt if none finishes within
+//DNS_ATTEMPT_DELAY
+static void arm_timer(struct loop *lp, struct conn *c)
+{
+    struct itimerspec its;
+
+    if(c->next_addr >= c->waiter.result.n) return;
+    if(c->timer.fd < 0)
+    {
+        if((c->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+            return;
+        c->timer.registered = 0;
+        if(set_interest(lp, &c->timer, EPOLLIN) < 0)
+        {
+            drop_handle(&c->timer);
+            return;
+        }
+    }
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_nsec = DNS_ATTEMPT_DELAY * 1000000L;
+    timerfd_settime(c->timer.fd, 0, &its, NULL);
+}
+
+static void try_connect(struct loop *lp, struct conn *c)
+{
+    c->state = CONNECTING;
+    if(!start_attempt(lp, c, &c->server))
+    {
+        bad_gateway(lp, c);
+        return;
+    }
+    arm_timer(lp, c);
+}
+
+//the delay passed without an attempt finishing: race the next address
+//if a handle is free. with both busy the next one starts as soon as an
+//attempt fails
+static void next_attempt(struct loop *lp, struct conn *c)
+{
+    uint64_t n;
+
+    if(read(c->timer.fd, &n, sizeof(n)) < 0) return;
+    if(c->race.fd < 0 && start_attempt(lp, c, &c->race)) arm_timer(lp, c);
+}
+
+static void finish_connect(struct loop *lp, struct conn *c, struct handle *h)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    getsockopt(h->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if(err != 0)
+    {
+        //a failed attempt is replaced right away
+        drop_handle(h);
+        if(!start_attempt(lp, c, h) && c->server.fd < 0 && c->race.fd < 0)
+            bad_gateway(lp, c);
+        return;
+    }
+    //the first attempt to connect wins, the other one and the timer go
+    if(h == &c->race)
+    {
+        drop_handle(&c->server);
+        set_interest(lp, &c->race, 0);
+        c->server.fd = c->race.fd;
+        c->race.fd = -1;
+        c->race.registered = 0;
+    }
+    drop_handle(&c->race);
+    drop_handle(&c->timer);
+    if(c->tunnel)
+    {
+        start_tunnel(lp, c);
+        return;
+    }
+    c->state = SEND_REQUEST;
+    send_request(lp, c);
+}
+
+//move response bytes from the server to the client. only one side is
+//watched at a time: the server while the buffer is empty, the client
+//while it still holds bytes
+static void relay(struct loop *lp, struct conn *c)
+{
+    http_response resp;
+    cache_key key;
+    ssize_t n, head_len;
+    int rc;
+
+    while(1)
+    {
+        if((rc = flush_buf(c, c->client.fd)) < 0)
+        {
+            conn_close(lp, c);
+            return;
+        }
+        if(rc == 0)
+        {
+            set_interest(lp, &c->server, 0);
+            set_interest(lp, &c->client, EPOLLOUT);
+            return;
+        }
+        set_interest(lp, &c->client, 0);
+
+        n = read(c->server.fd, c->buf, sizeof(c->buf));
+        if(n < 0)
+        {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                set_interest(lp, &c->server, EPOLLIN);
+            else
+                conn_close(lp, c);
+            return;
+        }
+        if(n == 0)
+        {
+            //response relayed, add it to the cache if its head allows
+            //that and the server didn't close before the body's end
+            if(c->fill.ok && c->fill.len > 0 &&
+               (head_len = http_parse_response_head(c->fill.buf,
+                                                    c->fill.len,
+                                                    &resp)) > 0 &&
+               http_cacheable(&resp) &&
+               http_body_complete(c->fill.buf, c->fill.len, head_len,
+                                  &resp))
+            {
+                cache_key_init(&key, c->key);
+                store(&key, &c->request, &c->fill, &resp);
+            }
+            else cache_fill_abandon(&c->fill);
+            conn_close(lp, c);
+            return;
+        }
+        stats_first_byte(&c->sr);
+        cache_fill_append(&c->fill, c->buf, n);
+        c->buf_len = n;
+        c->buf_off = 0;
+    }
+}
+
+//register h for what the tunnel's halves wait for on it
+static int tunnel_interest(struct loop *lp, struct conn *c, struct handle *h)
+{
+    int w = tunnel_half_wants(&c->up, h->fd) |
+            tunnel_half_wants(&c->down, h->fd);
+
+    return set_interest(lp, h, (w & TUNNEL_WANT_READ ? EPOLLIN : 0) |
+                               (w & TUNNEL_WANT_WRITE ? EPOLLOUT : 0));
+}
+
+//move tunnel bytes on the halves that wait on h, on both when h is
+//NULL, then watch the sockets for what they wait on next
+static void tunnel(struct loop *lp, struct conn *c, struct handle *h)
+{
+    tunnel_half *half[2] = { &c->up, &c->down };
+    int i;
+
+    for(i = 0; i < 2; i++)
+    {
+        if(h != NULL && !tunnel_half_wants(half[i], h->fd)) continue;
+        if(tunnel_move(half[i]) < 0)
+        {
+            conn_close(lp, c);
+            return;
+        }
+    }
+    if((c->up.done && c->down.done) ||
+       tunnel_interest(lp, c, &c->client) < 0 ||
+       tunnel_interest(lp, c, &c->server) < 0)
+        conn_close(lp, c);
+}
+
+//the target is connected: the 200 goes to the client ahead of the
+//server's bytes, and whatever the client sent behind its request ahead
+//of its own
+static void start_tunnel(struct loop *lp, struct conn *c)
+{
+    c->state = TUNNEL;
+    stats_count(STATS_TUNNELS, 1);
+    tunnel_half_init(&c->up, c->client.fd, c->server.fd, use_splice);
+    tunnel_half_init(&c->down, c->server.fd, c->client.fd, use_splice);
+    tunnel_half_seed(&c->down, TUNNEL_ESTABLISHED,
+                     strlen(TUNNEL_ESTABLISHED));
+    tunnel_half_seed(&c->up, c->req + c->request.line,
+                     c->req_len - c->request.line);
+    tunnel(lp, c, NULL);
+}
+
+//close the connections that overran their deadline. one still in
+//the middle of a fetch gets a 504 while nothing has been sent yet
+static void sweep(struct loop *lp)
+{
+    struct conn *c, *next;
+    uint64_t n;
+
+    if(read(lp->sweep.fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        unix_error("timerfd read error");
+    for(c = lp->live; c != NULL; c = next)
+    {
+        next = c->live_next;
+        if(c->state == READ_REQUEST)
+        {
+            if(lp->now - c->accepted < HTTP_HEAD_TIMEOUT) continue;
+            if(c->req_len > 0)
+                client_error(c->client.fd, "408 Request Timeout",
+                             "The request head took too long");
+        }
+        else
+        {
+            if(lp->now - c->last_active < (c->state == TUNNEL ?
+                                           TUNNEL_IDLE_TIMEOUT :
+                                           EVENT_IDLE_TIMEOUT))
+                continue;
+            if(c->state == RESOLVING || c->state == CONNECTING ||
+               c->state == SEND_REQUEST)
+                client_error(c->client.fd, "504 Gateway Timeout",
+                             "The server did not answer in time");
+        }
+        conn_close(lp, c);
+    }
+}
+
+static void accept_clients(struct loop *lp)
+{
+    struct conn *c;
+    int connfd;
+
+    while((connfd = accept4(lp->listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+    {
+        c = conn_new(lp, connfd);
+        if(set_interest(lp, &c->client, EPOLLIN) < 0)
+            conn_close(lp, c);
+    }
+}
+
+//dispatch one readiness event to the connection's current state
+static void handle_event(struct loop *lp, struct handle *h, uint32_t events)
+{
+    struct conn *c = h->conn;
+
+    if(h == &lp->resolver)
+    {
+        finish_resolves(lp);
+        return;
+    }
+    if(h == &lp->sweep)
+    {
+        sweep(lp);
+        return;
+    }
+    if(c == NULL)
+    {
+        accept_clients(lp);
+        return;
+    }
+    //events still queued for a connection or attempt closed meanwhile
+    if(c->closed || h->fd < 0) return;
+    c->last_active = lp->now;
+
+    switch(c->state)
+    {
+    case READ_REQUEST:
+        read_request(lp, c);
+        break;
+    case SEND_HIT:
+        send_hit(lp, c);
+        break;
+    case RESOLVING:
+        break;
+    case CONNECTING:
+        if(h == &c->timer) next_attempt(lp, c);
+        else finish_connect(lp, c, h);
+        break;
+    case SEND_REQUEST:
+        send_request(lp, c);
+        break;
+    case RELAY:
+        relay(lp, c);
+        break;
+    case SEND_LOCAL:
+        send_local(lp, c);
+        break;
+    case TUNNEL:
+        tunnel(lp, c, h);
+        break;
+    }
+}
+
+static void *loop_thread(void *vargp)
+{
+    struct loop *lp = vargp;
+    struct epoll_event events[MAX_EVENTS];
+    int i, n;
+
+    while(1)
+    {
+        n = epoll_wait(lp->epfd, events, MAX_EVENTS, -1);
+        if(n < 0)
+        {
+            if(errno == EINTR) continue;
+            unix_error("epoll_wait error");
+        }
+        lp->now = time(NULL);
+        for(i = 0; i < n; i++)
+            handle_event(lp, events[i].data.ptr, events[i].events);
+        conn_free_closed(lp);
+    }
+    return NULL;
+}
+
+void event_serve(int listenfd, int nloops)
+{
+    struct loop *loops = Calloc(nloops, sizeof(struct loop));
+    struct itimerspec its = { { 1, 0 }, { 1, 0 } };
+    struct epoll_event ev;
+    pthread_t tid;
+    int i;
+
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    for(i = 0; i < nloops; i++)
+    {
+        if((loops[i].epfd = epoll_create1(0)) < 0)
+            unix_error("epoll_create1 error");
+        loops[i].listenfd = listenfd;
+        loops[i].listener.fd = listenfd;
+        loops[i].listener.conn = NULL;
+        //only one loop is woken per incoming connection
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = &loops[i].listener;
+        if(epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+            unix_error("epoll_ctl error");
+        if((loops[i].resolver.fd = eventfd(0, EFD_NONBLOCK)) < 0)
+            unix_error("eventfd error");
+        loops[i].resolver.conn = NULL;
+        pthread_mutex_init(&loops[i].resolved_lock, NULL);
+        if(set_interest(&loops[i], &loops[i].resolver, EPOLLIN) < 0)
+            unix_error("epoll_ctl error");
+        if((loops[i].sweep.fd = timerfd_create(CLOCK_MONOTONIC,
+                                               TFD_NONBLOCK)) < 0)
+            unix_error("timerfd_create error");
+        loops[i].sweep.conn = NULL;
+        timerfd_settime(loops[i].sweep.fd, 0, &its, NULL);
+        if(set_interest(&loops[i], &loops[i].sweep, EPOLLIN) < 0)
+            unix_error("epoll_ctl error");
+    }
+    for(i = 1; i < nloops; i++)
+        Pthread_create(&tid, NULL, loop_thread, &loops[i]);
+    loop_thread(&loops[0]);
+}
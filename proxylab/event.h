@@ -0,0 +1,9 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include "csapp.h"
+
+//serve listenfd with nloops epoll event loop threads, never returns
+void event_serve(int listenfd, int nloops);
+
+#endif /* __EVENT_H__ */
@@ -0,0 +1,167 @@
+/*gzip encoding of cached responses.
+ * Text is kept in the cache gzip encoded: a response the server sent
+ * unencoded is compressed before it is stored, so the same memory holds
+ * several times more of it. Clients that take gzip get the stored bytes
+ * as they are. For the others the body is inflated on their first hit
+ * and that copy is cached too, under the key with GZIP_IDENTITY_SUFFIX,
+ * so only objects that inflate beyond MAX_OBJECT_SIZE are inflated on
+ * every hit. The copy takes back the memory compression saved, so it is
+ * inserted expendable: it is evicted before anything else unless
+ * identity clients keep hitting it, and otherwise costs one inflate per
+ * time it is evicted. The two encodings carry different ETags.*/
+#include <zlib.h>
+#include "gzip.h"
+#include "http.h"
+
+//compress the body of the response in fill, whose head takes head_len
+//bytes with its blank line, and rewrite the head to say so. returns 1
+//if fill now holds the gzip encoded response, 0 if it is left as it
+//was because compressing didn't make it smaller
+int gzip_fill(cache_fill *fill, size_t head_len)
+{
+    size_t body_len = fill->len - head_len, cap, len, hlen;
+    z_stream zs;
+    char *buf;
+    int rc;
+
+    memset(&zs, 0, sizeof(zs));
+    //15 bits of window plus 16 asks for the gzip wrapper
+    if(deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0;
+    cap = deflateBound(&zs, body_len);
+    //the body is compressed past room for the new head, then moved down
+    buf = Malloc(MAXLINE + cap);
+    zs.next_in = (unsigned char *)fill->buf + head_len;
+    zs.avail_in = body_len;
+    zs.next_out = (unsigned char *)buf + MAXLINE;
+    zs.avail_out = cap;
+    rc = deflate(&zs, Z_FINISH);
+    len = zs.total_out;
+    deflateEnd(&zs);
+    if(rc != Z_STREAM_END || len >= body_len ||
+       (hlen = http_encoded_head(buf, MAXLINE, fill->buf, head_len, 1,
+                                 len)) == 0)
+    {
+        Free(buf);
+        return 0;
+    }
+    memmove(buf + hlen, buf + MAXLINE, len);
+    Free(fill->buf);
+    fill->buf = buf;
+    fill->len = hlen + len;
+    fill->cap = MAXLINE + cap;
+    return 1;
+}
+
+//a private copy of a gzip encoded block with its body inflated and its
+//head saying so, NULL if the body doesn't inflate or is too big
+static cache_block *inflate_block(cache_block *block)
+{
+    char *head_end = block->buf + block->head_len;
+    char *body = head_end + (*head_end == '\r' ? 2 : 1);
+    size_t body_len = block->buf + block->size - body, size, hlen;
+    unsigned char *trailer;
+    cache_block *copy;
+    z_stream zs;
+    int rc;
+
+    if(block->head_len == 0 || body_len < 18) return NULL;
+    //a gzip member ends with the length of what it holds
+    trailer = (unsigned char *)block->buf + block->size - 4;
+    size = trailer[0] | trailer[1] << 8 | trailer[2] << 16 |
+           (size_t)trailer[3] << 24;
+    if(size > GZIP_MAX_INFLATED) return NULL;
+
+    copy = Malloc(sizeof(cache_block) + MAXLINE + size);
+    copy->buf = (char *)(copy + 1);
+    if((hlen = http_encoded_head(copy->buf, MAXLINE, block->buf,
+                                 body - block->buf, 0, size)) == 0)
+    {
+        Free(copy);
+        return NULL;
+    }
+    memset(&zs, 0, sizeof(zs));
+    if(inflateInit2(&zs, 15 + 16) != Z_OK)
+    {
+        Free(copy);
+        return NULL;
+    }
+    zs.next_in = (unsigned char *)body;
+    zs.avail_in = body_len;
+    zs.next_out = (unsigned char *)copy->buf + hlen;
+    zs.avail_out = size;
+    rc = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    if(rc != Z_STREAM_END || zs.total_out != size)
+    {
+        Free(copy);
+        return NULL;
+    }
+    copy->arena = NULL;
+    copy->size = hlen + size;
+    copy->slot = 0;
+    copy->refcnt = 1;
+    copy->framed = 1;
+    copy->head_len = hlen - 2;
+    copy->key = NULL;
+    copy->key_len = 0;
+    copy->meta = block->meta;
+    copy->meta.gzip = 0;
+    //the validators live in block's slot, which the copy outlives
+    copy->meta.etag = copy->meta.last_modified = "";
+    return copy;
+}
+
+//the key the inflated copy of the object under key is cached with,
+//made in buf, which holds GZIP_KEY_LEN bytes
+static void identity_key(cache_key *key, cache_key *ikey, char *buf)
+{
+    snprintf(buf, GZIP_KEY_LEN, "%s%s", key->str, GZIP_IDENTITY_SUFFIX);
+    cache_key_init(ikey, buf);
+}
+
+//the cached block under key as this client gets it: the block itself,
+//or for a client that doesn't take gzip the unencoded copy of a gzip
+//encoded one, which takes the place of block's reference. the copy is
+//inflated once and cached next to the gzip one, so later hits go out
+//without inflating again. it belongs to the gzip block it was made
+//from as long as both expire at the same moment: a refreshed or
+//replaced block has its copy made again. a copy too big for the cache
+//is made for every hit. returns NULL, with block released, if it
+//can't be inflated
+cache_block *gzip_for_client(cache_t *cache, cache_key *key,
+                             cache_block *block, int accepts_gzip)
+{
+    char buf[GZIP_KEY_LEN];
+    cache_key ikey;
+    cache_block *copy;
+    cache_meta meta;
+    time_t expires;
+
+    if(!block->meta.gzip || accepts_gzip) return block;
+    identity_key(key, &ikey, buf);
+    expires = __atomic_load_n(&block->meta.expires, __ATOMIC_RELAXED);
+    if((copy = cache_inquiry(&ikey, cache)) != NULL)
+    {
+        if(__atomic_load_n(&copy->meta.expires, __ATOMIC_RELAXED) ==
+           expires)
+        {
+            cache_release(block);
+            return copy;
+        }
+        cache_release(copy);
+    }
+    copy = inflate_block(block);
+    cache_release(block);
+    if(copy != NULL && copy->size <= MAX_OBJECT_SIZE)
+    {
+        //an encoding of the object, which the disk tier can't tell apart
+        meta = copy->meta;
+        meta.variant = 1;
+        meta.expendable = 1;
+        cache_insert(&ikey, copy->buf, copy->size, copy->head_len,
+                     copy->framed, &meta, cache);
+    }
+    return copy;
+}
@@ -0,0 +1,24 @@
+#ifndef __GZIP_H__
+#define __GZIP_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+//bodies shorter than this aren't worth compressing
+#define GZIP_MIN_SIZE 256
+//zlib level text is compressed with, 1 is fastest and 9 smallest
+#define GZIP_LEVEL 6
+//largest body inflated for a client that doesn't take gzip, a bigger
+//one is fetched from the server unencoded
+#define GZIP_MAX_INFLATED (16 * MAX_OBJECT_SIZE)
+
+//appended to a key for the object's inflated copy. a '\r' occurs
+//neither in a URI nor in the header values of a variant key
+#define GZIP_IDENTITY_SUFFIX "\ridentity"
+#define GZIP_KEY_LEN (CACHE_KEY_LEN + sizeof(GZIP_IDENTITY_SUFFIX))
+
+int gzip_fill(cache_fill *fill, size_t head_len);
+cache_block *gzip_for_client(cache_t *cache, cache_key *key,
+                             cache_block *block, int accepts_gzip);
+
+#endif /* __GZIP_H__ */
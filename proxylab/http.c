@@ -0,0 +1,1010 @@
+/*HTTP/1.1 message framing.
+ * The proxy relays a response body by Content-Length, by chunked
+ * transfer coding or, for old servers, until the connection closes.
+ * Only the first two leave the server connection reusable and let the
+ * client connection carry further requests.
+ * The response head also tells whether the cache may keep the response
+ * and for how long (Cache-Control, Expires, Last-Modified), what to
+ * revalidate it with once it is stale, and whether its body is or could
+ * be gzip encoded (Content-Encoding, Content-Type).*/
+#include <limits.h>
+#include "http.h"
+#include "relay.h"
+
+//skip the header name and the spaces after its colon
+static char *header_value(char *line, const char *name)
+{
+    size_t len = strlen(name);
+    if(strncasecmp(line, name, len) != 0 || line[len] != ':')
+        return NULL;
+    line += len + 1;
+    while(*line == ' ' || *line == '\t') line++;
+    return line;
+}
+
+//hop-by-hop headers describe one connection and are not forwarded
+static int hop_by_hop(char *line)
+{
+    return header_value(line, "Connection") != NULL ||
+           header_value(line, "Keep-Alive") != NULL ||
+           header_value(line, "Proxy-Connection") != NULL;
+}
+
+enum { PARSE_REQUEST_LINE, PARSE_HEADERS };
+
+void http_request_init(http_request *req)
+{
+    req->state = PARSE_REQUEST_LINE;
+    req->scanned = req->line = 0;
+    req->close_hdr = req->keep_alive_hdr = 0;
+    req->version_minor = 0;
+    req->connect = 0;
+    req->content_length = -1;
+    req->chunked = 0;
+    req->nheaders = 0;
+}
+
+//split host[:port] between host and auth_end into hostname and port,
+//default_port if it has none
+static int parse_authority(http_request *req, char *host, char *auth_end,
+                           const char *default_port)
+{
+    char *host_end, *port;
+
+    req->authority.p = host;
+    req->authority.len = auth_end - host;
+
+    //an IPv6 literal carries colons of its own
+    if(*host == '[')
+    {
+        if((host_end = memchr(host, ']', auth_end - host)) == NULL) return -1;
+        host++;
+        port = host_end + 1;
+    }
+    else
+    {
+        if((host_end = memchr(host, ':', auth_end - host)) == NULL)
+            host_end = auth_end;
+        port = host_end;
+    }
+    if(host_end == host || host_end - host >= HTTP_HOST_LEN) return -1;
+    memcpy(req->hostname, host, host_end - host);
+    req->hostname[host_end - host] = '\0';
+
+    if(port < auth_end && *port == ':' && auth_end - port > 1)
+    {
+        port++;
+        if(auth_end - port >= HTTP_PORT_LEN) return -1;
+        memcpy(req->port, port, auth_end - port);
+        req->port[auth_end - port] = '\0';
+    }
+    else strcpy(req->port, default_port);
+    return 0;
+}
+
+//split an absolute http:// uri into authority, host, port and path.
+//an origin-form uri, just a path, is for the proxy itself and leaves
+//the authority and hostname empty. CONNECT takes an authority-form
+//one, host:port alone, and has an empty path
+static int parse_uri(http_request *req)
+{
+    char *p = req->uri.p, *end = req->uri.p + req->uri.len;
+    char *host, *auth_end;
+
+    if(req->connect)
+    {
+        req->path.p = end;
+        req->path.len = 0;
+        return parse_authority(req, p, end, "443");
+    }
+    if(req->uri.len > 0 && *p == '/')
+    {
+        req->authority.p = p;
+        req->authority.len = 0;
+        req->hostname[0] = req->port[0] = '\0';
+        req->path = req->uri;
+        return 0;
+    }
+    if(req->uri.len < 7 || strncasecmp(p, "http://", 7) != 0) return -1;
+    host = p + 7;
+    if((auth_end = memchr(host, '/', end - host)) == NULL) auth_end = end;
+    if(parse_authority(req, host, auth_end, "80") < 0) return -1;
+
+    if(auth_end < end)
+    {
+        req->path.p = auth_end;
+        req->path.len = end - auth_end;
+    }
+    else
+    {
+        req->path.p = "/";
+        req->path.len = 1;
+    }
+    return 0;
+}
+
+//METHOD SP absolute-uri SP HTTP/1.x, or CONNECT SP host:port SP
+//HTTP/1.x, without its line ending
+static int parse_request_line(http_request *req, char *line, size_t len)
+{
+    char *end = line + len, *sp1, *sp2;
+
+    if((sp1 = memchr(line, ' ', len)) == NULL || sp1 == line) return -1;
+    if((sp2 = memchr(sp1 + 1, ' ', end - sp1 - 1)) == NULL) return -1;
+    req->method.p = line;
+    req->method.len = sp1 - line;
+    req->uri.p = sp1 + 1;
+    req->uri.len = sp2 - sp1 - 1;
+    if(end - sp2 - 1 != 8 || strncmp(sp2 + 1, "HTTP/1.", 7) != 0 ||
+       !isdigit((unsigned char)sp2[8]))
+        return -1;
+    req->version_minor = sp2[8] - '0';
+    req->connect = (req->method.len == 7 &&
+                    strncmp(req->method.p, "CONNECT", 7) == 0);
+    if(parse_uri(req) < 0) return -1;
+    //the spaces after them are no longer needed
+    req->method.p[req->method.len] = '\0';
+    req->uri.p[req->uri.len] = '\0';
+    return 0;
+}
+
+static int parse_request_header(http_request *req, char *line, size_t len)
+{
+    char *value;
+
+    if(req->nheaders == HTTP_MAX_HEADERS) return -1;
+    if(memchr(line, ':', len) == NULL) return -1;
+    req->headers[req->nheaders].p = line;
+    req->headers[req->nheaders].len = len;
+    req->nheaders++;
+
+    if((value = header_value(line, "Connection")) != NULL ||
+       (value = header_value(line, "Proxy-Connection")) != NULL)
+    {
+        if(strncasecmp(value, "close", 5) == 0) req->close_hdr = 1;
+        if(strncasecmp(value, "keep-alive", 10) == 0) req->keep_alive_hdr = 1;
+    }
+    else if((value = header_value(line, "Content-Length")) != NULL)
+        req->content_length = strtol(value, NULL, 10);
+    else if(header_value(line, "Transfer-Encoding") != NULL)
+        req->chunked = 1;
+    return 0;
+}
+
+//parse as much of a request head as buf holds. buf has to keep its
+//address between calls for the same request, only more bytes may be
+//added to its end. returns the length of the head once it is complete,
+//0 if more bytes are needed and -1 on a malformed head
+int http_parse_request(http_request *req, char *buf, size_t len)
+{
+    char *line, *nl;
+    size_t n, content;
+
+    while(req->scanned < len &&
+          (nl = memchr(buf + req->scanned, '\n', len - req->scanned)) != NULL)
+    {
+        line = buf + req->line;
+        n = nl + 1 - line;
+        content = n - 1 - (n >= 2 && nl[-1] == '\r');
+        req->scanned = req->line = nl + 1 - buf;
+
+        if(req->state == PARSE_REQUEST_LINE)
+        {
+            //empty lines ahead of a request are ignored
+            if(content == 0) continue;
+            if(parse_request_line(req, line, content) < 0) return -1;
+            req->state = PARSE_HEADERS;
+        }
+        else if(content == 0)
+        {
+            if(req->version_minor >= 1) req->keep_alive = !req->close_hdr;
+            else req->keep_alive = req->keep_alive_hdr;
+            return req->line;
+        }
+        else if(parse_request_header(req, line, n) < 0) return -1;
+    }
+    req->scanned = len;
+    return 0;
+}
+
+//read the next request head from a client connection and parse it in
+//place in rp's buffer; the bytes after it stay buffered. returns 1 on
+//success, 0 if the client closed or idled out between requests, -1 on
+//a bad or oversized request and -2 on one not complete HTTP_HEAD_TIMEOUT
+//seconds after its first byte or stalled past the socket's timeout
+int http_read_request(rio_t *rp, http_request *req)
+{
+    time_t start = 0;
+    ssize_t n;
+    int rc;
+
+    http_request_init(req);
+    //the head is parsed where it lies, so what a pipelining client sent
+    //ahead is moved to the front to leave room behind it
+    if(rp->rio_bufptr != rp->rio_buf)
+    {
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+        rp->rio_bufptr = rp->rio_buf;
+    }
+    while((rc = http_parse_request(req, rp->rio_buf, rp->rio_cnt)) == 0)
+    {
+        if(rp->rio_cnt == sizeof(rp->rio_buf)) return -1;
+        if(rp->rio_cnt > 0 && start == 0) start = time(NULL);
+        else if(start != 0 && time(NULL) - start >= HTTP_HEAD_TIMEOUT)
+            return -2;
+        n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+                 sizeof(rp->rio_buf) - rp->rio_cnt);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0 && rp->rio_cnt > 0 &&
+           (errno == EAGAIN || errno == EWOULDBLOCK))
+            return -2;
+        if(n <= 0) return rp->rio_cnt == 0 ? 0 : -1;
+        rp->rio_cnt += n;
+    }
+    if(rc < 0) return -1;
+    rp->rio_bufptr += rc;
+    rp->rio_cnt -= rc;
+    return 1;
+}
+
+//1 if the header line is a name header
+int http_header_is(http_span *line, const char *name)
+{
+    return header_value(line->p, name) != NULL;
+}
+
+//the single byte range the client asks for, "bytes=first-last" or
+//"bytes=first-" with *last -1. returns 0 for a request without one, and
+//for the ones answered whole: several ranges, suffix ranges and ranges
+//made conditional with If-Range
+int http_request_range(http_request *req, long *first, long *last)
+{
+    http_span *range = NULL;
+    char *value, *end;
+    int i;
+
+    for(i = 0; i < req->nheaders; i++)
+    {
+        if(http_header_is(&req->headers[i], "If-Range")) return 0;
+        if(http_header_is(&req->headers[i], "Range"))
+            range = &req->headers[i];
+    }
+    if(range == NULL ||
+       memchr(range->p, ',', range->len) != NULL ||
+       (value = header_value(range->p, "Range")) == NULL ||
+       strncmp(value, "bytes=", 6) != 0 ||
+       !isdigit((unsigned char)value[6]))
+        return 0;
+    *first = strtol(value + 6, &end, 10);
+    if(*end++ != '-') return 0;
+    if(!isdigit((unsigned char)*end)) *last = -1;
+    else if((*last = strtol(end, NULL, 10)) < *first) return 0;
+    return 1;
+}
+
+//1 if the client takes gzip encoded responses: its Accept-Encoding
+//lists gzip, x-gzip or * without q=0
+int http_accepts_gzip(http_request *req)
+{
+    char *p, *end, *q;
+    size_t n;
+    int i;
+
+    for(i = 0; i < req->nheaders; i++)
+        if(http_header_is(&req->headers[i], "Accept-Encoding")) break;
+    if(i == req->nheaders) return 0;
+    p = header_value(req->headers[i].p, "Accept-Encoding");
+    end = req->headers[i].p + req->headers[i].len;
+    while(p < end && *p != '\r' && *p != '\n')
+    {
+        while(p < end && (*p == ' ' || *p == ',')) p++;
+        n = strcspn(p, ",;\r\n ");
+        if((n == 4 && strncasecmp(p, "gzip", 4) == 0) ||
+           (n == 6 && strncasecmp(p, "x-gzip", 6) == 0) ||
+           (n == 1 && *p == '*'))
+        {
+            q = p + strcspn(p, ",\r\n");
+            while(p < q && strncasecmp(p, "q=", 2) != 0) p++;
+            return p == q || strtod(p + 2, NULL) > 0;
+        }
+        p += strcspn(p, ",\r\n");
+    }
+    return 0;
+}
+
+static int unreserved(int c)
+{
+    return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+//the uri in the one form the cache keys it by: host in lower case, no
+//default port, percent-escapes of unreserved characters decoded and
+//the others in upper case, so equivalent spellings share an entry.
+//returns its length, 0 if it doesn't fit in cap
+size_t http_normalize_uri(http_request *req, char *dst, size_t cap)
+{
+    char *p = req->path.p, *end = req->path.p + req->path.len;
+    size_t len, i;
+    int c;
+
+    len = snprintf(dst, cap, strchr(req->hostname, ':') ? "http://[%s" :
+                   "http://%s", req->hostname);
+    for(i = strlen("http://"); i < len && i < cap; i++)
+        dst[i] = tolower((unsigned char)dst[i]);
+    if(len < cap && strchr(req->hostname, ':')) dst[len++] = ']';
+    if(len < cap && atoi(req->port) != 80)
+        len += snprintf(dst + len, cap - len, ":%d", atoi(req->port));
+    for(; p < end && len + 3 < cap; p++)
+    {
+        if(*p == '%' && end - p > 2 && isxdigit((unsigned char)p[1]) &&
+           isxdigit((unsigned char)p[2]))
+        {
+            sscanf(p + 1, "%2x", &c);
+            p += 2;
+            if(unreserved(c)) dst[len++] = c;
+            else len += sprintf(dst + len, "%%%02X", c);
+        }
+        else dst[len++] = *p;
+    }
+    if(p < end || len >= cap) return 0;
+    dst[len] = '\0';
+    return len;
+}
+
+//append to the len bytes of key in dst the client's values of the
+//request headers named in vary, so each variant gets a key of its own.
+//returns the new length, 0 if it doesn't fit in cap
+size_t http_vary_key(http_request *req, char *vary, char *dst, size_t len,
+                     size_t cap)
+{
+    char name[HTTP_VARY_LEN], *value;
+    size_t n;
+    int i;
+
+    while(*vary != '\0')
+    {
+        n = strcspn(vary, ",");
+        memcpy(name, vary, n);
+        name[n] = '\0';
+        vary += n + (vary[n] == ',');
+        if(len + 1 >= cap) return 0;
+        dst[len++] = '\n';
+        for(i = 0; i < req->nheaders; i++)
+            if((value = header_value(req->headers[i].p, name)) != NULL)
+            {
+                n = strcspn(value, "\r\n");
+                if(len + n >= cap) return 0;
+                memcpy(dst + len, value, n);
+                len += n;
+                break;
+            }
+    }
+    dst[len] = '\0';
+    return len;
+}
+
+//skip written bytes of iov[i..n) and return the first iovec with any
+//left, adjusting it to start at the unwritten part
+int http_iov_advance(struct iovec *iov, int i, int n, size_t written)
+{
+    while(i < n && written >= iov[i].iov_len)
+        written -= iov[i++].iov_len;
+    if(i < n)
+    {
+        iov[i].iov_base = (char *)iov[i].iov_base + written;
+        iov[i].iov_len -= written;
+    }
+    return i;
+}
+
+//write all of iov to a blocking fd, iov itself is left as it is.
+//returns the number of bytes written or -1
+ssize_t http_writev(int fd, struct iovec *iov, int n)
+{
+    struct iovec v[HTTP_REQUEST_IOV];
+    ssize_t total = 0, w;
+    int i = 0;
+
+    if(n > HTTP_REQUEST_IOV) return -1;
+    memcpy(v, iov, n * sizeof(struct iovec));
+    while(i < n)
+    {
+        if((w = writev(fd, v + i, n - i)) < 0)
+        {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        total += w;
+        i = http_iov_advance(v, i, n, w);
+    }
+    return total;
+}
+
+static void response_init(http_response *resp)
+{
+    resp->status = 0;
+    resp->version_minor = 0;
+    resp->content_length = -1;
+    resp->chunked = 0;
+    resp->no_store = resp->no_cache = 0;
+    resp->max_age = -1;
+    resp->age = 0;
+    resp->expires = resp->date = -1;
+    resp->etag[0] = resp->last_modified[0] = resp->vary[0] = '\0';
+    resp->gzip = resp->encoded = resp->compressible = 0;
+    resp->spliced = 0;
+    resp->range_first = resp->range_last = resp->range_total = -1;
+}
+
+//HTTP-date in its preferred format, 0 if it can't be parsed
+static time_t parse_date(char *value)
+{
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if(strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL) return 0;
+    return timegm(&tm);
+}
+
+//copy a header value without its line ending
+static void copy_value(char *dst, char *value)
+{
+    size_t n = strcspn(value, "\r\n");
+    if(n >= HTTP_VALIDATOR_LEN) n = 0;
+    memcpy(dst, value, n);
+    dst[n] = '\0';
+}
+
+//take name out of a list of Vary names
+static void drop_vary(char *vary, const char *name)
+{
+    size_t len = strlen(name);
+    char *p = vary, *next;
+
+    while(*p != '\0')
+    {
+        next = p + strcspn(p, ",");
+        if(next - p == len && strncmp(p, name, len) == 0)
+        {
+            if(*next != ',')
+            {
+                *(p > vary ? p - 1 : p) = '\0';
+                return;
+            }
+            memmove(p, next + 1, strlen(next + 1) + 1);
+            continue;
+        }
+        p = *next == ',' ? next + 1 : next;
+    }
+}
+
+//text types that shrink when compressed
+static int compressible_type(char *value)
+{
+    static const char *types[] = {
+        "text/", "application/json", "application/javascript",
+        "application/xml", "application/xhtml+xml", "image/svg+xml", NULL
+    };
+    const char **t;
+
+    for(t = types; *t != NULL; t++)
+        if(strncasecmp(value, *t, strlen(*t)) == 0) return 1;
+    return 0;
+}
+
+//add the names of a Vary header to resp->vary. a response that varies
+//with more than fits is treated like Vary: *
+static void add_vary(http_response *resp, char *value)
+{
+    size_t len = strlen(resp->vary);
+    char *p;
+
+    if(strcmp(resp->vary, "*") == 0) return;
+    for(p = value; *p != '\0' && *p != '\r' && *p != '\n'; p++)
+    {
+        if(*p == ' ' || *p == '\t') continue;
+        if(*p == ',' && (len == 0 || resp->vary[len - 1] == ',')) continue;
+        if(*p == '*' || len + 2 >= HTTP_VARY_LEN)
+        {
+            strcpy(resp->vary, "*");
+            return;
+        }
+        if(len > 0 && p == value) resp->vary[len++] = ',';
+        resp->vary[len++] = tolower((unsigned char)*p);
+    }
+    if(len > 0 && resp->vary[len - 1] == ',') len--;
+    resp->vary[len] = '\0';
+    drop_vary(resp->vary, "accept-encoding");
+}
+
+//no-cache holds whatever max-age comes with it, in any order
+static void parse_cache_control(char *value, http_response *resp)
+{
+    char *p;
+    int shared = 0;
+
+    for(p = value; *p != '\0' && *p != '\r' && *p != '\n'; p++)
+    {
+        if(p != value && p[-1] != ' ' && p[-1] != ',') continue;
+        if(strncasecmp(p, "no-store", 8) == 0 ||
+           strncasecmp(p, "private", 7) == 0)
+            resp->no_store = 1;
+        else if(strncasecmp(p, "no-cache", 8) == 0)
+            resp->no_cache = 1;
+        //s-maxage is meant for shared caches like this one
+        else if(strncasecmp(p, "s-maxage=", 9) == 0)
+        {
+            resp->max_age = strtol(p + 9, NULL, 10);
+            shared = 1;
+        }
+        else if(strncasecmp(p, "max-age=", 8) == 0 && !shared)
+            resp->max_age = strtol(p + 8, NULL, 10);
+    }
+}
+
+//note what one response header line says. the status line and the
+//blank line are handled by the callers
+static void parse_header(char *line, http_response *resp,
+                         int *close_hdr, int *keep_alive_hdr)
+{
+    char *value;
+
+    if((value = header_value(line, "Content-Length")) != NULL)
+        resp->content_length = strtol(value, NULL, 10);
+    else if((value = header_value(line, "Transfer-Encoding")) != NULL)
+        resp->chunked = (strncasecmp(value, "chunked", 7) == 0);
+    else if((value = header_value(line, "Connection")) != NULL)
+    {
+        if(strncasecmp(value, "close", 5) == 0) *close_hdr = 1;
+        if(strncasecmp(value, "keep-alive", 10) == 0) *keep_alive_hdr = 1;
+    }
+    else if((value = header_value(line, "Cache-Control")) != NULL)
+        parse_cache_control(value, resp);
+    else if((value = header_value(line, "Pragma")) != NULL)
+    {
+        if(strncasecmp(value, "no-cache", 8) == 0) resp->no_cache = 1;
+    }
+    else if((value = header_value(line, "Age")) != NULL)
+    {
+        if((resp->age = strtol(value, NULL, 10)) < 0) resp->age = 0;
+    }
+    else if((value = header_value(line, "Expires")) != NULL)
+        resp->expires = parse_date(value);
+    else if((value = header_value(line, "Date")) != NULL)
+        resp->date = parse_date(value);
+    else if((value = header_value(line, "ETag")) != NULL)
+        copy_value(resp->etag, value);
+    else if((value = header_value(line, "Last-Modified")) != NULL)
+        copy_value(resp->last_modified, value);
+    else if((value = header_value(line, "Vary")) != NULL)
+        add_vary(resp, value);
+    else if((value = header_value(line, "Content-Encoding")) != NULL)
+    {
+        if(strncasecmp(value, "gzip", 4) == 0 ||
+           strncasecmp(value, "x-gzip", 6) == 0)
+            resp->gzip = 1;
+        else if(strncasecmp(value, "identity", 8) != 0)
+            resp->encoded = 1;
+    }
+    else if((value = header_value(line, "Content-Type")) != NULL)
+        resp->compressible = compressible_type(value);
+    else if((value = header_value(line, "Content-Range")) != NULL &&
+            sscanf(value, "bytes %ld-%ld/", &resp->range_first,
+                   &resp->range_last) == 2)
+    {
+        if((value = strchr(value, '/')) != NULL)
+            resp->range_total = strtol(value + 1, NULL, 10);
+        if(resp->range_total <= 0) resp->range_total = -1;
+    }
+}
+
+//what the headers say about the connection and the body's end
+static void response_done(http_response *resp, int close_hdr,
+                          int keep_alive_hdr)
+{
+    if(resp->version_minor >= 1) resp->keep_alive = !close_hdr;
+    else resp->keep_alive = keep_alive_hdr;
+    //without framing the body can only end with the connection
+    resp->framed = !http_has_body(resp) || resp->chunked ||
+                   resp->content_length >= 0;
+    if(!resp->framed) resp->keep_alive = 0;
+}
+
+//read status line and headers into head (NUL terminated) and fill in
+//resp. head is what the client gets: the status line is answered as
+//HTTP/1.1 and hop-by-hop headers are dropped. returns the length of the
+//head, 0 if the server closed before sending anything, -1 on a
+//malformed or oversized head
+ssize_t http_read_response_head(rio_t *rp, char *head, size_t maxlen,
+                                http_response *resp)
+{
+    size_t len = 0;
+    ssize_t n;
+    char *line;
+    int close_hdr = 0, keep_alive_hdr = 0;
+
+    response_init(resp);
+    while(1)
+    {
+        line = head + len;
+        if((n = rio_readlineb(rp, line, maxlen - len)) <= 0)
+            return (len == 0 && n == 0) ? 0 : -1;
+        len += n;
+        if(line[n-1] != '\n') return -1;
+
+        if(line == head)
+        {
+            if(sscanf(line, "HTTP/1.%d %d", &resp->version_minor,
+                      &resp->status) != 2)
+                return -1;
+            line[strlen("HTTP/1.")] = '1';
+            continue;
+        }
+        if(strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0)
+            break;
+
+        parse_header(line, resp, &close_hdr, &keep_alive_hdr);
+        if(hop_by_hop(line))
+        {
+            len -= n;
+            head[len] = '\0';
+        }
+    }
+    response_done(resp, close_hdr, keep_alive_hdr);
+    return len;
+}
+
+//fill in resp from a response head at the start of buf, as relayed by
+//the event loops. returns the length of the head or -1 if buf doesn't
+//start with a complete one
+ssize_t http_parse_response_head(char *buf, size_t len,
+                                 http_response *resp)
+{
+    char line[MAXLINE];
+    char *p = buf, *end = buf + len, *nl;
+    int close_hdr = 0, keep_alive_hdr = 0;
+
+    response_init(resp);
+    while((nl = memchr(p, '\n', end - p)) != NULL)
+    {
+        if(nl - p + 1 >= MAXLINE) return -1;
+        memcpy(line, p, nl - p + 1);
+        line[nl - p + 1] = '\0';
+        if(p == buf)
+        {
+            if(sscanf(line, "HTTP/1.%d %d", &resp->version_minor,
+                      &resp->status) != 2)
+                return -1;
+        }
+        else if(strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0)
+        {
+            response_done(resp, close_hdr, keep_alive_hdr);
+            return nl + 1 - buf;
+        }
+        else parse_header(line, resp, &close_hdr, &keep_alive_hdr);
+        p = nl + 1;
+    }
+    return -1;
+}
+
+//get a response at the start of buf ready to be stored: the lines a
+//hit gets rewritten for each client it goes to, the hop-by-hop ones
+//and Age, are dropped and the rest is moved down. *head_len is set to
+//the length of the head up to the blank line ending it, 0 if buf
+//doesn't start with a whole head. returns the new length of buf
+size_t http_store_head(char *buf, size_t len, size_t *head_len)
+{
+    char *p, *nl, *end = buf + len;
+
+    *head_len = 0;
+    if((p = memchr(buf, '\n', len)) == NULL) return len;
+    p++;
+    while((nl = memchr(p, '\n', end - p)) != NULL)
+    {
+        if(nl == p || (nl == p + 1 && *p == '\r'))
+        {
+            *head_len = p - buf;
+            return len;
+        }
+        if(hop_by_hop(p) || header_value(p, "Age") != NULL)
+        {
+            memmove(p, nl + 1, end - (nl + 1));
+            end -= nl + 1 - p;
+            len -= nl + 1 - p;
+            continue;
+        }
+        p = nl + 1;
+    }
+    return len;
+}
+
+//the head of a 206 answering bytes first-last of total from the head of
+//a response holding some or all of them: the status line is replaced,
+//the lines describing that response's own body are dropped and the new
+//range follows. returns its length, 0 if it doesn't fit in cap
+size_t http_range_head(char *dst, size_t cap, char *head, long first,
+                       long last, long total, int keep_alive)
+{
+    static const char *body_hdrs[] = {
+        "Content-Length", "Content-Range", "Transfer-Encoding", "Age", NULL
+    };
+    const char **name;
+    char *p, *nl;
+    size_t len;
+
+    len = snprintf(dst, cap, "HTTP/1.1 206 Partial Content\r\n");
+    if((p = strchr(head, '\n')) == NULL) return 0;
+    for(p++; (nl = strchr(p, '\n')) != NULL && *p != '\r' && *p != '\n';
+        p = nl + 1)
+    {
+        for(name = body_hdrs; *name != NULL; name++)
+            if(header_value(p, *name) != NULL) break;
+        if(*name != NULL || hop_by_hop(p)) continue;
+        if(len + (nl + 1 - p) >= cap) return 0;
+        memcpy(dst + len, p, nl + 1 - p);
+        len += nl + 1 - p;
+    }
+    len += snprintf(dst + len, cap - len, "Content-Range: bytes %ld-%ld/%ld"
+                    "\r\nContent-Length: %ld\r\nConnection: %s\r\n\r\n",
+                    first, last, total, last - first + 1,
+                    keep_alive ? "keep-alive" : "close");
+    return len < cap ? len : 0;
+}
+
+//the ETag line for the representation in the other encoding, written
+//to dst from the entity tag that starts at value and ends at end. a
+//gzip encoded one gets "-gzip" inside the quotes, which it loses again
+//once inflated, and a body inflated from the server's own gzip gets
+//"-identity", so a conditional request made with the tag of one
+//encoding never matches the other. returns its length, 0 for a tag
+//that isn't quoted or doesn't fit in cap
+static size_t encoded_etag(char *dst, size_t cap, char *value, char *end,
+                           int gzip)
+{
+    static const char gz[] = "-gzip";
+    size_t n, gzlen = strlen(gz);
+    char *quote;
+
+    while(end > value && (end[-1] == '\r' || end[-1] == '\n' ||
+                          end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    if(end - value < 2 || end[-1] != '"' ||
+       (quote = memchr(value, '"', end - value)) == end - 1)
+        return 0;
+    n = end - 1 - value;
+    if(!gzip && n >= gzlen && quote + gzlen < end - 1 &&
+       strncmp(end - 1 - gzlen, gz, gzlen) == 0)
+        n = snprintf(dst, cap, "ETag: %.*s\"\r\n", (int)(n - gzlen), value);
+    else
+        n = snprintf(dst, cap, "ETag: %.*s%s\"\r\n", (int)n, value,
+                     gzip ? gz : "-identity");
+    return n < cap ? n : 0;
+}
+
+//the head of the same response with a body of length bytes, gzip
+//encoded or not, from head_len bytes of head ending in its blank line:
+//the lines describing the old body are dropped, new ones follow and
+//the ETag is made the one of the new encoding.
+//returns its length, 0 if it doesn't fit in cap
+size_t http_encoded_head(char *dst, size_t cap, char *head, size_t head_len,
+                         int gzip, size_t length)
+{
+    static const char *body_hdrs[] = {
+        "Content-Length", "Content-Encoding", "Transfer-Encoding", "Age",
+        NULL
+    };
+    const char **name;
+    char *p, *nl, *end = head + head_len, *value;
+    size_t len = 0;
+    int vary = 0;
+
+    for(p = head; (nl = memchr(p, '\n', end - p)) != NULL &&
+        (p == head || (*p != '\r' && *p != '\n')); p = nl + 1)
+    {
+        for(name = body_hdrs; *name != NULL; name++)
+            if(header_value(p, *name) != NULL) break;
+        if(*name != NULL || hop_by_hop(p)) continue;
+        if((value = header_value(p, "Vary")) != NULL &&
+           strncasecmp(value, "accept-encoding", 15) == 0)
+            vary = 1;
+        //an unquoted tag is dropped rather than shared by both encodings
+        if((value = header_value(p, "ETag")) != NULL)
+        {
+            len += encoded_etag(dst + len, cap - len, value, nl + 1, gzip);
+            continue;
+        }
+        if(len + (nl + 1 - p) >= cap) return 0;
+        memcpy(dst + len, p, nl + 1 - p);
+        len += nl + 1 - p;
+    }
+    if(gzip)
+        len += snprintf(dst + len, cap - len, "Content-Encoding: gzip\r\n%s",
+                        vary ? "" : "Vary: Accept-Encoding\r\n");
+    if(len < cap)
+        len += snprintf(dst + len, cap - len, "Content-Length: %lu\r\n\r\n",
+                        (unsigned long)length);
+    return len < cap ? len : 0;
+}
+
+//only complete 200 responses the server allows shared caches to store
+//are cached
+int http_cacheable(http_response *resp)
+{
+    return resp->status == 200 && !resp->no_store &&
+           strcmp(resp->vary, "*") != 0;
+}
+
+//seconds the response stays fresh from when it was generated: 0 for
+//no-cache, then max-age, then Expires relative to Date, then a tenth
+//of the time since it was last modified. -1 if the response says
+//nothing about it. Age is left to the caller
+long http_freshness(http_response *resp)
+{
+    time_t date = resp->date > 0 ? resp->date : time(NULL);
+    time_t modified;
+
+    if(resp->no_cache) return 0;
+    if(resp->max_age >= 0) return resp->max_age;
+    if(resp->expires >= 0)
+        return resp->expires > date ? resp->expires - date : 0;
+    if(resp->last_modified[0] != '\0' &&
+       (modified = parse_date(resp->last_modified)) > 0 && modified < date)
+        return (date - modified) / 10;
+    return -1;
+}
+
+//1xx, 204 and 304 responses never carry a body
+int http_has_body(http_response *resp)
+{
+    return !(resp->status / 100 == 1 || resp->status == 204 ||
+             resp->status == 304);
+}
+
+//pass exactly n body bytes to sink
+static int relay_bytes(rio_t *rp, size_t n, http_sink sink, void *arg)
+{
+    char buf[MAXBUF];
+    ssize_t got;
+
+    while(n > 0)
+    {
+        got = rio_readnb(rp, buf, n < MAXBUF ? n : MAXBUF);
+        if(got <= 0) return -1;
+        if(sink(arg, buf, got) < 0) return -1;
+        n -= got;
+    }
+    return 0;
+}
+
+//the size on a chunk size line, which may carry extensions after a
+//';'. returns -1 if the line doesn't start with a hex number
+static long chunk_size(char *line)
+{
+    char *end;
+    unsigned long size;
+
+    if(!isxdigit((unsigned char)line[0])) return -1;
+    errno = 0;
+    size = strtoul(line, &end, 16);
+    if(errno == ERANGE || size > LONG_MAX) return -1;
+    while(*end == ' ' || *end == '\t') end++;
+    if(*end != ';' && *end != '\r' && *end != '\n') return -1;
+    return size;
+}
+
+//chunk size lines, chunk data and trailers are all relayed as they are.
+//a size line that doesn't parse is an error, so the body is never
+//taken for complete and cached cut short
+static int relay_chunked(rio_t *rp, http_sink sink, void *arg)
+{
+    char line[MAXLINE];
+    ssize_t n;
+    long size;
+
+    while(1)
+    {
+        if((n = rio_readlineb(rp, line, MAXLINE)) <= 0) return -1;
+        if((size = chunk_size(line)) < 0) return -1;
+        if(sink(arg, line, n) < 0) return -1;
+        if(size == 0) break;
+        //chunk data plus its trailing CRLF
+        if(relay_bytes(rp, size + 2, sink, arg) < 0) return -1;
+    }
+    //optional trailer headers up to the blank line
+    do {
+        if((n = rio_readlineb(rp, line, MAXLINE)) <= 0) return -1;
+        if(sink(arg, line, n) < 0) return -1;
+    } while(strcmp(line, "\r\n") != 0 && strcmp(line, "\n") != 0);
+    return 0;
+}
+
+//whether buf, a head of head_len bytes and the body relayed after it,
+//holds the whole body: up to Content-Length, or through the last chunk
+//and its trailers. a body without framing ends wherever the server
+//closed, so any length is whole
+int http_body_complete(char *buf, size_t len, size_t head_len,
+                       http_response *resp)
+{
+    char line[MAXLINE];
+    char *p = buf + head_len, *end = buf + len, *nl;
+    long size;
+
+    if(!http_has_body(resp)) return 1;
+    if(!resp->chunked)
+        return resp->content_length < 0 ||
+               len - head_len >= (size_t)resp->content_length;
+    //size lines and data up to the last chunk
+    while(1)
+    {
+        if((nl = memchr(p, '\n', end - p)) == NULL ||
+           nl - p + 1 >= MAXLINE)
+            return 0;
+        memcpy(line, p, nl - p + 1);
+        line[nl - p + 1] = '\0';
+        if((size = chunk_size(line)) < 0) return 0;
+        p = nl + 1;
+        if(size == 0) break;
+        if(end - p < size + 2) return 0;
+        p += size + 2;
+    }
+    //trailers up to the blank line
+    while((nl = memchr(p, '\n', end - p)) != NULL)
+    {
+        if(nl == p || (nl == p + 1 && *p == '\r')) return 1;
+        p = nl + 1;
+    }
+    return 0;
+}
+
+//relay the body that follows a head read by http_read_response_head.
+//returns 0 when the body ended at its framing boundary, 1 when it ran
+//until the server closed the connection and -1 on error
+int http_relay_body(rio_t *rp, http_response *resp,
+                    http_sink sink, void *arg)
+{
+    char buf[MAXBUF];
+    ssize_t n;
+
+    if(!http_has_body(resp)) return 0;
+    if(resp->chunked) return relay_chunked(rp, sink, arg);
+    if(resp->content_length >= 0)
+        return relay_bytes(rp, resp->content_length, sink, arg);
+
+    while((n = rio_readnb(rp, buf, MAXBUF)) > 0)
+        if(sink(arg, buf, n) < 0) return -1;
+    return n < 0 ? -1 : 1;
+}
+
+//like http_relay_body, but the body goes from the server socket to
+//tofd with relay_splice and copy only gets a copy of it. bytes rio has
+//already buffered, chunked bodies and descriptors splice can't handle
+//go through sink, which is expected to write to tofd itself
+int http_splice_body(rio_t *rp, http_response *resp, int tofd,
+                     http_sink sink, http_sink copy, void *arg)
+{
+    long len = resp->content_length;
+    ssize_t n;
+
+    if(!http_has_body(resp)) return 0;
+    if(resp->chunked) return http_relay_body(rp, resp, sink, arg);
+
+    //what the head read pulled in with it
+    if((n = rp->rio_cnt) > 0)
+    {
+        if(len >= 0 && n > len) n = len;
+        if(sink(arg, rp->rio_bufptr, n) < 0) return -1;
+        rp->rio_bufptr += n;
+        rp->rio_cnt -= n;
+        if(len >= 0) len -= n;
+    }
+    if(len == 0) return 0;
+
+    n = relay_splice(rp->rio_fd, tofd, len, copy, arg);
+    if(n == RELAY_UNSUPPORTED)
+    {
+        if(len >= 0) return relay_bytes(rp, len, sink, arg);
+        return http_relay_body(rp, resp, sink, arg);
+    }
+    if(n < 0) return -1;
+    resp->spliced = n;
+    return len < 0 ? 1 : 0;
+}
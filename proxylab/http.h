@@ -0,0 +1,117 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <sys/uio.h>
+#include "csapp.h"
+
+//longest ETag or Last-Modified value kept for revalidation
+#define HTTP_VALIDATOR_LEN 128
+//longest list of Vary header names kept, a longer one isn't cached
+#define HTTP_VARY_LEN 128
+
+//what the proxy needs to know about a response head to relay its body
+//and decide whether the server connection can be reused
+typedef struct {
+    int status;
+    int version_minor;          //HTTP/1.x
+    long content_length;        //-1 when the header is absent
+    int chunked;                //Transfer-Encoding: chunked
+    int keep_alive;             //server keeps the connection open
+    int framed;                 //the response itself says where it ends
+    //caching: explicit freshness and the validators to revalidate with
+    int no_store;               //no-store or private
+    int no_cache;               //stored, but revalidated before every use
+    long max_age;               //-1 when absent
+    long age;                   //Age, seconds spent in caches upstream
+    time_t expires;             //-1 when absent, 0 if unparsable
+    time_t date;                //-1 when absent
+    char etag[HTTP_VALIDATOR_LEN];
+    char last_modified[HTTP_VALIDATOR_LEN];
+    //request headers the response depends on: names in lower case,
+    //comma separated, "*" when it can't be cached by them.
+    //Accept-Encoding is left out, the proxy serves each client the
+    //encoding it takes itself
+    char vary[HTTP_VARY_LEN];
+    //Content-Encoding gzip, or another one than identity
+    int gzip, encoded;
+    int compressible;           //Content-Type is text worth compressing
+    long spliced;               //body bytes http_splice_body moved itself
+    //Content-Range of a 206, -1 when absent, range_total also when "*"
+    long range_first, range_last, range_total;
+} http_response;
+
+//most header lines a request may carry
+#define HTTP_MAX_HEADERS 64
+#define HTTP_HOST_LEN 256
+#define HTTP_PORT_LEN 8
+//iovecs an upstream request is built from
+#define HTTP_REQUEST_IOV (HTTP_MAX_HEADERS + 16)
+//seconds a client has for the rest of a request head once it started
+//sending it, however slowly the bytes trickle in
+#define HTTP_HEAD_TIMEOUT 10
+
+//bytes inside a buffer, not NUL terminated unless said so
+typedef struct {
+    char *p;
+    size_t len;
+} http_span;
+
+//a client's request head, parsed in place: the spans point into the
+//buffer the head was read into and stay valid as long as it does.
+//method and uri are NUL terminated there
+typedef struct {
+    //parser state, so a head arriving in pieces is only scanned once
+    int state;
+    size_t scanned, line;
+    int close_hdr, keep_alive_hdr;
+
+    http_span method, uri;
+    int connect;                //CONNECT, the uri is just host:port
+    http_span authority;        //host[:port] of the uri, empty if none
+    http_span path;             //"/" when the uri has none
+    char hostname[HTTP_HOST_LEN];
+    char port[HTTP_PORT_LEN];
+    int version_minor;
+    int keep_alive;             //client wants the connection kept open
+    long content_length;        //-1 when the request has no body
+    int chunked;                //body with Transfer-Encoding: chunked
+    int nheaders;
+    http_span headers[HTTP_MAX_HEADERS];    //whole lines with their CRLF
+} http_request;
+
+//receives the bytes of a response as they are relayed, returns -1 to
+//abort the relay. a sink that only keeps a copy of bytes spliced past
+//user space returns 1 once it needs no more of them
+typedef int (*http_sink)(void *arg, char *data, size_t n);
+
+void http_request_init(http_request *req);
+int http_parse_request(http_request *req, char *buf, size_t len);
+int http_read_request(rio_t *rp, http_request *req);
+int http_header_is(http_span *line, const char *name);
+int http_request_range(http_request *req, long *first, long *last);
+int http_accepts_gzip(http_request *req);
+size_t http_normalize_uri(http_request *req, char *dst, size_t cap);
+size_t http_vary_key(http_request *req, char *vary, char *dst, size_t len,
+                     size_t cap);
+int http_iov_advance(struct iovec *iov, int i, int n, size_t written);
+ssize_t http_writev(int fd, struct iovec *iov, int n);
+ssize_t http_read_response_head(rio_t *rp, char *head, size_t maxlen,
+                                http_response *resp);
+ssize_t http_parse_response_head(char *buf, size_t len,
+                                 http_response *resp);
+int http_has_body(http_response *resp);
+size_t http_store_head(char *buf, size_t len, size_t *head_len);
+size_t http_range_head(char *dst, size_t cap, char *head, long first,
+                       long last, long total, int keep_alive);
+size_t http_encoded_head(char *dst, size_t cap, char *head, size_t head_len,
+                         int gzip, size_t length);
+int http_cacheable(http_response *resp);
+long http_freshness(http_response *resp);
+int http_body_complete(char *buf, size_t len, size_t head_len,
+                       http_response *resp);
+int http_relay_body(rio_t *rp, http_response *resp,
+                    http_sink sink, void *arg);
+int http_splice_body(rio_t *rp, http_response *resp, int tofd,
+                     http_sink sink, http_sink copy, void *arg);
+
+#endif /* __HTTP_H__ */
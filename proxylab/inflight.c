@@ -0,0 +1,166 @@
+/*request coalescing for concurrent misses.
+ * Fetches in progress are tracked by URI so the origin sees a single
+ * request per cold object no matter how many clients ask for it at
+ * once. The table lock only covers lookups, each flight has its own
+ * lock and condition for streaming bytes to its followers.*/
+#include "inflight.h"
+#include "cache.h"
+
+static flight *table[INFLIGHT_NBUCKETS];
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long hash_uri(const char *key)
+{
+    unsigned long h = 5381;
+    while(*key) h = h * 33 + (unsigned char)*key++;
+    return h;
+}
+
+//join the fetch in progress for key, or start one. *leader tells the
+//caller which role it got; either way it owns a reference
+flight *flight_begin(char *key, int *leader)
+{
+    flight **slot = &table[hash_uri(key) % INFLIGHT_NBUCKETS];
+    flight *f;
+
+    pthread_mutex_lock(&table_lock);
+    for(f = *slot; f != NULL; f = f->next)
+    {
+        if(strcmp(f->key, key) != 0) continue;
+        pthread_mutex_lock(&f->lock);
+        if(f->joinable)
+        {
+            f->refcnt++;
+            pthread_mutex_unlock(&f->lock);
+            pthread_mutex_unlock(&table_lock);
+            *leader = 0;
+            return f;
+        }
+        pthread_mutex_unlock(&f->lock);
+    }
+
+    f = Calloc(1, sizeof(flight));
+    f->key = Malloc(strlen(key) + 1);
+    strcpy(f->key, key);
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->more, NULL);
+    f->joinable = 1;
+    f->refcnt = 2;
+    f->next = *slot;
+    *slot = f;
+    pthread_mutex_unlock(&table_lock);
+    *leader = 1;
+    return f;
+}
+
+//leader: make n more response bytes available to followers
+void flight_append(flight *f, char *data, size_t n)
+{
+    pthread_mutex_lock(&f->lock);
+    if(f->len + n > MAX_OBJECT_SIZE) f->joinable = 0;
+    //followers still attached to a response this long would have the
+    //whole of it buffered, they fail instead
+    if(f->len + n > INFLIGHT_MAX_BUFFER && f->buf != NULL)
+    {
+        f->overflow = 1;
+        pthread_cond_broadcast(&f->more);
+    }
+    //nobody is left to read the bytes of a response this big
+    if(f->overflow || (!f->joinable && f->refcnt <= 2))
+    {
+        Free(f->buf);
+        f->buf = NULL;
+        f->cap = 0;
+    }
+    else
+    {
+        if(f->len + n > f->cap)
+        {
+            f->cap = f->cap ? f->cap * 2 : MAXBUF;
+            while(f->cap < f->len + n) f->cap *= 2;
+            f->buf = Realloc(f->buf, f->cap);
+        }
+        memcpy(f->buf + f->len, data, n);
+        pthread_cond_broadcast(&f->more);
+    }
+    f->len += n;
+    pthread_mutex_unlock(&f->lock);
+}
+
+//leader: the response is complete (ok) or the fetch failed. the flight
+//leaves the table, so later misses start a fetch of their own
+void flight_finish(flight *f, int ok, int framed)
+{
+    flight **slot = &table[hash_uri(f->key) % INFLIGHT_NBUCKETS];
+
+    pthread_mutex_lock(&table_lock);
+    while(*slot != f) slot = &(*slot)->next;
+    *slot = f->next;
+    pthread_mutex_unlock(&table_lock);
+
+    pthread_mutex_lock(&f->lock);
+    f->joinable = 0;
+    f->done = ok ? 1 : -1;
+    f->framed = framed;
+    f->refcnt--;
+    pthread_cond_broadcast(&f->more);
+    pthread_mutex_unlock(&f->lock);
+}
+
+//leader: if nobody follows the fetch yet, stop admitting followers and
+//drop the buffer so the response no longer has to pass through user
+//space. returns 1 if that happened
+int flight_detach(flight *f)
+{
+    int alone;
+
+    pthread_mutex_lock(&f->lock);
+    if((alone = (f->refcnt <= 2)))
+    {
+        f->joinable = 0;
+        Free(f->buf);
+        f->buf = NULL;
+        f->cap = 0;
+    }
+    pthread_mutex_unlock(&f->lock);
+    return alone;
+}
+
+//follower: copy up to max bytes from offset off, waiting for the
+//leader if none have arrived yet. returns 0 at the end of a complete
+//response and -1 if the fetch failed or outgrew the buffer
+ssize_t flight_read(flight *f, size_t off, char *dst, size_t max)
+{
+    ssize_t n;
+
+    pthread_mutex_lock(&f->lock);
+    while(f->len <= off && f->done == 0 && !f->overflow)
+        pthread_cond_wait(&f->more, &f->lock);
+    if(f->overflow) n = -1;
+    else if(f->len > off)
+    {
+        n = f->len - off < max ? f->len - off : max;
+        memcpy(dst, f->buf + off, n);
+    }
+    else n = (f->done > 0) ? 0 : -1;
+    pthread_mutex_unlock(&f->lock);
+    return n;
+}
+
+//drop the caller's reference, the last one frees the flight
+void flight_release(flight *f)
+{
+    int last;
+
+    pthread_mutex_lock(&f->lock);
+    last = (--f->refcnt == 0);
+    pthread_mutex_unlock(&f->lock);
+    if(last)
+    {
+        pthread_mutex_destroy(&f->lock);
+        pthread_cond_destroy(&f->more);
+        Free(f->key);
+        Free(f->buf);
+        Free(f);
+    }
+}
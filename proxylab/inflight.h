@@ -0,0 +1,39 @@
+#ifndef __INFLIGHT_H__
+#define __INFLIGHT_H__
+
+#include "csapp.h"
+
+#define INFLIGHT_NBUCKETS 256
+//most response bytes kept for the followers of one fetch. followers
+//that fall further behind than this are cut off
+#define INFLIGHT_MAX_BUFFER (1024*1024)
+
+//one origin fetch in progress for a URI. the thread that started it
+//(the leader) appends response bytes as they arrive and any thread that
+//misses on the same URI meanwhile (a follower) streams them from buf
+//instead of asking the origin again.
+//followers are admitted only while the response fits MAX_OBJECT_SIZE;
+//past that buf keeps growing only for the followers already attached,
+//up to INFLIGHT_MAX_BUFFER
+typedef struct flight {
+    char *key;
+    pthread_mutex_t lock;
+    pthread_cond_t more;        //signalled when bytes arrive or it ends
+    char *buf;
+    size_t len, cap;
+    int joinable;
+    int done;                   //1 complete, -1 failed
+    int overflow;               //buf outgrew INFLIGHT_MAX_BUFFER
+    int framed;                 //response carries its own length
+    int refcnt;                 //leader, followers and the table
+    struct flight *next;
+} flight;
+
+flight *flight_begin(char *key, int *leader);
+void flight_append(flight *f, char *data, size_t n);
+void flight_finish(flight *f, int ok, int framed);
+int flight_detach(flight *f);
+ssize_t flight_read(flight *f, size_t off, char *dst, size_t max);
+void flight_release(flight *f);
+
+#endif /* __INFLIGHT_H__ */
@@ -0,0 +1,494 @@
+/*closed-loop load generator for the proxy.
+ * Every connection is a thread that sends a request through the proxy,
+ * waits for the whole response and sends the next one. Static requests
+ * go for objects obj0..objN-1 with Zipf popularity, the rest for
+ * tiny's adder with arguments never used before, which always miss.
+ * After a warmup the latency of every request is recorded and at the end
+ * the throughput, latency percentiles and, read off the proxy's
+ * /__proxy/stats page before and after, the cache hit ratio are printed.
+ * With -P it also reads the proxy's /proc/<pid>/io and prints the read
+ * and write class system calls (read, write, writev, sendfile, ...) the
+ * proxy made per request; epoll_wait, accept and setsockopt aren't
+ * counted there.
+ * With -g it instead writes the object set for tiny to serve, with sizes
+ * drawn from a fixed, uniform or Pareto distribution.*/
+#include "csapp.h"
+
+#define MAX_CONNS 1024
+//objects from a Pareto distribution are capped at this size
+#define MAX_GEN_SIZE (4*1024*1024)
+//first allocation of a connection's latency array
+#define LATENCY_MIN 4096
+//seconds a request may wait for its response before it counts as an
+//error, so a connection the proxy never serves doesn't stall the run
+#define REQUEST_TIMEOUT 5
+
+enum phase { WARMUP, MEASURE, STOP };
+
+struct conn{
+    pthread_t tid;
+    int id;
+    unsigned short rng[3];
+    int fd;
+    rio_t rio;
+    unsigned long seq;              //dynamic requests sent
+    //results, measured phase only
+    long *lat;                      //microseconds per request
+    size_t nlat, cap;
+    unsigned long errors, bytes, dynamic;
+};
+
+//options
+static char *proxy_host, *proxy_port, *origin;
+static int nconns = 8, duration = 10, warmup = 1, nobjects = 1000;
+static int dynamic_pct = 0, keep_alive = 0;
+static double zipf = 0.99;
+static char *dir;
+static unsigned seed = 1;
+static pid_t proxy_pid;
+
+static double *cdf;                 //Zipf popularity, cumulative
+static long *sizes;                 //object sizes, -1 if not known
+static volatile enum phase phase = WARMUP;
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-c conns] [-t secs] [-w secs] [-n objects] "
+            "[-z s] [-x pct] [-k]\n"
+            "       [-D dir] [-S seed] [-P pid] <proxy host:port> "
+            "<origin host:port>\n"
+            "       %s -g dir [-n objects] [-s fixed:N|uniform:MIN:MAX|"
+            "pareto:MIN:ALPHA] [-S seed]\n", prog, prog);
+    fprintf(stderr, "  -c  concurrent connections, each a closed loop\n");
+    fprintf(stderr, "  -t  seconds measured, after -w seconds of warmup\n");
+    fprintf(stderr, "  -n  number of objects\n");
+    fprintf(stderr, "  -z  Zipf exponent of object popularity, 0 is uniform\n");
+    fprintf(stderr, "  -x  percent of requests for uncacheable dynamic "
+                    "content\n");
+    fprintf(stderr, "  -k  keep connections alive between requests\n");
+    fprintf(stderr, "  -D  object directory, responses are checked against "
+                    "its sizes\n");
+    fprintf(stderr, "  -P  proxy's process id, its system calls per request "
+                    "are counted\n");
+    fprintf(stderr, "  -g  write the objects into dir and exit\n");
+    exit(1);
+}
+
+static long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+//split "host:port" in place
+static void split_addr(char *addr, char **host, char **port)
+{
+    char *colon = strrchr(addr, ':');
+    if(colon == NULL)
+    {
+        fprintf(stderr, "%s: expected host:port\n", addr);
+        exit(1);
+    }
+    *colon = '\0';
+    *host = addr;
+    *port = colon + 1;
+}
+
+/***** object set *****/
+
+static long draw_size(char *dist, unsigned short *rng)
+{
+    long a, b;
+    double alpha, s;
+
+    if(sscanf(dist, "fixed:%ld", &a) == 1) return a;
+    if(sscanf(dist, "uniform:%ld:%ld", &a, &b) == 2 && b >= a)
+        return a + (long)(erand48(rng) * (b - a + 1));
+    if(sscanf(dist, "pareto:%ld:%lf", &a, &alpha) == 2 && alpha > 0)
+    {
+        s = a / pow(1.0 - erand48(rng), 1.0 / alpha);
+        return s > MAX_GEN_SIZE ? MAX_GEN_SIZE : (long)s;
+    }
+    fprintf(stderr, "bad size distribution %s\n", dist);
+    exit(1);
+}
+
+static void generate(char *dir, char *dist)
+{
+    unsigned short rng[3] = { seed, seed >> 16, 0x1234 };
+    char path[MAXLINE], buf[MAXBUF];
+    long size, n, total = 0;
+    int i, fd;
+
+    for(i = 0; i < MAXBUF; i++) buf[i] = "abcdefghijklmnopqrstuvwxyz\n"[i % 27];
+    for(i = 0; i < nobjects; i++)
+    {
+        size = draw_size(dist, rng);
+        snprintf(path, MAXLINE, "%s/obj%d", dir, i);
+        fd = Open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        for(n = size; n > 0; n -= MAXBUF)
+            Rio_writen(fd, buf, n < MAXBUF ? n : MAXBUF);
+        Close(fd);
+        total += size;
+    }
+    printf("%d objects, %ld bytes, %ld on average\n", nobjects, total,
+           nobjects ? total / nobjects : 0);
+}
+
+static void load_sizes(void)
+{
+    char path[MAXLINE];
+    struct stat st;
+    int i;
+
+    sizes = Malloc(nobjects * sizeof(long));
+    for(i = 0; i < nobjects; i++)
+    {
+        snprintf(path, MAXLINE, "%s/obj%d", dir, i);
+        sizes[i] = (dir != NULL && stat(path, &st) == 0) ? st.st_size : -1;
+    }
+}
+
+//cumulative probabilities of a Zipf distribution with exponent zipf
+static void make_cdf(void)
+{
+    double sum = 0;
+    int i;
+
+    cdf = Malloc(nobjects * sizeof(double));
+    for(i = 0; i < nobjects; i++) cdf[i] = sum += 1.0 / pow(i + 1, zipf);
+    for(i = 0; i < nobjects; i++) cdf[i] /= sum;
+}
+
+static int pick_object(unsigned short *rng)
+{
+    double u = erand48(rng);
+    int lo = 0, hi = nobjects - 1, mid;
+
+    while(lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if(cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/***** requests *****/
+
+static void drop_conn(struct conn *c)
+{
+    if(c->fd >= 0) close(c->fd);
+    c->fd = -1;
+}
+
+//read one response. returns its status, 0 if the connection closed
+//before a status line and -1 on a broken response. *body gets the
+//body's length and *reuse whether the connection stays open
+static int read_response(struct conn *c, long *body, int *reuse)
+{
+    char line[MAXLINE], buf[MAXBUF];
+    long len = -1, n;
+    int status, minor;
+
+    if((n = rio_readlineb(&c->rio, line, MAXLINE)) <= 0) return n < 0 ? -1 : 0;
+    if(sscanf(line, "HTTP/1.%d %d", &minor, &status) != 2) return -1;
+    *reuse = keep_alive && minor >= 1;
+    while(1)
+    {
+        if(rio_readlineb(&c->rio, line, MAXLINE) <= 0) return -1;
+        if(strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0) break;
+        if(strncasecmp(line, "Content-Length:", 15) == 0)
+            len = strtol(line + 15, NULL, 10);
+        else if(strncasecmp(line, "Connection:", 11) == 0 &&
+                strcasestr(line + 11, "close") != NULL)
+            *reuse = 0;
+    }
+    //without a length the body runs to the end of the connection
+    if(len < 0) *reuse = 0;
+    *body = 0;
+    while(len < 0 || *body < len)
+    {
+        n = len < 0 || len - *body > MAXBUF ? MAXBUF : len - *body;
+        if((n = rio_readnb(&c->rio, buf, n)) < 0) return -1;
+        if(n == 0) break;
+        *body += n;
+    }
+    if(len >= 0 && *body < len) return -1;
+    return status;
+}
+
+//send one request, on a new connection unless the last one is kept.
+//a kept connection the proxy closed meanwhile is retried once.
+//returns 1 if the response is what was expected
+static int request(struct conn *c, char *req, size_t len, long expect,
+                   long *bytes)
+{
+    struct timeval timeout = { REQUEST_TIMEOUT, 0 };
+    int status, reuse, retry;
+
+    *bytes = 0;
+    for(retry = (c->fd >= 0); ; retry = 0)
+    {
+        if(c->fd < 0)
+        {
+            if((c->fd = open_clientfd(proxy_host, proxy_port)) < 0) return 0;
+            setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                       sizeof(timeout));
+            rio_readinitb(&c->rio, c->fd);
+        }
+        if(rio_writen(c->fd, req, len) == len &&
+           (status = read_response(c, bytes, &reuse)) != 0)
+            break;
+        drop_conn(c);
+        if(!retry) return 0;
+    }
+    if(status < 0 || !reuse) drop_conn(c);
+    return status == 200 && (expect < 0 || *bytes == expect);
+}
+
+static void *conn_thread(void *vargp)
+{
+    struct conn *c = vargp;
+    char req[MAXLINE];
+    long start, elapsed, expect, bytes;
+    size_t len;
+    int i, dynamic, ok;
+
+    while(phase != STOP)
+    {
+        dynamic = erand48(c->rng) * 100 < dynamic_pct;
+        if(dynamic)
+        {
+            len = snprintf(req, MAXLINE, "GET http://%s/cgi-bin/adder?%d&%lu "
+                           "HTTP/1.%d\r\nHost: %s\r\n\r\n", origin, c->id,
+                           c->seq++, keep_alive, origin);
+            expect = -1;
+        }
+        else
+        {
+            i = pick_object(c->rng);
+            len = snprintf(req, MAXLINE, "GET http://%s/obj%d HTTP/1.%d\r\n"
+                           "Host: %s\r\n\r\n", origin, i, keep_alive, origin);
+            expect = sizes[i];
+        }
+        start = now_us();
+        ok = request(c, req, len, expect, &bytes);
+        elapsed = now_us() - start;
+        if(phase != MEASURE) continue;
+
+        if(c->nlat == c->cap)
+        {
+            c->cap = c->cap ? 2 * c->cap : LATENCY_MIN;
+            c->lat = Realloc(c->lat, c->cap * sizeof(long));
+        }
+        c->lat[c->nlat++] = elapsed;
+        c->bytes += bytes;
+        c->dynamic += dynamic;
+        if(!ok) c->errors++;
+    }
+    drop_conn(c);
+    return NULL;
+}
+
+/***** results *****/
+
+//pull "name": value out of the proxy's statistics, -1 if it is missing
+static long json_field(char *json, char *name)
+{
+    char key[MAXLINE], *p;
+    snprintf(key, MAXLINE, "\"%s\": ", name);
+    if((p = strstr(json, key)) == NULL) return -1;
+    return strtol(p + strlen(key), NULL, 10);
+}
+
+//requests the proxy answered and how many of them from a cached copy,
+//0 if it doesn't serve /__proxy/stats
+static int proxy_stats(long *requests, long *hits)
+{
+    char buf[MAXBUF], *req = "GET /__proxy/stats?format=json HTTP/1.0\r\n\r\n";
+    struct timeval timeout = { REQUEST_TIMEOUT, 0 };
+    rio_t rio;
+    ssize_t n, len = 0;
+    int fd;
+
+    if((fd = open_clientfd(proxy_host, proxy_port)) < 0) return 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    rio_readinitb(&rio, fd);
+    if(rio_writen(fd, req, strlen(req)) > 0)
+        while(len < MAXBUF - 1 &&
+              (n = rio_readnb(&rio, buf + len, MAXBUF - 1 - len)) > 0)
+            len += n;
+    close(fd);
+    buf[len] = '\0';
+    *requests = json_field(buf, "requests");
+    *hits = json_field(buf, "hits") + json_field(buf, "disk_hits") +
+            json_field(buf, "revalidated");
+    return *requests >= 0 && json_field(buf, "hits") >= 0;
+}
+
+//read and write class system calls the proxy has made so far, 0 if
+//its /proc/<pid>/io can't be read
+static int proxy_syscalls(long *reads, long *writes)
+{
+    char path[MAXLINE], line[MAXLINE];
+    FILE *fp;
+
+    *reads = *writes = -1;
+    snprintf(path, MAXLINE, "/proc/%d/io", (int)proxy_pid);
+    if(proxy_pid == 0 || (fp = fopen(path, "r")) == NULL) return 0;
+    while(fgets(line, MAXLINE, fp) != NULL)
+    {
+        sscanf(line, "syscr: %ld", reads);
+        sscanf(line, "syscw: %ld", writes);
+    }
+    fclose(fp);
+    return *reads >= 0 && *writes >= 0;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static long percentile(long *lat, size_t n, double p)
+{
+    return n ? lat[(size_t)(p * (n - 1))] : 0;
+}
+
+static void report(struct conn *conns, double secs, int have_stats,
+                   long requests0, long hits0, long *calls)
+{
+    unsigned long errors = 0, bytes = 0, dynamic = 0;
+    long *lat, requests1, hits1;
+    size_t n = 0;
+    int i;
+
+    for(i = 0; i < nconns; i++) n += conns[i].nlat;
+    lat = Malloc((n ? n : 1) * sizeof(long));
+    for(n = 0, i = 0; i < nconns; i++)
+    {
+        memcpy(lat + n, conns[i].lat, conns[i].nlat * sizeof(long));
+        n += conns[i].nlat;
+        errors += conns[i].errors;
+        bytes += conns[i].bytes;
+        dynamic += conns[i].dynamic;
+    }
+    qsort(lat, n, sizeof(long), cmp_long);
+
+    printf("%d connections%s, %d objects, zipf %.2f, %d%% dynamic, "
+           "%.1f s\n", nconns, keep_alive ? " kept alive" : "", nobjects,
+           zipf, dynamic_pct, secs);
+    printf("requests %lu (%.1f/s), %lu dynamic, %lu errors, %.2f MB/s\n",
+           (unsigned long)n, n / secs, dynamic, errors, bytes / secs / 1e6);
+    printf("latency_us p50 %ld p99 %ld p999 %ld max %ld\n",
+           percentile(lat, n, 0.5), percentile(lat, n, 0.99),
+           percentile(lat, n, 0.999), n ? lat[n - 1] : 0);
+    if(have_stats && proxy_stats(&requests1, &hits1) &&
+       requests1 > requests0)
+        printf("cache hit ratio %.1f%% of %ld proxy requests\n",
+               100.0 * (hits1 - hits0) / (requests1 - requests0),
+               requests1 - requests0);
+    else printf("cache hit ratio unknown, the proxy has no stats page\n");
+    if(calls != NULL && n > 0)
+        printf("proxy syscalls per request %.2f, %.2f reads %.2f writes\n",
+               (double)(calls[2] - calls[0] + calls[3] - calls[1]) / n,
+               (double)(calls[2] - calls[0]) / n,
+               (double)(calls[3] - calls[1]) / n);
+    Free(lat);
+}
+
+int main(int argc, char *argv[])
+{
+    struct conn *conns;
+    char *gen_dir = NULL, *dist = "pareto:1024:1.2";
+    long requests0 = 0, hits0 = 0, start, stop, calls[4];
+    int opt, i, have_stats, have_calls;
+
+    while((opt = getopt(argc, argv, "c:t:w:n:z:x:kD:S:P:g:s:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'c':
+            nconns = atoi(optarg);
+            if(nconns <= 0 || nconns > MAX_CONNS) usage(argv[0]);
+            break;
+        case 't':
+            if((duration = atoi(optarg)) <= 0) usage(argv[0]);
+            break;
+        case 'w':
+            if((warmup = atoi(optarg)) < 0) usage(argv[0]);
+            break;
+        case 'n':
+            if((nobjects = atoi(optarg)) <= 0) usage(argv[0]);
+            break;
+        case 'z':
+            if((zipf = atof(optarg)) < 0) usage(argv[0]);
+            break;
+        case 'x':
+            dynamic_pct = atoi(optarg);
+            if(dynamic_pct < 0 || dynamic_pct > 100) usage(argv[0]);
+            break;
+        case 'k':
+            keep_alive = 1;
+            break;
+        case 'D':
+            dir = optarg;
+            break;
+        case 'S':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'P':
+            proxy_pid = atoi(optarg);
+            break;
+        case 'g':
+            gen_dir = optarg;
+            break;
+        case 's':
+            dist = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(gen_dir != NULL)
+    {
+        generate(gen_dir, dist);
+        return 0;
+    }
+    if(optind != argc - 2) usage(argv[0]);
+    split_addr(argv[optind], &proxy_host, &proxy_port);
+    origin = argv[optind + 1];
+
+    //a connection the proxy closed must not kill the generator
+    Signal(SIGPIPE, SIG_IGN);
+    make_cdf();
+    load_sizes();
+    conns = Calloc(nconns, sizeof(struct conn));
+    for(i = 0; i < nconns; i++)
+    {
+        conns[i].id = i;
+        conns[i].fd = -1;
+        conns[i].rng[0] = seed;
+        conns[i].rng[1] = i;
+        conns[i].rng[2] = 0x330e;
+        Pthread_create(&conns[i].tid, NULL, conn_thread, &conns[i]);
+    }
+    sleep(warmup);
+    have_stats = proxy_stats(&requests0, &hits0);
+    have_calls = proxy_syscalls(&calls[0], &calls[1]);
+    start = now_us();
+    phase = MEASURE;
+    sleep(duration);
+    phase = STOP;
+    stop = now_us();
+    have_calls = have_calls && proxy_syscalls(&calls[2], &calls[3]);
+    if(proxy_pid != 0 && !have_calls)
+        fprintf(stderr, "can't read /proc/%d/io\n", (int)proxy_pid);
+    for(i = 0; i < nconns; i++) Pthread_join(conns[i].tid, NULL);
+    report(conns, (stop - start) / 1e6, have_stats, requests0, hits0,
+           have_calls ? calls : NULL);
+    return 0;
+}
@@ -0,0 +1,341 @@
+/*eviction policies and the TinyLFU admission filter for the cache.
+ *  lru    evict the least recently used block
+ *  gdsf   Greedy-Dual-Size-Frequency: evict the block with the lowest
+ *         L + hits / slot size, so big rarely used objects go first
+ *  s3fifo a small probationary FIFO, a main FIFO with reinsertion and a
+ *         ghost table of keys evicted from the small queue
+ * A policy only orders blocks, the shard does the accounting and keeps
+ * asking for victims until a new block fits. An expendable block starts
+ * where the policy looks for victims first, it stays only if it is hit
+ * before its turn comes.*/
+#include "policy.h"
+
+/*********queue helpers, shared by LRU and S3-FIFO*********/
+static void queue_init(cache_block *head)
+{
+    head->prev = head->next = head;
+}
+
+static void queue_unlink(cache_block *block)
+{
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+}
+
+static void queue_push_front(cache_block *head, cache_block *block)
+{
+    block->prev = head;
+    block->next = head->next;
+    head->next->prev = block;
+    head->next = block;
+}
+
+static void queue_push_back(cache_block *head, cache_block *block)
+{
+    block->next = head;
+    block->prev = head->prev;
+    head->prev->next = block;
+    head->prev = block;
+}
+
+/*********LRU*********/
+static void lru_init(struct cache_shard *shard)
+{
+    queue_init(&shard->queues[0]);
+}
+
+static void lru_insert(struct cache_shard *shard, cache_block *block)
+{
+    if(block->meta.expendable) queue_push_back(&shard->queues[0], block);
+    else queue_push_front(&shard->queues[0], block);
+}
+
+//concurrent hits only serialize on the relink
+static void lru_hit(struct cache_shard *shard, cache_block *block)
+{
+    pthread_mutex_lock(&shard->policy_lock);
+    if(shard->queues[0].next != block)
+    {
+        queue_unlink(block);
+        queue_push_front(&shard->queues[0], block);
+    }
+    pthread_mutex_unlock(&shard->policy_lock);
+}
+
+static void lru_remove(struct cache_shard *shard, cache_block *block,
+                       int evicted)
+{
+    queue_unlink(block);
+}
+
+static cache_block *lru_victim(struct cache_shard *shard)
+{
+    return shard->queues[0].prev;
+}
+
+/*********GDSF*********/
+static void heap_swap(cache_block **heap, size_t i, size_t j)
+{
+    cache_block *t = heap[i];
+    heap[i] = heap[j];
+    heap[j] = t;
+    heap[i]->heap_idx = i;
+    heap[j]->heap_idx = j;
+}
+
+static void heap_up(cache_block **heap, size_t i)
+{
+    while(i > 0 && heap[(i-1)/2]->priority > heap[i]->priority)
+    {
+        heap_swap(heap, i, (i-1)/2);
+        i = (i-1)/2;
+    }
+}
+
+static void heap_down(cache_block **heap, size_t len, size_t i)
+{
+    size_t min, l, r;
+    while(1)
+    {
+        min = i;
+        l = 2*i + 1;
+        r = l + 1;
+        if(l < len && heap[l]->priority < heap[min]->priority) min = l;
+        if(r < len && heap[r]->priority < heap[min]->priority) min = r;
+        if(min == i) return;
+        heap_swap(heap, i, min);
+        i = min;
+    }
+}
+
+static void gdsf_init(struct cache_shard *shard)
+{
+    shard->heap_cap = CACHE_MIN_BUCKETS;
+    shard->heap = Malloc(shard->heap_cap * sizeof(cache_block *));
+    shard->heap_len = 0;
+    shard->inflation = 0;
+}
+
+static void gdsf_insert(struct cache_shard *shard, cache_block *block)
+{
+    if(shard->heap_len == shard->heap_cap)
+    {
+        shard->heap_cap *= 2;
+        shard->heap = Realloc(shard->heap,
+                              shard->heap_cap * sizeof(cache_block *));
+    }
+    //an expendable block has no hits to its credit yet
+    block->hits = !block->meta.expendable;
+    block->priority = shard->inflation + (double)block->hits / block->slot;
+    block->heap_idx = shard->heap_len;
+    shard->heap[shard->heap_len++] = block;
+    heap_up(shard->heap, block->heap_idx);
+}
+
+//a hit only raises the priority, so the block can only sink
+static void gdsf_hit(struct cache_shard *shard, cache_block *block)
+{
+    pthread_mutex_lock(&shard->policy_lock);
+    block->hits++;
+    block->priority = shard->inflation + (double)block->hits / block->slot;
+    heap_down(shard->heap, shard->heap_len, block->heap_idx);
+    pthread_mutex_unlock(&shard->policy_lock);
+}
+
+static void gdsf_remove(struct cache_shard *shard, cache_block *block,
+                        int evicted)
+{
+    size_t i = block->heap_idx;
+
+    //everything cached later has to beat the priority evicted here
+    if(evicted) shard->inflation = block->priority;
+    if(i != --shard->heap_len)
+    {
+        heap_swap(shard->heap, i, shard->heap_len);
+        heap_up(shard->heap, i);
+        heap_down(shard->heap, shard->heap_len, i);
+    }
+}
+
+static cache_block *gdsf_victim(struct cache_shard *shard)
+{
+    return shard->heap[0];
+}
+
+/*********S3-FIFO*********/
+#define S3FIFO_SMALL 0
+#define S3FIFO_MAIN 1
+#define S3FIFO_MAX_FREQ 3
+
+static unsigned long *ghost_slot(struct cache_shard *shard,
+                                 unsigned long hash)
+{
+    return &shard->ghosts[hash % S3FIFO_GHOSTS];
+}
+
+static void s3fifo_init(struct cache_shard *shard)
+{
+    queue_init(&shard->queues[S3FIFO_SMALL]);
+    queue_init(&shard->queues[S3FIFO_MAIN]);
+    shard->queue_size[S3FIFO_SMALL] = shard->queue_size[S3FIFO_MAIN] = 0;
+    memset(shard->ghosts, 0, sizeof(shard->ghosts));
+}
+
+static void s3fifo_push(struct cache_shard *shard, cache_block *block,
+                        int queue)
+{
+    block->queue = queue;
+    queue_push_front(&shard->queues[queue], block);
+    shard->queue_size[queue] += block->slot;
+}
+
+static void s3fifo_unlink(struct cache_shard *shard, cache_block *block)
+{
+    queue_unlink(block);
+    shard->queue_size[block->queue] -= block->slot;
+}
+
+//keys evicted from the small queue not long ago go straight to main.
+//expendable blocks go to the far end of the small queue and leave no
+//ghost
+static void s3fifo_insert(struct cache_shard *shard, cache_block *block)
+{
+    unsigned long *ghost = ghost_slot(shard, block->hash);
+    block->freq = 0;
+    if(block->meta.expendable)
+    {
+        block->queue = S3FIFO_SMALL;
+        queue_push_back(&shard->queues[S3FIFO_SMALL], block);
+        shard->queue_size[S3FIFO_SMALL] += block->slot;
+    }
+    else if(*ghost == block->hash)
+    {
+        *ghost = 0;
+        s3fifo_push(shard, block, S3FIFO_MAIN);
+    }
+    else s3fifo_push(shard, block, S3FIFO_SMALL);
+}
+
+//a hit only bumps a saturating counter, no lock needed
+static void s3fifo_hit(struct cache_shard *shard, cache_block *block)
+{
+    unsigned char f = __atomic_load_n(&block->freq, __ATOMIC_RELAXED);
+    if(f < S3FIFO_MAX_FREQ)
+        __atomic_store_n(&block->freq, f + 1, __ATOMIC_RELAXED);
+}
+
+static void s3fifo_remove(struct cache_shard *shard, cache_block *block,
+                          int evicted)
+{
+    if(evicted && block->queue == S3FIFO_SMALL && !block->meta.expendable)
+        *ghost_slot(shard, block->hash) = block->hash;
+    s3fifo_unlink(shard, block);
+}
+
+//blocks accessed while in the small queue are promoted to main, blocks
+//accessed while in main get another round. the first block that was
+//not accessed is the victim
+static cache_block *s3fifo_victim(struct cache_shard *shard)
+{
+    cache_block *small = &shard->queues[S3FIFO_SMALL];
+    cache_block *main = &shard->queues[S3FIFO_MAIN];
+    cache_block *block;
+
+    while(1)
+    {
+        if(small->prev != small &&
+           (shard->queue_size[S3FIFO_SMALL] * 100 >=
+            shard->capacity * S3FIFO_SMALL_PERCENT || main->prev == main))
+        {
+            block = small->prev;
+            if(block->freq == 0) return block;
+            s3fifo_unlink(shard, block);
+            block->freq = 0;
+            s3fifo_push(shard, block, S3FIFO_MAIN);
+        }
+        else
+        {
+            block = main->prev;
+            if(block->freq == 0) return block;
+            s3fifo_unlink(shard, block);
+            block->freq--;
+            s3fifo_push(shard, block, S3FIFO_MAIN);
+        }
+    }
+}
+
+static const cache_policy policies[] = {
+    { "lru", lru_init, lru_insert, lru_hit, lru_remove, lru_victim },
+    { "gdsf", gdsf_init, gdsf_insert, gdsf_hit, gdsf_remove, gdsf_victim },
+    { "s3fifo", s3fifo_init, s3fifo_insert, s3fifo_hit, s3fifo_remove,
+      s3fifo_victim },
+};
+
+//policy called name, NULL if there is none
+const cache_policy *policy_lookup(char *name)
+{
+    size_t i;
+    for(i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+        if(strcmp(policies[i].name, name) == 0) return &policies[i];
+    return NULL;
+}
+
+/*********TinyLFU admission*********/
+//the sketch is halved after this many recorded accesses, so old
+//popularity fades
+#define TINYLFU_SAMPLES (10 * TINYLFU_WIDTH)
+#define TINYLFU_MAX 15
+
+//one independent index per sketch row from the key's hash
+static size_t sketch_index(unsigned long hash, int row)
+{
+    static const unsigned long seeds[TINYLFU_DEPTH] = {
+        0x9e3779b97f4a7c15UL, 0xc2b2ae3d27d4eb4fUL,
+        0x165667b19e3779f9UL, 0x27d4eb2f165667c5UL
+    };
+    hash *= seeds[row];
+    return (hash >> 32) & (TINYLFU_WIDTH - 1);
+}
+
+//count one access to hash. runs under the shared lock, so counters are
+//touched atomically; a lost update only makes the estimate rougher
+void tinylfu_record(struct cache_shard *shard, unsigned long hash)
+{
+    unsigned char *c;
+    unsigned char v;
+    int row, i;
+
+    for(row = 0; row < TINYLFU_DEPTH; row++)
+    {
+        c = &shard->sketch[row][sketch_index(hash, row)];
+        v = __atomic_load_n(c, __ATOMIC_RELAXED);
+        if(v < TINYLFU_MAX) __atomic_store_n(c, v + 1, __ATOMIC_RELAXED);
+    }
+    if(__atomic_add_fetch(&shard->samples, 1, __ATOMIC_RELAXED) ==
+       TINYLFU_SAMPLES)
+    {
+        for(row = 0; row < TINYLFU_DEPTH; row++)
+        {
+            for(i = 0; i < TINYLFU_WIDTH; i++)
+            {
+                c = &shard->sketch[row][i];
+                __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) / 2,
+                                 __ATOMIC_RELAXED);
+            }
+        }
+        __atomic_store_n(&shard->samples, 0, __ATOMIC_RELAXED);
+    }
+}
+
+//estimated recent accesses of hash, the smallest of its counters
+int tinylfu_estimate(struct cache_shard *shard, unsigned long hash)
+{
+    int row, v, min = TINYLFU_MAX;
+    for(row = 0; row < TINYLFU_DEPTH; row++)
+    {
+        v = __atomic_load_n(&shard->sketch[row][sketch_index(hash, row)],
+                            __ATOMIC_RELAXED);
+        if(v < min) min = v;
+    }
+    return min;
+}
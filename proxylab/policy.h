@@ -0,0 +1,26 @@
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+#include "cache.h"
+
+//eviction policy of a cache shard. insert, remove and victim run with
+//the shard's lock held exclusively. hit runs with it held shared, so it
+//must be safe against concurrent hits on the same shard
+typedef struct cache_policy {
+    const char *name;
+    void (*init)(struct cache_shard *shard);
+    void (*insert)(struct cache_shard *shard, cache_block *block);
+    void (*hit)(struct cache_shard *shard, cache_block *block);
+    //block leaves the cache, evicted or replaced by a newer copy
+    void (*remove)(struct cache_shard *shard, cache_block *block,
+                   int evicted);
+    //next block to evict, still linked
+    cache_block *(*victim)(struct cache_shard *shard);
+} cache_policy;
+
+const cache_policy *policy_lookup(char *name);
+
+void tinylfu_record(struct cache_shard *shard, unsigned long hash);
+int tinylfu_estimate(struct cache_shard *shard, unsigned long hash);
+
+#endif /* __POLICY_H__ */
@@ -3,59 +3,265 @@
  * receives response from the server and forward it to the client.
  * Caching is implemented and used to ensure that if the request is
  * in the cache, response is sent to the client without connecting to
- * the server. Pseudo-LRU policy is used for eviction process for
- * caching.*/
-#include "csapp.h"
-#include "cache.h"
-
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+ * the server. The cache is split into independently locked shards,
+ * each a hash index over a slab arena with a pluggable eviction policy
+ * (policy.c: LRU, GDSF or S3-FIFO, optionally behind a TinyLFU
+ * admission filter). With -d objects evicted from memory go to a
+ * segment file on disk (disk.c) and are served from there, also across
+ * restarts. Cached copies are served while they are
+ * fresh; a stale one is revalidated with a conditional request and a
+ * 304 keeps it without downloading the body again.
+ * By default every connection gets its own thread; -m pool hands
+ * connections to a prethreaded worker pool through a bounded queue
+ * (sbuf.c) and -m epoll serves them from a fixed number of event loops
+ * (event.c). Both count requests and time them into histograms
+ * (stats.c), served as a page at /__proxy/stats. Requests for a byte
+ * range are answered from fixed-size chunks of the object (range.c).
+ * Client sockets have Nagle's algorithm off: a hit leaves in a single
+ * writev, and a relayed miss is corked so its head and body share
+ * full segments. Text is cached gzip encoded (gzip.c) and inflated for
+ * clients that don't take gzip. SIGUSR2 writes the memory tier to a
+ * snapshot file (snapshot.c) that --warm-from loads before the first
+ * connection, so a restarted proxy doesn't send every request to the
+ * servers at once.
+ * CONNECT opens a tunnel to the target (tunnel.c) that relays bytes
+ * both ways until either side is done with it.*/
+#include <netinet/tcp.h>
+#include <getopt.h>
+#include "proxy.h"
+#include "event.h"
+#include "sbuf.h"
+#include "http.h"
+#include "upstream.h"
+#include "inflight.h"
+#include "dns.h"
+#include "stats.h"
+#include "range.h"
+#include "snapshot.h"
+#include "gzip.h"
+#include "tunnel.h"
+
 /* You won't lose style points for including these long lines in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
-static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
+static const char *accept_encoding_hdr = "Accept-Encoding: gzip\r\n";
+static const char *identity_hdr = "Accept-Encoding: identity\r\n";
+//client headers that are not passed on: hop-by-hop ones, the ones the
+//proxy sets itself and the ones that would make the response something
+//other than the full object the cache wants
+static const char *dropped_hdrs[] = {
+    "Connection", "Proxy-Connection", "Keep-Alive", "TE", "Trailer",
+    "Upgrade", "Proxy-Authorization", "Host", "User-Agent", "Accept",
+    "Accept-Encoding", "Content-Length", "Transfer-Encoding",
+    "If-None-Match", "If-Modified-Since", "If-Match", "If-Unmodified-Since",
+    "If-Range", "Range", NULL
+};
+//room for the conditional headers of a revalidation
+#define CONDITIONAL_LEN (2 * CACHE_VALIDATOR_LEN + 64)
+//front ends selected with -m
+enum mode { MODE_THREAD, MODE_POOL, MODE_EPOLL };
+//default number of pool workers per cpu
+#define POOL_THREADS_PER_CPU 4
+//default connection queue slots per pool worker
+#define QUEUE_SLOTS_PER_THREAD 4
+//seconds a persistent client connection may sit idle between requests
+#define CLIENT_IDLE_TIMEOUT 5
+//seconds a write to a client may block before the client counts as
+//gone, so one that stops reading doesn't hold a thread for good
+#define CLIENT_SEND_TIMEOUT 30
+//microseconds accepting pauses when out of file descriptors
+#define ACCEPT_BACKOFF_US 10000
 //global variables
-sem_t mutex, cache_mut, op_mut;
-cache_block *cache;
-int readcnt;
+cache_t cache;
+disk_t disk;
+sbuf_t sbuf;
+int use_splice = 1;
+enum mode mode = MODE_THREAD;
+char *snapshot_path = NULL;
+//long names of the snapshot options
+static struct option long_options[] = {
+    {"snapshot", required_argument, NULL, 'S'},
+    {"warm-from", required_argument, NULL, 'w'},
+    {NULL, 0, NULL, 0}
+};
 //helper functions
 void *thread(void *vargp);
-void operate(int connfd);
-int parse(char *uri, char *hostname, char *port, char *filepath);
+void *worker(void *vargp);
+void *reporter(void *vargp);
+void serve_client(int connfd);
+int operate(int connfd, rio_t *client_rio);
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-m thread|pool|epoll] [-n nthreads] "
+            "[-q qslots] [-i idle] [-r splice|copy]\n"
+            "       [-p lru|gdsf|s3fifo] [-a] [-d file] [-u fetches] "
+            "[--snapshot file]\n"
+            "       [--warm-from file] <port>\n", prog);
+    fprintf(stderr, "  -m  front end: a thread per connection (default),\n"
+                    "      a prethreaded worker pool or epoll event loops\n");
+    fprintf(stderr, "  -n  number of pool workers or event loop threads\n");
+    fprintf(stderr, "  -q  connection queue slots for -m pool\n");
+    fprintf(stderr, "  -i  seconds an idle server connection is kept\n");
+    fprintf(stderr, "  -r  relay response bodies and tunnels with splice\n"
+                    "      (default) or by copying through user space\n");
+    fprintf(stderr, "  -p  cache eviction policy, lru by default\n");
+    fprintf(stderr, "  -a  admit new objects through a TinyLFU filter\n");
+    fprintf(stderr, "  -d  keep objects evicted from memory in file\n");
+    fprintf(stderr, "  -u  fetches in progress per origin at most\n");
+    fprintf(stderr, "  --snapshot   SIGUSR2 writes the memory cache to file,\n"
+                    "               SIGTERM too before the proxy exits\n");
+    fprintf(stderr, "  --warm-from  load a snapshot before accepting "
+                    "connections\n");
+    fprintf(stderr, "  SIGUSR1 prints cache, queue and dns statistics\n");
+    fprintf(stderr, "  GET %s[?format=json] on the proxy's port shows\n"
+                    "  request counters and latency percentiles\n",
+            STATS_PATH);
+    exit(1);
+}
+
+//accept the next client. a failed accept is not fatal: the client may
+//have given up already, and when descriptors run out the proxy backs
+//off a moment for connections to finish. returns -1 on failure
+static int accept_client(int listenfd)
+{
+    int connfd = accept(listenfd, NULL, NULL);
+    if(connfd < 0 && (errno == EMFILE || errno == ENFILE))
+        usleep(ACCEPT_BACKOFF_US);
+    return connfd;
+}
 
-//main function to initialize cache and semaphores
-//Also accepts connection, creates threads
+//main function to initialize cache and parse options
+//Also accepts connection, hands it to a thread
 int main(int argc, char *argv[])
 {
-    int listenfd;
-    struct sockaddr_in clientaddr;
-    socklen_t clientlen = sizeof(struct sockaddr_in);
+    int listenfd, opt, i;
+    char *policy = "lru";
+    char *disk_path = NULL, *warm_path = NULL;
+    int tinylfu = 0;
+    int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = 0, qslots = 0;
+    int idle_timeout = UPSTREAM_IDLE_TIMEOUT;
+    int per_origin = UPSTREAM_MAX_PER_ORIGIN;
     int *connfd;
     pthread_t tid;
-    cache = NULL;
-    readcnt = 0;
+    sigset_t mask;
+    snapshot_stats st;
+
+    while((opt = getopt_long(argc, argv, "m:n:q:i:r:p:ad:u:S:w:",
+                             long_options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+        case 'm':
+            if(strcmp(optarg, "epoll") == 0) mode = MODE_EPOLL;
+            else if(strcmp(optarg, "pool") == 0) mode = MODE_POOL;
+            else if(strcmp(optarg, "thread") == 0) mode = MODE_THREAD;
+            else usage(argv[0]);
+            break;
+        case 'n':
+            if((nthreads = atoi(optarg)) <= 0) usage(argv[0]);
+            break;
+        case 'q':
+            if((qslots = atoi(optarg)) <= 0) usage(argv[0]);
+            break;
+        case 'i':
+            if((idle_timeout = atoi(optarg)) <= 0) usage(argv[0]);
+            break;
+        case 'r':
+            if(strcmp(optarg, "splice") == 0) use_splice = 1;
+            else if(strcmp(optarg, "copy") == 0) use_splice = 0;
+            else usage(argv[0]);
+            break;
+        case 'p':
+            policy = optarg;
+            break;
+        case 'a':
+            tinylfu = 1;
+            break;
+        case 'd':
+            disk_path = optarg;
+            break;
+        case 'u':
+            if((per_origin = atoi(optarg)) <= 0) usage(argv[0]);
+            break;
+        case 'S':
+            snapshot_path = optarg;
+            break;
+        case 'w':
+            warm_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1) usage(argv[0]);
 
-    sem_init(&cache_mut, 0, 1);
-    sem_init(&op_mut, 0, 1);
-    sem_init(&mutex, 0, 1);
+    if(cache_init(&cache, policy, tinylfu) < 0) usage(argv[0]);
+    if(disk_path != NULL)
+    {
+        if(disk_open(&disk, disk_path, DISK_DEFAULT_SIZE) < 0)
+            unix_error("can't open disk cache");
+        cache.disk = &disk;
+        fprintf(stderr, "disk cache %s: %lu objects recovered\n",
+                disk_path, disk.recovered);
+    }
+    //the cache is filled before the port opens, clients never see it
+    //half loaded
+    if(warm_path != NULL)
+    {
+        if(snapshot_load(&cache, warm_path, &st) < 0)
+            fprintf(stderr, "can't warm from %s: %s\n", warm_path,
+                    strerror(errno));
+        else fprintf(stderr, "warm start from %s: %lu of %lu objects, "
+                     "%lu bytes in %.1f ms\n", warm_path, st.loaded,
+                     st.records, st.bytes, st.us / 1000.0);
+    }
+    //SIGUSR1, SIGUSR2 and SIGTERM are only taken by the reporter
+    //thread, so they are blocked before any other thread starts
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGUSR1);
+    Sigaddset(&mask, SIGUSR2);
+    Sigaddset(&mask, SIGTERM);
+    Sigprocmask(SIG_BLOCK, &mask, NULL);
+    Pthread_create(&tid, NULL, reporter, NULL);
+    dns_init();
+    upstream_init(idle_timeout, per_origin);
     //ignore sigpipe
     Signal(SIGPIPE, SIG_IGN);
 
-    if(argc != 2) 
+    listenfd = Open_listenfd(argv[optind]);
+    switch(mode)
     {
-        fprintf(stderr, "wrong number of arguments\n");
-        exit(1);
+    case MODE_EPOLL:
+        event_serve(listenfd, nthreads ? nthreads : ncpus);
+        return 0;
+    case MODE_POOL:
+        if(nthreads == 0) nthreads = POOL_THREADS_PER_CPU * ncpus;
+        if(qslots == 0) qslots = QUEUE_SLOTS_PER_THREAD * nthreads;
+        sbuf_init(&sbuf, qslots);
+        for(i = 0; i < nthreads; i++)
+            Pthread_create(&tid, NULL, worker, NULL);
+        while(1)
+        {
+            //a full queue blocks here and the kernel's listen
+            //backlog absorbs the rest of the spike
+            if((i = accept_client(listenfd)) >= 0) sbuf_insert(&sbuf, i);
+        }
+    case MODE_THREAD:
+        break;
     }
-
-    listenfd = Open_listenfd(argv[1]);
     while(1)
     {
-        connfd = malloc(sizeof(int));
-        *connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        //lock before creating threads
-        P(&mutex);
-        pthread_create(&tid, NULL, thread, connfd);
+        if((i = accept_client(listenfd)) < 0) continue;
+        connfd = Malloc(sizeof(int));
+        *connfd = i;
+        //each thread owns and frees its own copy of the descriptor
+        if(pthread_create(&tid, NULL, thread, connfd) != 0)
+        {
+            close(i);
+            Free(connfd);
+        }
     }
     return 0;
 }
@@ -64,135 +270,692 @@ int main(int argc, char *argv[])
 void *thread(void *vargp)
 {
     int connfd = *((int *)vargp);
-    //unlock
-    V(&mutex);
     pthread_detach(pthread_self());
     //note that vargp, connfd from main, was malloced
     free(vargp);
-    operate(connfd);
+    serve_client(connfd);
     close(connfd);
     return NULL;
 }
 
+//prethreaded worker, serves connections from the queue forever
+void *worker(void *vargp)
+{
+    int connfd;
+    Pthread_detach(pthread_self());
+    while(1)
+    {
+        connfd = sbuf_remove(&sbuf);
+        serve_client(connfd);
+        close(connfd);
+    }
+    return NULL;
+}
+
+//SIGUSR2, and SIGTERM before the proxy exits: write the memory cache
+//to path and say how that went
+static void snapshot(char *path)
+{
+    snapshot_stats st;
+
+    if(snapshot_save(&cache, path, &st) < 0)
+        fprintf(stderr, "can't write snapshot %s: %s\n", path,
+                strerror(errno));
+    else fprintf(stderr, "snapshot %s: %lu objects, %lu bytes in %.1f ms\n",
+                 path, st.records, st.bytes, st.us / 1000.0);
+}
+
+//prints the cache, disk, dns, upstream and queue metrics on every
+//SIGUSR1 and saves a snapshot on SIGUSR2 and SIGTERM
+void *reporter(void *vargp)
+{
+    sigset_t mask;
+    int sig;
+
+    Pthread_detach(pthread_self());
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGUSR1);
+    Sigaddset(&mask, SIGUSR2);
+    Sigaddset(&mask, SIGTERM);
+    while(sigwait(&mask, &sig) == 0)
+    {
+        if(sig != SIGUSR1)
+        {
+            if(snapshot_path != NULL) snapshot(snapshot_path);
+            if(sig == SIGTERM) exit(0);
+            continue;
+        }
+        cache_report(&cache, stderr);
+        if(cache.disk != NULL) disk_report(cache.disk, stderr);
+        dns_report(stderr);
+        upstream_report(stderr);
+        if(mode == MODE_POOL) sbuf_report(&sbuf, stderr);
+    }
+    return NULL;
+}
+
+//answer requests on a persistent client connection in order until the
+//client closes, idles out or a response can't be delimited
+void serve_client(int connfd)
+{
+    rio_t client_rio;
+    struct timeval idle = { CLIENT_IDLE_TIMEOUT, 0 };
+    struct timeval send = { CLIENT_SEND_TIMEOUT, 0 };
+    int one = 1;
+
+    //a pool worker must not be held forever by an idle client, nor by
+    //one that stops reading
+    setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &send, sizeof(send));
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    rio_readinitb(&client_rio, connfd);
+    while(operate(connfd, &client_rio))
+        ;
+}
+
+//relay state for one response: bytes go to the client, to followers
+//and, while the response still fits, into the cache fill
+struct relay_ctx{
+    int connfd;
+    cache_fill fill;
+    flight *f;                  //followers waiting on this fetch
+    size_t sent;                //bytes written to the client
+};
+
+//the copy kept for the cache and followers. once neither wants it the
+//rest of a spliced response no longer passes through user space
+static int copy_sink(void *arg, char *data, size_t n)
+{
+    struct relay_ctx *ctx = arg;
+    cache_fill_append(&ctx->fill, data, n);
+    flight_append(ctx->f, data, n);
+    return !ctx->fill.ok && flight_detach(ctx->f);
+}
+
+static int relay_sink(void *arg, char *data, size_t n)
+{
+    struct relay_ctx *ctx = arg;
+    //write response to client, a client that is gone or stuck ends
+    //the relay
+    if(rio_writen(ctx->connfd, data, n) != n) return -1;
+    ctx->sent += n;
+    copy_sink(arg, data, n);
+    return 0;
+}
+
+//while corked, the kernel sends only full segments, the rest goes out
+//once the response is done and the socket is uncorked
+void cork(int fd, int on)
+{
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+//another thread is already fetching this uri, stream its bytes to the
+//client as they arrive. returns 1 if the client connection can carry
+//another request
+static int follow(int connfd, flight *f, stats_req *sr)
+{
+    char buf[MAXBUF];
+    size_t off = 0;
+    ssize_t n;
+
+    while((n = flight_read(f, off, buf, MAXBUF)) > 0)
+    {
+        stats_first_byte(sr);
+        if(rio_writen(connfd, buf, n) != n)
+        {
+            n = -2;
+            break;
+        }
+        off += n;
+    }
+    //the leader's fetch failed before any of the response came in
+    if(n == -1 && off == 0)
+        client_error(connfd, "502 Bad Gateway",
+                     "The proxy could not fetch the page");
+    stats_done(sr, n == 0 ? STATS_COALESCED : STATS_FAILED, off);
+    return n == 0 && f->framed;
+}
+
+//send a cached response to the client, outcome says how it was found
+//for the statistics. returns 1 if the client connection can carry
+//another request
+static int send_block(int connfd, cache_block *block, stats_req *sr,
+                      enum stats_counter outcome, int keep_alive)
+{
+    struct iovec iov[HIT_IOV];
+    char hdrs[HIT_HEADERS_LEN];
+    ssize_t n;
+
+    keep_alive = keep_alive && block->framed;
+    //block is pinned, so it can be sent without holding any lock
+    //even if it gets evicted meanwhile
+    stats_first_byte(sr);
+    n = http_writev(connfd, iov, hit_iov(iov, hdrs, block, keep_alive));
+    stats_done(sr, outcome, n > 0 ? n : 0);
+    cache_release(block);
+    return keep_alive && n >= 0;
+}
+
+//send an object from the disk tier with sendfile. returns 1 if the
+//client connection can carry another request
+static int send_disk(int connfd, disk_entry *e, stats_req *sr)
+{
+    size_t off = 0;
+    ssize_t n;
+    int framed = e->framed;
+
+    stats_first_byte(sr);
+    while(off < e->size)
+    {
+        if((n = disk_send(cache.disk, e, connfd, &off)) < 0 && errno == EINTR)
+            continue;
+        if(n <= 0) break;
+    }
+    n = (off == e->size);
+    stats_done(sr, STATS_DISK_HITS, off);
+    disk_release(cache.disk, e);
+    return framed && n;
+}
+
+//the header lines that turn the request into a conditional one for a
+//stale copy
+static void add_conditional(char *cond, cache_block *block)
+{
+    char *end = cond;
+    *end = '\0';
+    if(block->meta.etag[0] != '\0')
+        end += sprintf(end, "If-None-Match: %s\r\n", block->meta.etag);
+    if(block->meta.last_modified[0] != '\0')
+        end += sprintf(end, "If-Modified-Since: %s\r\n",
+                       block->meta.last_modified);
+}
+
+//the server answered a conditional request with 304, so the stale
+//copy is current again: it is refreshed and goes to the client and the
+//followers. returns 1 if the client connection can carry another request
+static int revalidated(int connfd, upstream_conn *uc, http_response *resp,
+                       cache_key *key, cache_block *block, flight *f,
+                       stats_req *sr, int keep_alive, int gzip)
+{
+    long lifetime = http_freshness(resp);
+    //a 304 that says nothing keeps the lifetime of the stored response
+    if(lifetime < 0) lifetime = block->meta.lifetime;
+    cache_refresh(block, lifetime, resp->age);
+    if(resp->keep_alive) upstream_put(uc);
+    else upstream_close(uc);
+    if((block = gzip_for_client(&cache, key, block, gzip)) == NULL)
+    {
+        client_error(connfd, "502 Bad Gateway", "The cached copy is damaged");
+        stats_done(sr, STATS_FAILED, 0);
+        flight_finish(f, 0, 0);
+        flight_release(f);
+        return 0;
+    }
+    flight_append(f, block->buf, block->size);
+    flight_finish(f, 1, block->framed);
+    flight_release(f);
+    return send_block(connfd, block, sr, STATS_REVALIDATED, keep_alive);
+}
+
+//send the request in iov over a pooled server connection and read the
+//response head. a pooled connection the server has meanwhile closed
+//is retried once on a fresh one. returns NULL if the server can't be
+//reached, is too busy or answers with garbage, with *status the error
+//to give the client
+upstream_conn *fetch_head(char *hostname, char *port, struct iovec *iov,
+                          int n, char *head, ssize_t *head_len,
+                          http_response *resp, char **status)
+{
+    upstream_conn *uc;
+    int reused;
+
+    *status = "502 Bad Gateway";
+    while((uc = upstream_get(hostname, port)) != NULL)
+    {
+        if(http_writev(uc->fd, iov, n) >= 0 &&
+           (*head_len = http_read_response_head(&uc->rio, head, MAXLINE,
+                                                resp)) > 0)
+            return uc;
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+            *status = "504 Gateway Timeout";
+        reused = uc->reused;
+        upstream_close(uc);
+        if(!reused) break;
+    }
+    if(uc == NULL && errno == EBUSY) *status = "503 Service Unavailable";
+    return NULL;
+}
+
+//answer a request for the proxy's own statistics page
+static int send_stats(int connfd, int json)
+{
+    char buf[MAXBUF];
+    size_t n = stats_response(buf, MAXBUF, &cache, json);
+    return rio_writen(connfd, buf, n) == n;
+}
+
+//connect a CONNECT request to its target and tunnel between the two.
+//the connection is done with afterwards, a tunnel holds it to the end
+static int open_tunnel(int connfd, rio_t *client_rio, http_request *req)
+{
+    int serverfd;
+
+    if((serverfd = dns_connect(req->hostname, req->port)) < 0)
+    {
+        fprintf(stderr, "can't connect to %s:%s\n", req->hostname, req->port);
+        client_error(connfd, "502 Bad Gateway",
+                     "The proxy could not reach the server");
+        stats_count(STATS_UPSTREAM_FAILURES, 1);
+        return 0;
+    }
+    stats_count(STATS_TUNNELS, 1);
+    //what the client sent right behind the request, a TLS hello most
+    //likely, is still in client_rio's buffer
+    stats_count(STATS_BYTES_TUNNELED,
+                tunnel_relay(connfd, serverfd, client_rio->rio_bufptr,
+                             client_rio->rio_cnt, use_splice));
+    close(serverfd);
+    return 0;
+}
+
 /*read request from client
 parse request
 if request not in cache, send request to server
 read response from server
 write(forward) to client
-add to cache*/
-void operate(int connfd)
-{
-    rio_t client_rio, server_rio;
-    char buf[MAXLINE], response_buf[MAXLINE],
-         method[MAXLINE], uri[MAXLINE], httpver[MAXLINE],
-         hostname[MAXLINE], filepath[MAXLINE],
-         proxy_request[MAXLINE],
-         port[MAXLINE];
-    int serverfd, numbytes;
-    size_t temp;
+add to cache
+returns 1 if the client connection can carry another request*/
+int operate(int connfd, rio_t *client_rio)
+{
+    char head[MAXLINE], cond[CONDITIONAL_LEN], *uri, *status;
+    char key_buf[CACHE_KEY_LEN], variant_buf[CACHE_KEY_LEN];
+    char flight_key[CACHE_KEY_LEN + 16];
+    cache_key key, variant, *k;
+    struct iovec iov[HTTP_REQUEST_IOV];
+    ssize_t head_len;
+    int rc, keep_alive, leader, n, json, gzip;
+    long first, last;
     cache_block *block;
+    disk_entry *de;
+    flight *f;
+    upstream_conn *uc;
+    http_request req;
+    http_response resp;
+    struct relay_ctx ctx;
+    stats_req sr;
 
-    //read from client
-    Rio_readinitb(&client_rio, connfd);
-    Rio_readlineb(&client_rio, buf, MAXLINE);
-    sscanf(buf, "%s %s %s", method, uri, httpver);
-    
-    //check if request exists in cache
-    P(&op_mut);
-    readcnt++;
-    if(readcnt == 1) P(&cache_mut);
-    V(&op_mut);
-
-    //access cache safely
-    block = cache_inquiry(uri, cache);
+    //read from client, pipelined requests wait in client_rio's buffer.
+    //the head is parsed where it lies in that buffer and stays there
+    //until the next request is read
+    if((rc = http_read_request(client_rio, &req)) <= 0)
+    {
+        if(rc == -2)
+            client_error(connfd, "408 Request Timeout",
+                         "The request head took too long");
+        else if(rc < 0)
+        {
+            stats_count(STATS_BAD_REQUESTS, 1);
+            client_error(connfd, "400 Bad Request",
+                         "The proxy could not parse the request");
+        }
+        return 0;
+    }
+    stats_start(&sr);
+    //request bodies are not relayed, so nothing can follow one
+    keep_alive = req.keep_alive && req.content_length <= 0 && !req.chunked;
+    if(stats_request(&req, &json)) return send_stats(connfd, json) && keep_alive;
+    if(req.connect) return open_tunnel(connfd, client_rio, &req);
+    if(strcmp(req.method.p, "GET") != 0 || req.hostname[0] == '\0')
+    {
+        stats_count(STATS_BAD_REQUESTS, 1);
+        if(req.hostname[0] == '\0')
+            client_error(connfd, "400 Bad Request",
+                         "The proxy only takes absolute http:// URIs");
+        else client_error(connfd, "501 Not Implemented",
+                          "The proxy only forwards GET requests");
+        return 0;
+    }
+    uri = req.uri.p;
+    if(!request_key(&req, &key, key_buf))
+    {
+        stats_count(STATS_BAD_REQUESTS, 1);
+        client_error(connfd, "414 URI Too Long", "The URI is too long");
+        return 0;
+    }
+    k = &key;
+    gzip = http_accepts_gzip(&req);
+
+    //a single byte range is served from cached chunks of the object
+    if(http_request_range(&req, &first, &last))
+        return range_serve(connfd, &req, &key, first, last, keep_alive,
+                           &sr);
     
-    P(&op_mut);
-    readcnt--;
-    if(readcnt == 0) V(&cache_mut);
-    V(&op_mut);
-    //lock to write to client, unlock afterwards
-    P(&mutex);
+    //check if request exists in cache, the cache does its own locking
+    block = lookup(&k, &variant, variant_buf, &req);
     if(block != NULL)
     {
         /*********request exits in cache*****************/
-        Rio_writen(connfd, block->buf, block->size);
-        V(&mutex);
-        return;
+        //a copy that won't inflate is fetched again
+        if(cache_fresh(block) &&
+           (block = gzip_for_client(&cache, k, block, gzip)) != NULL)
+            return send_block(connfd, block, &sr, STATS_HITS, keep_alive);
+        //stale, the fetch below revalidates it
+        if(block != NULL) cache_release(block);
+    }
+    else if(cache.disk != NULL && (de = disk_inquiry(cache.disk, k->str)) != NULL)
+    {
+        if(!de->gzip || gzip) return send_disk(connfd, de, &sr) && keep_alive;
+        disk_release(cache.disk, de);
     }
-    V(&mutex);
     
     /***********request doesn't exist in cache*********/
-    //parse uri
-    if (!parse(uri, hostname, port, filepath))
+    //only one concurrent miss per uri and encoding goes to the server,
+    //the followers get the leader's bytes as they are
+    snprintf(flight_key, sizeof(flight_key), "%s%s", k->str,
+             gzip ? "" : " identity");
+    f = flight_begin(flight_key, &leader);
+    if(!leader)
     {
-        fprintf(stderr, "parsing error");
-        return;
+        rc = follow(connfd, f, &sr);
+        flight_release(f);
+        return rc && keep_alive;
+    }
+    //the previous fetch may have finished between the lookup and
+    //flight_begin, in which case its followers get the cached copy
+    if((block = cache_inquiry(k, &cache)) != NULL && cache_fresh(block) &&
+       (block = gzip_for_client(&cache, k, block, gzip)) != NULL)
+    {
+        flight_append(f, block->buf, block->size);
+        flight_finish(f, 1, block->framed);
+        flight_release(f);
+        return send_block(connfd, block, &sr, STATS_HITS, keep_alive);
+    }
+    //a stale copy without validators is simply fetched again
+    if(block != NULL && block->meta.etag[0] == '\0' &&
+       block->meta.last_modified[0] == '\0')
+    {
+        cache_release(block);
+        block = NULL;
     }
-    //prepare request
-    sprintf(proxy_request, "GET %s HTTP/1.0\r\n", filepath);
-    //headers
-    strcat(proxy_request, "Host: ");
-    strcat(proxy_request, hostname);
-    strcat(proxy_request, "\r\n");
-    strcat(proxy_request, user_agent_hdr);
-    strcat(proxy_request, accept_hdr);
-    strcat(proxy_request, accept_encoding_hdr);
-    strcat(proxy_request, "Connection: close\r\n");
-    strcat(proxy_request, "Proxy-Connection: close\r\n");
-    strcat(proxy_request, "\r\n");
+    //prepare request, the server connection is kept alive
+    cond[0] = '\0';
+    if(block != NULL) add_conditional(cond, block);
+    n = build_request(iov, &req, 1, cond);
     //request to server
-    serverfd = open_clientfd(hostname, port);
-    //send line to server
-    Rio_writen(serverfd, proxy_request, strlen(proxy_request));
-    //read response from server
-    Rio_readinitb(&server_rio, serverfd);
-    numbytes = 0;
-    while((temp = Rio_readnb(&server_rio, response_buf, MAXLINE)) > 0)
+    if((uc = fetch_head(req.hostname, req.port, iov, n,
+                        head, &head_len, &resp, &status)) == NULL)
     {
-        //write response to client
-        Rio_writen(connfd, response_buf, temp);
-        numbytes += temp;
+        fprintf(stderr, "can't fetch %s: %s\n", uri, status);
+        client_error(connfd, status, "The proxy could not fetch the page");
+        stats_count(STATS_UPSTREAM_FAILURES, 1);
+        stats_done(&sr, STATS_FAILED, 0);
+        if(block != NULL) cache_release(block);
+        flight_finish(f, 0, 0);
+        flight_release(f);
+        return 0;
     }
-    //since this request wasn't in cache, add to cache
-    if(numbytes <= MAX_OBJECT_SIZE)
+    if(block != NULL)
     {
-        P(&cache_mut);
-        //safe cache access
-        cache = cache_insert(uri, response_buf, numbytes, cache);
-        V(&cache_mut);
+        if(resp.status == 304)
+            return revalidated(connfd, uc, &resp, k, block, f, &sr,
+                               keep_alive, gzip);
+        //changed on the server, the new response replaces the copy
+        cache_release(block);
     }
-    Close(serverfd);
+    //read response from server and forward it
+    ctx.connfd = connfd;
+    cache_fill_init(&ctx.fill);
+    ctx.f = f;
+    ctx.sent = 0;
+    stats_first_byte(&sr);
+    cork(connfd, 1);
+    relay_sink(&ctx, head, head_len);
+    //a response the cache won't keep, or whose body is known to be too
+    //big for it, skips the fill up front
+    if(!http_cacheable(&resp) || resp.content_length > MAX_OBJECT_SIZE)
+        cache_fill_abandon(&ctx.fill);
+    if(use_splice)
+        rc = http_splice_body(&uc->rio, &resp, connfd,
+                              relay_sink, copy_sink, &ctx);
+    else
+        rc = http_relay_body(&uc->rio, &resp, relay_sink, &ctx);
+    cork(connfd, 0);
+    //the connection is reusable only if the body ended at its framing
+    if(rc == 0 && resp.keep_alive) upstream_put(uc);
+    else upstream_close(uc);
+
+    //since this request wasn't in cache, add to cache.
+    //insert before finishing the flight so no later miss slips
+    //between the two and fetches again
+    if(rc >= 0) store(&key, &req, &ctx.fill, &resp);
+    else cache_fill_abandon(&ctx.fill);
+    stats_done(&sr, STATS_MISSES, ctx.sent + resp.spliced);
+    flight_finish(f, rc >= 0, resp.framed);
+    flight_release(f);
+    return keep_alive && rc == 0 && resp.framed;
 }
 
-//parse given uri to hostname, port, filepath
-int parse(char *uri, char *hostname, char *port, char *filepath)
+static int iov_push(struct iovec *iov, int n, const char *p, size_t len)
 {
-    char host_temp[MAXLINE];
-    char *http = strstr(uri, "http");
-    char *name_end;
-    char *portptr;
-    int len = strlen("http://");
+    iov[n].iov_base = (char *)p;
+    iov[n].iov_len = len;
+    return n + 1;
+}
 
-    if(http == NULL) return 0;
-    http += len;
-    
-    name_end = strchr(http, '/');
-    
-    strcpy(filepath, name_end);
-    *name_end = '\0';
-    strcpy(host_temp, http);
-    *name_end = '/';
-
-    portptr = strstr(host_temp, ":");
-    strcpy(hostname, host_temp);
-    strcpy(port, "80");
-    if(portptr != NULL)
-    {
-        *portptr = '\0';
-        strcpy(port, portptr+1);
-        strcpy(hostname, host_temp);
-        *portptr = ':';
-        return 1;
-    }
+static int iov_str(struct iovec *iov, int n, const char *s)
+{
+    return iov_push(iov, n, s, strlen(s));
+}
+
+//the cache key of req, its normalized uri written into buf, which holds
+//CACHE_KEY_LEN bytes. returns 0 if it doesn't fit
+int request_key(http_request *req, cache_key *key, char *buf)
+{
+    if(http_normalize_uri(req, buf, CACHE_KEY_LEN) == 0) return 0;
+    cache_key_init(key, buf);
+    return 1;
+}
+
+//the key of req's variant of a response varying with the request
+//headers named in vary, made in buf. returns 0 if it doesn't fit
+static int vary_key(cache_key *key, char *vary, cache_key *variant,
+                    char *buf, http_request *req)
+{
+    memcpy(buf, key->str, key->len);
+    if(http_vary_key(req, vary, buf, key->len, CACHE_KEY_LEN) == 0)
+        return 0;
+    cache_key_init(variant, buf);
     return 1;
 }
+
+//look req up under *k. a response that varies with request headers is
+//stored under its variant key, made in buf, and *k itself only holds
+//the header names: then *k is pointed at variant. returns the block
+//for req, pinned, or NULL
+cache_block *lookup(cache_key **k, cache_key *variant, char *buf,
+                    http_request *req)
+{
+    cache_block *block = cache_inquiry(*k, &cache);
+    char vary[HTTP_VARY_LEN];
+
+    if(block == NULL || !block->meta.vary) return block;
+    snprintf(vary, sizeof(vary), "%.*s", (int)block->size, block->buf);
+    cache_release(block);
+    if(!vary_key(*k, vary, variant, buf, req)) return NULL;
+    *k = variant;
+    return cache_inquiry(variant, &cache);
+}
+
+//put the response fetched for req into the cache under key. one that
+//varies with request headers goes under its variant key, with the
+//names of the headers kept under key
+void store(cache_key *key, http_request *req, cache_fill *fill,
+           http_response *resp)
+{
+    char buf[CACHE_KEY_LEN];
+    cache_key variant;
+    cache_meta meta, names;
+    http_response parsed;
+    ssize_t head_len;
+    int framed = resp->framed;
+
+    //a response in another encoding than gzip, or a chunked gzip one,
+    //can't be inflated for clients that don't take it
+    if(resp->encoded || (resp->gzip && resp->chunked))
+    {
+        cache_fill_abandon(fill);
+        return;
+    }
+    response_meta(resp, &meta);
+    meta.gzip = resp->gzip;
+    //unencoded text is compressed, and then carries its length
+    if(!resp->gzip && resp->compressible && !resp->chunked && fill->ok &&
+       (head_len = http_parse_response_head(fill->buf, fill->len,
+                                            &parsed)) > 0 &&
+       fill->len - head_len >= GZIP_MIN_SIZE &&
+       gzip_fill(fill, head_len))
+        meta.gzip = framed = 1;
+    if(resp->vary[0] != '\0')
+    {
+        if(!vary_key(key, resp->vary, &variant, buf, req))
+        {
+            cache_fill_abandon(fill);
+            return;
+        }
+        //the names are never fresh and carry no validators, so they
+        //can't be mistaken for a response to serve
+        memset(&names, 0, sizeof(names));
+        names.vary = 1;
+        cache_insert(key, resp->vary, strlen(resp->vary), 0, 0, &names,
+                     &cache);
+        key = &variant;
+        meta.variant = 1;
+    }
+    cache_fill_commit(key, fill, framed, &meta, &cache);
+}
+
+//point iov at a cached response for one client: the stored head, its
+//Age and Connection lines written into hdrs, which holds HIT_HEADERS_LEN
+//bytes, and the body, so a hit goes out in one writev. returns the
+//number of iovecs used, at most HIT_IOV
+int hit_iov(struct iovec *iov, char *hdrs, cache_block *block,
+            int keep_alive)
+{
+    char *head_end = block->buf + block->head_len;
+    char *body = head_end + (*head_end == '\r' ? 2 : 1);
+    long age;
+    int n = 0;
+
+    //a response whose head wasn't found goes out as it was received
+    if(block->head_len == 0)
+        return iov_push(iov, n, block->buf, block->size);
+    //the copy was received or last revalidated lifetime seconds before
+    //it goes stale
+    age = time(NULL) - (__atomic_load_n(&block->meta.expires,
+                                        __ATOMIC_RELAXED) -
+                        __atomic_load_n(&block->meta.lifetime,
+                                        __ATOMIC_RELAXED));
+    n = iov_push(iov, n, block->buf, block->head_len);
+    n = iov_push(iov, n, hdrs,
+                 snprintf(hdrs, HIT_HEADERS_LEN, "Age: %ld\r\n"
+                          "Connection: %s\r\n\r\n", age > 0 ? age : 0,
+                          keep_alive ? "keep-alive" : "close"));
+    return iov_push(iov, n, body, block->buf + block->size - body);
+}
+
+//the client's header line called name, NULL if it sent none
+static http_span *find_header(http_request *req, const char *name)
+{
+    int i;
+    for(i = 0; i < req->nheaders; i++)
+        if(http_header_is(&req->headers[i], name)) return &req->headers[i];
+    return NULL;
+}
+
+static int dropped(http_span *line)
+{
+    const char **name;
+    for(name = dropped_hdrs; *name != NULL; name++)
+        if(http_header_is(line, *name)) return 1;
+    return 0;
+}
+
+//point iov at the pieces of the request sent to the server: nothing
+//is copied, the request line and the client's headers are used where
+//the parser left them. with keep_alive it is an HTTP/1.1 request on a
+//persistent connection. extra holds more header lines, or is empty.
+//returns the number of iovecs used, at most HTTP_REQUEST_IOV
+int build_request(struct iovec *iov, http_request *req, int keep_alive,
+                  char *extra)
+{
+    http_span *h;
+    int n = 0, i;
+
+    n = iov_str(iov, n, "GET ");
+    n = iov_push(iov, n, req->path.p, req->path.len);
+    n = iov_str(iov, n, keep_alive ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n");
+    //headers. Host is always the authority of the absolute URI, the
+    //client's own is dropped: the response is cached under that URI,
+    //so it must not come from whatever host the client names instead
+    n = iov_str(iov, n, "Host: ");
+    n = iov_push(iov, n, req->authority.p, req->authority.len);
+    n = iov_str(iov, n, "\r\n");
+    n = iov_str(iov, n, user_agent_hdr);
+    if((h = find_header(req, "Accept")) != NULL)
+        n = iov_push(iov, n, h->p, h->len);
+    else n = iov_str(iov, n, accept_hdr);
+    //the server is asked for gzip or nothing encoded, the two the cache
+    //can give any client. ranges are cut from the unencoded object
+    if(http_accepts_gzip(req) && find_header(req, "Range") == NULL)
+        n = iov_str(iov, n, accept_encoding_hdr);
+    else n = iov_str(iov, n, identity_hdr);
+    if(keep_alive)
+        n = iov_str(iov, n, "Connection: keep-alive\r\n");
+    else
+        n = iov_str(iov, n, "Connection: close\r\n"
+                             "Proxy-Connection: close\r\n");
+    for(i = 0; i < req->nheaders; i++)
+        if(!dropped(&req->headers[i]))
+            n = iov_push(iov, n, req->headers[i].p, req->headers[i].len);
+    if(extra != NULL && extra[0] != '\0')
+        n = iov_str(iov, n, extra);
+    n = iov_str(iov, n, "\r\n");
+    return n;
+}
+
+//an error page for a request the proxy won't forward, like tiny's
+//clienterror
+void client_error(int fd, char *status, char *msg)
+{
+    char body[MAXLINE], head[MAXLINE];
+    int len;
+
+    len = snprintf(body, MAXLINE, "<html><title>Proxy Error</title>"
+                   "<body bgcolor=\"ffffff\">\r\n%s\r\n"
+                   "<hr><em>The Proxy</em>\r\n</body></html>\r\n",
+                   msg);
+    snprintf(head, MAXLINE, "HTTP/1.0 %s\r\nContent-Type: text/html\r\n"
+             "Content-Length: %d\r\nConnection: close\r\n\r\n",
+             status, len);
+    if(rio_writen(fd, head, strlen(head)) > 0) rio_writen(fd, body, len);
+}
+
+//what the cache keeps from resp to tell when the copy goes stale and
+//to revalidate it then
+void response_meta(http_response *resp, cache_meta *meta)
+{
+    meta->status = resp->status;
+    if((meta->lifetime = http_freshness(resp)) < 0)
+        meta->lifetime = CACHE_DEFAULT_FRESHNESS;
+    //the response may have aged in caches on the way already. expires
+    //less lifetime is then its generation, so hits report the full age
+    meta->expires = time(NULL) + meta->lifetime - resp->age;
+    //the cache copies the validators, resp only has to outlive the insert
+    meta->etag = resp->etag;
+    meta->last_modified = resp->last_modified;
+    meta->vary = 0;
+    meta->variant = 0;
+    meta->gzip = 0;
+    meta->expendable = 0;
+}
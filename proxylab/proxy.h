@@ -0,0 +1,34 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "http.h"
+#include "upstream.h"
+
+//a hit goes out as its stored head, the lines written for the client
+//and its body
+#define HIT_IOV 3
+#define HIT_HEADERS_LEN 64
+
+//shared by the thread-per-connection and event-driven front ends
+extern cache_t cache;
+extern int use_splice;
+
+int build_request(struct iovec *iov, http_request *req, int keep_alive,
+                  char *extra);
+int hit_iov(struct iovec *iov, char *hdrs, cache_block *block,
+            int keep_alive);
+void client_error(int fd, char *status, char *msg);
+upstream_conn *fetch_head(char *hostname, char *port, struct iovec *iov,
+                          int n, char *head, ssize_t *head_len,
+                          http_response *resp, char **status);
+void cork(int fd, int on);
+void response_meta(http_response *resp, cache_meta *meta);
+int request_key(http_request *req, cache_key *key, char *buf);
+cache_block *lookup(cache_key **k, cache_key *variant, char *buf,
+                    http_request *req);
+void store(cache_key *key, http_request *req, cache_fill *fill,
+           http_response *resp);
+
+#endif /* __PROXY_H__ */
@@ -0,0 +1,313 @@
+/*range requests answered from fixed-size chunks.
+ * A request for one byte range of an object is served from chunks of
+ * RANGE_CHUNK_SIZE bytes, each cached under "<key> chunk <k>" as the
+ * server's 206 response for exactly that chunk, so hot parts of objects
+ * far larger than MAX_OBJECT_SIZE are cached too. Chunks missing from
+ * the cache are fetched with a Range request of their own, one at a
+ * time while the range is streamed to the client. A whole copy of the
+ * object in the cache answers any range of it directly. A server that
+ * answers the first chunk with anything but that chunk, say a 200
+ * because it doesn't do ranges, has its response relayed as it is.*/
+#include "range.h"
+#include "proxy.h"
+
+//"<key> chunk <k>", a space never occurs in a URI
+#define CHUNK_KEY_LEN (CACHE_KEY_LEN + 32)
+
+//a piece of the object: a whole cached copy, a cached chunk or a chunk
+//just fetched
+typedef struct {
+    cache_block *block;         //cached copy, pinned, or NULL
+    cache_fill fill;            //fetched chunk, head and body
+    http_response resp;         //what the head says
+    char *head;
+    char *body;
+    long first, len;            //where body lies in the object
+    long total;                 //size of the object
+} piece;
+
+static int fill_sink(void *arg, char *data, size_t n)
+{
+    cache_fill_append(arg, data, n);
+    return 0;
+}
+
+//relay state for a response that isn't a chunk
+struct whole_ctx{
+    int connfd;
+    cache_fill fill;
+    size_t sent;
+};
+
+static int whole_sink(void *arg, char *data, size_t n)
+{
+    struct whole_ctx *ctx = arg;
+    if(rio_writen(ctx->connfd, data, n) != n) return -1;
+    ctx->sent += n;
+    cache_fill_append(&ctx->fill, data, n);
+    return 0;
+}
+
+//a whole copy of the object in the cache whose body can be cut into
+//ranges, which a gzip encoded one can't
+static int whole_copy(http_request *req, cache_key *key, piece *p)
+{
+    char buf[CACHE_KEY_LEN];
+    cache_key variant;
+    ssize_t head_len;
+
+    if((p->block = lookup(&key, &variant, buf, req)) == NULL) return 0;
+    if(cache_fresh(p->block) &&
+       (head_len = http_parse_response_head(p->block->buf, p->block->size,
+                                            &p->resp)) > 0 &&
+       p->resp.status == 200 && !p->resp.chunked && !p->resp.gzip)
+    {
+        p->head = p->block->buf;
+        p->body = p->block->buf + head_len;
+        p->first = 0;
+        p->len = p->total = p->block->size - head_len;
+        return 1;
+    }
+    cache_release(p->block);
+    p->block = NULL;
+    return 0;
+}
+
+//1 if resp is the 206 for chunk k of an object and nothing else
+static int is_chunk(http_response *resp, long k)
+{
+    long first = k * RANGE_CHUNK_SIZE;
+    return resp->status == 206 && !resp->chunked &&
+           resp->range_first == first && resp->range_total > first &&
+           resp->range_last == (first + RANGE_CHUNK_SIZE < resp->range_total ?
+                                first + RANGE_CHUNK_SIZE :
+                                resp->range_total) - 1 &&
+           resp->content_length == resp->range_last - first + 1;
+}
+
+static void set_chunk(piece *p, char *buf, ssize_t head_len)
+{
+    p->head = buf;
+    p->body = buf + head_len;
+    p->first = p->resp.range_first;
+    p->len = p->resp.range_last - p->resp.range_first + 1;
+    p->total = p->resp.range_total;
+}
+
+static int cached_chunk(char *str, long k, piece *p)
+{
+    ssize_t head_len;
+    cache_key key;
+
+    cache_key_init(&key, str);
+    if((p->block = cache_inquiry(&key, &cache)) == NULL) return 0;
+    if(cache_fresh(p->block) &&
+       (head_len = http_parse_response_head(p->block->buf, p->block->size,
+                                            &p->resp)) > 0 &&
+       is_chunk(&p->resp, k) &&
+       p->block->size - head_len == p->resp.content_length)
+    {
+        set_chunk(p, p->block->buf, head_len);
+        return 1;
+    }
+    cache_release(p->block);
+    p->block = NULL;
+    return 0;
+}
+
+//fetch chunk k from the server. returns 1 with the chunk in p, 0 if
+//the fetch failed with *status the error for the client, and -1 if the
+//server answered with something else, which is left in *ucp, head and
+//p->resp for the caller
+static int fetch_chunk(http_request *req, long k, piece *p,
+                       upstream_conn **ucp, char *head, ssize_t *head_len,
+                       char **status)
+{
+    struct iovec iov[HTTP_REQUEST_IOV];
+    char range[64];
+    upstream_conn *uc;
+    int n, rc;
+
+    snprintf(range, sizeof(range), "Range: bytes=%ld-%ld\r\n",
+             k * RANGE_CHUNK_SIZE, (k + 1) * RANGE_CHUNK_SIZE - 1);
+    n = build_request(iov, req, 1, range);
+    if((uc = fetch_head(req->hostname, req->port, iov, n, head, head_len,
+                        &p->resp, status)) == NULL)
+        return 0;
+    if(!is_chunk(&p->resp, k))
+    {
+        *ucp = uc;
+        return -1;
+    }
+    cache_fill_init(&p->fill);
+    cache_fill_append(&p->fill, head, *head_len);
+    rc = http_relay_body(&uc->rio, &p->resp, fill_sink, &p->fill);
+    if(rc == 0 && p->resp.keep_alive) upstream_put(uc);
+    else upstream_close(uc);
+    if(rc != 0 || !p->fill.ok)
+    {
+        cache_fill_abandon(&p->fill);
+        *status = "502 Bad Gateway";
+        return 0;
+    }
+    set_chunk(p, p->fill.buf, *head_len);
+    return 1;
+}
+
+//the piece holding byte k * RANGE_CHUNK_SIZE: a whole copy, a cached
+//chunk or, counted in *fetched, a fetched one. returns like fetch_chunk
+static int get_piece(http_request *req, cache_key *key, long k, piece *p,
+                     int *fetched, upstream_conn **ucp, char *head,
+                     ssize_t *head_len, char **status)
+{
+    char chunk_key[CHUNK_KEY_LEN];
+
+    p->block = NULL;
+    p->fill.buf = NULL;
+    if(whole_copy(req, key, p)) return 1;
+    snprintf(chunk_key, CHUNK_KEY_LEN, "%s chunk %ld", key->str, k);
+    if(cached_chunk(chunk_key, k, p)) return 1;
+    *fetched += 1;
+    return fetch_chunk(req, k, p, ucp, head, head_len, status);
+}
+
+//done with a piece: a fetched chunk goes into the cache unless the
+//server said not to store it, or that it varies with request headers
+static void put_piece(cache_key *key, piece *p)
+{
+    char str[CHUNK_KEY_LEN];
+    cache_key chunk_key;
+    cache_meta meta;
+
+    if(p->block != NULL)
+    {
+        cache_release(p->block);
+        return;
+    }
+    if(!p->resp.no_store && p->resp.vary[0] == '\0')
+    {
+        snprintf(str, CHUNK_KEY_LEN, "%s chunk %ld", key->str,
+                 p->first / RANGE_CHUNK_SIZE);
+        cache_key_init(&chunk_key, str);
+        response_meta(&p->resp, &meta);
+        cache_fill_commit(&chunk_key, &p->fill, 1, &meta, &cache);
+    }
+    else cache_fill_abandon(&p->fill);
+}
+
+//pieces of one object agree on its size and validators, else it
+//changed on the server meanwhile
+static int same_object(piece *a, piece *b)
+{
+    return a->total == b->total &&
+           strcmp(a->resp.etag, b->resp.etag) == 0 &&
+           strcmp(a->resp.last_modified, b->resp.last_modified) == 0;
+}
+
+//relay a response the server sent instead of the first chunk, and
+//cache it if it is a whole object that fits
+static int relay_whole(int connfd, http_request *req, cache_key *key,
+                       upstream_conn *uc, char *head, ssize_t head_len,
+                       http_response *resp, int keep_alive, stats_req *sr)
+{
+    struct whole_ctx ctx;
+    int rc;
+
+    ctx.connfd = connfd;
+    ctx.sent = 0;
+    cache_fill_init(&ctx.fill);
+    if(!http_cacheable(resp) || resp->content_length > MAX_OBJECT_SIZE)
+        cache_fill_abandon(&ctx.fill);
+    stats_first_byte(sr);
+    cork(connfd, 1);
+    rc = whole_sink(&ctx, head, head_len);
+    if(rc == 0) rc = http_relay_body(&uc->rio, resp, whole_sink, &ctx);
+    cork(connfd, 0);
+    if(rc == 0 && resp->keep_alive) upstream_put(uc);
+    else upstream_close(uc);
+    if(rc >= 0) store(key, req, &ctx.fill, resp);
+    else cache_fill_abandon(&ctx.fill);
+    stats_done(sr, STATS_MISSES, ctx.sent);
+    return keep_alive && rc == 0 && resp->framed;
+}
+
+//answer a request for bytes first-last of an object, last is -1 for
+//the rest of it. returns 1 if the client connection can carry another
+//request
+int range_serve(int connfd, http_request *req, cache_key *key, long first,
+                long last, int keep_alive, stats_req *sr)
+{
+    char head[MAXLINE], out[MAXLINE + MAXBUF], *status;
+    upstream_conn *uc;
+    piece p, next;
+    ssize_t head_len;
+    long off, n, sent = 0;
+    size_t out_len;
+    int fetched = 0, rc;
+
+    rc = get_piece(req, key, first / RANGE_CHUNK_SIZE, &p, &fetched, &uc,
+                   head, &head_len, &status);
+    if(rc < 0)
+        return relay_whole(connfd, req, key, uc, head, head_len, &p.resp,
+                           keep_alive, sr);
+    if(rc == 0)
+    {
+        client_error(connfd, status, "The proxy could not fetch the page");
+        stats_count(STATS_UPSTREAM_FAILURES, 1);
+        stats_done(sr, STATS_FAILED, 0);
+        return 0;
+    }
+    if(first >= p.total)
+    {
+        out_len = snprintf(out, sizeof(out), "HTTP/1.1 416 Range Not "
+                           "Satisfiable\r\nContent-Range: bytes */%ld\r\n"
+                           "Content-Length: 0\r\n\r\n", p.total);
+        put_piece(key, &p);
+        stats_done(sr, fetched ? STATS_MISSES : STATS_HITS, 0);
+        return rio_writen(connfd, out, out_len) == out_len && keep_alive;
+    }
+    if(last < 0 && p.len < p.total &&
+       p.first + RANGE_MAX_OPEN_CHUNKS * RANGE_CHUNK_SIZE < p.total)
+        last = p.first + RANGE_MAX_OPEN_CHUNKS * RANGE_CHUNK_SIZE - 1;
+    if(last < 0 || last >= p.total) last = p.total - 1;
+
+    if((out_len = http_range_head(out, sizeof(out), p.head, first, last,
+                                  p.total, keep_alive)) == 0)
+    {
+        put_piece(key, &p);
+        client_error(connfd, "502 Bad Gateway", "The response head is too "
+                     "large");
+        stats_done(sr, STATS_FAILED, 0);
+        return 0;
+    }
+    stats_first_byte(sr);
+    cork(connfd, 1);
+    rc = rio_writen(connfd, out, out_len) == out_len;
+    //stream the range piece by piece, a chunk is fetched only once the
+    //one before it went out
+    for(off = first; rc; )
+    {
+        n = (last < p.first + p.len ? last + 1 : p.first + p.len) - off;
+        if((rc = rio_writen(connfd, p.body + (off - p.first), n) == n))
+            sent += n;
+        off += n;
+        if(!rc || off > last) break;
+        if((rc = get_piece(req, key, off / RANGE_CHUNK_SIZE, &next,
+                           &fetched, &uc, head, &head_len, &status)) < 0)
+            upstream_close(uc);
+        if(rc <= 0) break;
+        if(!same_object(&p, &next))
+        {
+            put_piece(key, &next);
+            rc = 0;
+            break;
+        }
+        put_piece(key, &p);
+        p = next;
+    }
+    cork(connfd, 0);
+    put_piece(key, &p);
+    stats_done(sr, rc > 0 ? (fetched ? STATS_MISSES : STATS_HITS) :
+               STATS_FAILED, sent);
+    return rc > 0 && keep_alive;
+}
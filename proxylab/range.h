@@ -0,0 +1,18 @@
+#ifndef __RANGE_H__
+#define __RANGE_H__
+
+#include "csapp.h"
+#include "http.h"
+#include "stats.h"
+
+//bytes of an object per cached chunk, a chunk plus its head must stay
+//well under MAX_OBJECT_SIZE
+#define RANGE_CHUNK_SIZE (32*1024)
+//an open ended range "bytes=first-" is answered with at most this many
+//chunks, the client asks again for the rest
+#define RANGE_MAX_OPEN_CHUNKS 32
+
+int range_serve(int connfd, http_request *req, cache_key *key, long first,
+                long last, int keep_alive, stats_req *sr);
+
+#endif /* __RANGE_H__ */
@@ -0,0 +1,123 @@
+/*zero-copy relay between sockets.
+ * Payload bytes are spliced from the source socket into a pipe and from
+ * the pipe into the destination socket, so they never enter user space.
+ * When somebody still needs a copy (the cache fill or coalesced
+ * followers) the pipe is first duplicated with tee into a second pipe
+ * and only that copy is read. Each thread keeps its own pair of pipes.*/
+#include "relay.h"
+
+static __thread int pipefd[2] = { -1, -1 };
+static __thread int teefd[2] = { -1, -1 };
+
+static int pipe_open(int p[2])
+{
+    if(p[0] >= 0) return 0;
+    if(pipe2(p, O_CLOEXEC) < 0) return -1;
+    //a bigger pipe means fewer splices per response, best effort
+    fcntl(p[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    return 0;
+}
+
+//a pipe that may still hold bytes of a failed relay is not reused
+static void pipe_reset(int p[2])
+{
+    if(p[0] < 0) return;
+    close(p[0]);
+    close(p[1]);
+    p[0] = p[1] = -1;
+}
+
+//splice exactly n bytes already in the pipe to tofd
+static int drain_pipe(int tofd, size_t n)
+{
+    ssize_t moved;
+    while(n > 0)
+    {
+        moved = splice(pipefd[0], NULL, tofd, NULL, n,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(moved < 0 && errno == EINTR) continue;
+        if(moved <= 0) return -1;
+        n -= moved;
+    }
+    return 0;
+}
+
+//hand a tee'd copy of the first n bytes in the pipe to copy, then
+//splice them on. tee may duplicate fewer bytes than asked for, so it
+//runs again on what is left. returns 1 when copy wants no more bytes
+static int copy_and_drain(int tofd, size_t n, http_sink copy, void *arg)
+{
+    char buf[MAXBUF];
+    ssize_t t, got, r;
+    int done = 0;
+
+    while(n > 0)
+    {
+        t = tee(pipefd[0], teefd[1], n < MAXBUF ? n : MAXBUF, 0);
+        if(t < 0 && errno == EINTR) continue;
+        if(t <= 0) return -1;
+        for(got = 0; got < t; got += r)
+        {
+            if((r = read(teefd[0], buf + got, t - got)) <= 0)
+            {
+                if(r < 0 && errno == EINTR) { r = 0; continue; }
+                return -1;
+            }
+        }
+        if(!done && (r = copy(arg, buf, t)) != 0)
+        {
+            if(r < 0) return -1;
+            done = 1;
+        }
+        if(drain_pipe(tofd, t) < 0) return -1;
+        n -= t;
+    }
+    return done;
+}
+
+//move len bytes, or everything up to end of file if len is negative,
+//from fromfd to tofd. copy, if not NULL, gets a copy of the bytes until
+//it returns 1. returns the number of bytes moved, -1 on error and
+//RELAY_UNSUPPORTED if the descriptors can't be spliced
+ssize_t relay_splice(int fromfd, int tofd, long len,
+                     http_sink copy, void *arg)
+{
+    ssize_t n, moved = 0;
+    size_t want;
+    int rc;
+
+    if(pipe_open(pipefd) < 0) return RELAY_UNSUPPORTED;
+    if(copy != NULL && pipe_open(teefd) < 0) return RELAY_UNSUPPORTED;
+
+    while(len < 0 || moved < len)
+    {
+        want = RELAY_PIPE_SIZE;
+        if(len >= 0 && len - moved < want) want = len - moved;
+        n = splice(fromfd, NULL, pipefd[1], NULL, want,
+                   SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(n < 0)
+        {
+            if(errno == EINTR) continue;
+            if(errno == EINVAL && moved == 0) return RELAY_UNSUPPORTED;
+            goto fail;
+        }
+        if(n == 0)
+        {
+            if(len < 0) break;
+            goto fail;
+        }
+        if(copy != NULL)
+        {
+            if((rc = copy_and_drain(tofd, n, copy, arg)) < 0) goto fail;
+            if(rc == 1) copy = NULL;
+        }
+        else if(drain_pipe(tofd, n) < 0) goto fail;
+        moved += n;
+    }
+    return moved;
+
+ fail:
+    pipe_reset(pipefd);
+    pipe_reset(teefd);
+    return -1;
+}
@@ -0,0 +1,15 @@
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include "csapp.h"
+#include "http.h"
+
+//bytes moved per splice, also the size asked for each relay pipe
+#define RELAY_PIPE_SIZE (64*1024)
+//splice can't be used on these descriptors, nothing was moved
+#define RELAY_UNSUPPORTED -2
+
+ssize_t relay_splice(int fromfd, int tofd, long len,
+                     http_sink copy, void *arg);
+
+#endif /* __RELAY_H__ */
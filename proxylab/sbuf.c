@@ -0,0 +1,75 @@
+#include "sbuf.h"
+
+static double elapsed_us(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1e6 +
+           (to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+//create an empty, bounded, shared FIFO buffer with n slots
+void sbuf_init(sbuf_t *sp, int n)
+{
+    sp->buf = Calloc(n, sizeof(sbuf_item));
+    sp->n = n;
+    sp->front = sp->rear = 0;
+    Sem_init(&sp->mutex, 0, 1);
+    Sem_init(&sp->slots, 0, n);
+    Sem_init(&sp->items, 0, 0);
+    sp->total = 0;
+    sp->max_depth = 0;
+    sp->wait_total_us = sp->wait_max_us = 0;
+}
+
+//clean up buffer sp
+void sbuf_deinit(sbuf_t *sp)
+{
+    Free(sp->buf);
+}
+
+//insert fd onto the rear of shared buffer sp, blocking while it is
+//full so a load spike backs up into the listen queue
+void sbuf_insert(sbuf_t *sp, int fd)
+{
+    int depth;
+
+    P(&sp->slots);
+    P(&sp->mutex);
+    sp->buf[(++sp->rear)%(sp->n)].fd = fd;
+    clock_gettime(CLOCK_MONOTONIC, &sp->buf[sp->rear%sp->n].queued);
+    depth = sp->rear - sp->front;
+    if(depth > sp->max_depth) sp->max_depth = depth;
+    V(&sp->mutex);
+    V(&sp->items);
+}
+
+//remove and return the first fd from buffer sp
+int sbuf_remove(sbuf_t *sp)
+{
+    sbuf_item item;
+    struct timespec now;
+    double wait;
+
+    P(&sp->items);
+    P(&sp->mutex);
+    item = sp->buf[(++sp->front)%(sp->n)];
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    wait = elapsed_us(&item.queued, &now);
+    sp->total++;
+    sp->wait_total_us += wait;
+    if(wait > sp->wait_max_us) sp->wait_max_us = wait;
+    V(&sp->mutex);
+    V(&sp->slots);
+    return item.fd;
+}
+
+//print queue depth and wait time metrics
+void sbuf_report(sbuf_t *sp, FILE *fp)
+{
+    P(&sp->mutex);
+    fprintf(fp, "queue: depth %d/%d max %d, %lu served, "
+            "wait avg %.1fus max %.1fus\n",
+            sp->rear - sp->front, sp->n, sp->max_depth, sp->total,
+            sp->total ? sp->wait_total_us / sp->total : 0.0,
+            sp->wait_max_us);
+    V(&sp->mutex);
+}
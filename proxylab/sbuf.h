@@ -0,0 +1,34 @@
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+
+//bounded producer/consumer queue of connected descriptors feeding the
+//prethreaded worker pool, after the sbuf package in CS:APP 12.5.4
+typedef struct {
+    int fd;
+    struct timespec queued;     //when the fd was inserted
+} sbuf_item;
+
+typedef struct {
+    sbuf_item *buf;     //buffer array
+    int n;              //maximum number of slots
+    int front;          //buf[(front+1)%n] is first item
+    int rear;           //buf[rear%n] is last item
+    sem_t mutex;        //protects accesses to buf and the metrics
+    sem_t slots;        //counts available slots
+    sem_t items;        //counts available items
+    //metrics
+    unsigned long total;        //items ever removed
+    int max_depth;              //deepest the queue has been
+    double wait_total_us;       //time items spent queued
+    double wait_max_us;
+} sbuf_t;
+
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, int fd);
+int sbuf_remove(sbuf_t *sp);
+void sbuf_report(sbuf_t *sp, FILE *fp);
+
+#endif /* __SBUF_H__ */
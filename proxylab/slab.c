@@ -0,0 +1,185 @@
+/*slab arena for cache objects.
+ * Each cache shard owns one arena carved out of a single region that is
+ * allocated when the cache starts. A slot is the request rounded up to
+ * whole units of 64 bytes. Free slots are kept on lists by size class,
+ * the classes 1.25 times apart, and are split on allocation and merged
+ * with their free neighbours when freed, so allocation and free are
+ * O(number of classes) in the common case and never call the system
+ * allocator.*/
+#include "slab.h"
+
+#define TAG_FREE 1U
+#define TAG_LEN(t) ((t) >> 1)
+
+//free slots link through their first bytes
+struct slab_free{
+    struct slab_free *next, *prev;
+};
+
+//smallest slot, in units, of each size class
+static size_t class_min[SLAB_NCLASSES];
+static pthread_once_t classes_once = PTHREAD_ONCE_INIT;
+
+static void init_classes(void)
+{
+    size_t min = 1;
+    int c;
+
+    for(c = 0; c < SLAB_NCLASSES; c++)
+    {
+        class_min[c] = min;
+        min = min * 5 / 4 > min ? min * 5 / 4 : min + 1;
+    }
+}
+
+//the class a free slot of len units is listed in: the last one whose
+//smallest slot is no longer than len
+static int class_of(size_t len)
+{
+    int lo = 0, hi = SLAB_NCLASSES - 1, mid;
+
+    while(lo < hi)
+    {
+        mid = (lo + hi + 1) / 2;
+        if(class_min[mid] <= len) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+static size_t unit_index(slab_arena *arena, char *p)
+{
+    return (p - arena->base) >> SLAB_UNIT_SHIFT;
+}
+
+static char *unit_ptr(slab_arena *arena, size_t i)
+{
+    return arena->base + (i << SLAB_UNIT_SHIFT);
+}
+
+//mark the len units from i as one slot
+static void set_tags(slab_arena *arena, size_t i, size_t len,
+                     unsigned is_free)
+{
+    arena->tags[i] = arena->tags[i + len - 1] = (len << 1) | is_free;
+}
+
+static void push_free(slab_arena *arena, size_t i, size_t len)
+{
+    struct slab_free *f = (struct slab_free *)unit_ptr(arena, i);
+    int class = class_of(len);
+
+    f->prev = NULL;
+    f->next = arena->free[class];
+    if(f->next != NULL) f->next->prev = f;
+    arena->free[class] = f;
+    set_tags(arena, i, len, TAG_FREE);
+}
+
+static void unlink_free(slab_arena *arena, size_t i, size_t len)
+{
+    struct slab_free *f = (struct slab_free *)unit_ptr(arena, i);
+    if(f->prev != NULL) f->prev->next = f->next;
+    else arena->free[class_of(len)] = f->next;
+    if(f->next != NULL) f->next->prev = f->prev;
+}
+
+//size is rounded down to whole units, at most 1 << SLAB_MAX_SHIFT
+//bytes, and base must be aligned to a unit
+void slab_init(slab_arena *arena, char *base, size_t size)
+{
+    int i;
+
+    pthread_once(&classes_once, init_classes);
+    pthread_mutex_init(&arena->lock, NULL);
+    arena->base = base;
+    arena->units = size >> SLAB_UNIT_SHIFT;
+    arena->size = arena->units << SLAB_UNIT_SHIFT;
+    arena->used = 0;
+    for(i = 0; i < SLAB_NCLASSES; i++) arena->free[i] = NULL;
+    arena->tags = Calloc(arena->units, sizeof(unsigned int));
+    push_free(arena, 0, arena->units);
+}
+
+//a slot of at least n bytes, NULL if no free slot is big enough
+void *slab_alloc(slab_arena *arena, size_t n)
+{
+    size_t want = (n + (1 << SLAB_UNIT_SHIFT) - 1) >> SLAB_UNIT_SHIFT;
+    size_t i = 0, len = 0;
+    struct slab_free *f;
+    int class, k;
+
+    if(want == 0) want = 1;
+    if(want > arena->units) return NULL;
+    class = class_of(want);
+
+    pthread_mutex_lock(&arena->lock);
+    //slots in want's own class may be shorter than want, the first one
+    //that fits is taken. any slot of a larger class fits
+    for(f = arena->free[class]; f != NULL; f = f->next)
+    {
+        i = unit_index(arena, (char *)f);
+        if((len = TAG_LEN(arena->tags[i])) >= want) break;
+    }
+    for(k = class + 1; f == NULL && k < SLAB_NCLASSES; k++)
+    {
+        if((f = arena->free[k]) == NULL) continue;
+        i = unit_index(arena, (char *)f);
+        len = TAG_LEN(arena->tags[i]);
+    }
+    if(f == NULL)
+    {
+        pthread_mutex_unlock(&arena->lock);
+        return NULL;
+    }
+    unlink_free(arena, i, len);
+    //split, keeping the front and freeing the rest
+    if(len > want) push_free(arena, i + want, len - want);
+    set_tags(arena, i, want, 0);
+    arena->used += want << SLAB_UNIT_SHIFT;
+    pthread_mutex_unlock(&arena->lock);
+    return f;
+}
+
+//return a slot, merging it with the free slots before and after it
+void slab_free(slab_arena *arena, void *ptr)
+{
+    size_t i, len, nlen;
+
+    pthread_mutex_lock(&arena->lock);
+    i = unit_index(arena, ptr);
+    len = TAG_LEN(arena->tags[i]);
+    arena->used -= len << SLAB_UNIT_SHIFT;
+    if(i + len < arena->units && (arena->tags[i + len] & TAG_FREE))
+    {
+        nlen = TAG_LEN(arena->tags[i + len]);
+        unlink_free(arena, i + len, nlen);
+        len += nlen;
+    }
+    if(i > 0 && (arena->tags[i - 1] & TAG_FREE))
+    {
+        nlen = TAG_LEN(arena->tags[i - 1]);
+        i -= nlen;
+        unlink_free(arena, i, nlen);
+        len += nlen;
+    }
+    push_free(arena, i, len);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+size_t slab_used(slab_arena *arena)
+{
+    size_t used;
+    pthread_mutex_lock(&arena->lock);
+    used = arena->used;
+    pthread_mutex_unlock(&arena->lock);
+    return used;
+}
+
+//bytes of the slot slab_alloc takes for n bytes
+size_t slab_slot_size(size_t n)
+{
+    size_t unit = (size_t)1 << SLAB_UNIT_SHIFT;
+    if(n == 0) n = 1;
+    return (n + unit - 1) & ~(unit - 1);
+}
@@ -0,0 +1,38 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include "csapp.h"
+
+//slots are whole units of 1 << SLAB_UNIT_SHIFT bytes
+#define SLAB_UNIT_SHIFT 6
+//an arena is at most 1 << SLAB_MAX_SHIFT bytes
+#define SLAB_MAX_SHIFT 30
+//free lists, one per size class, each class 1.25 times the one before
+#define SLAB_NCLASSES 96
+
+struct slab_free;
+
+//variable sized slots, a whole number of units each, carved from one
+//preallocated region. free slots sit on a list for their size class
+//and a freed slot merges with the free slots on either side, so no
+//memory is lost to classes that are no longer in demand and a slot
+//wastes less than a unit. tags has one word per unit: the first and
+//the last unit of a slot hold its length in units and whether it is
+//free
+typedef struct {
+    pthread_mutex_t lock;
+    char *base;
+    size_t size;                //bytes, a whole number of units
+    size_t units;
+    struct slab_free *free[SLAB_NCLASSES];
+    unsigned int *tags;
+    size_t used;                //bytes in allocated slots
+} slab_arena;
+
+void slab_init(slab_arena *arena, char *base, size_t size);
+void *slab_alloc(slab_arena *arena, size_t n);
+void slab_free(slab_arena *arena, void *p);
+size_t slab_used(slab_arena *arena);
+size_t slab_slot_size(size_t n);
+
+#endif /* __SLAB_H__ */
@@ -0,0 +1,81 @@
+/*writes a synthetic cache snapshot for benchmarking --warm-from.
+ * The objects are fresh 200 responses of one size for
+ * http://localhost:<port>/warm/<i>, object 0 the most recent. With -c
+ * the file is dropped from the page cache once it is on disk, so the
+ * proxy's load reads it from the disk.*/
+#include "csapp.h"
+#include "snapshot.h"
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-s size] [-p port] [-c] <file> <megabytes>\n",
+            prog);
+    fprintf(stderr, "  -s  body bytes per object, 16384 by default\n");
+    fprintf(stderr, "  -p  origin port in the keys, 8080 by default\n");
+    fprintf(stderr, "  -c  leave the file out of the page cache\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    char key[MAXLINE], head[MAXLINE], *buf;
+    size_t size = 16384, head_len, total;
+    int opt, port = 8080, cold = 0, fd;
+    unsigned long i;
+    snapshot_out out;
+    cache_meta meta;
+
+    while((opt = getopt(argc, argv, "s:p:c")) != -1)
+    {
+        switch(opt)
+        {
+        case 's':
+            if((size = atol(optarg)) <= 0) usage(argv[0]);
+            break;
+        case 'p':
+            if((port = atoi(optarg)) <= 0) usage(argv[0]);
+            break;
+        case 'c':
+            cold = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(optind != argc - 2 || atol(argv[optind + 1]) <= 0) usage(argv[0]);
+    total = (size_t)atol(argv[optind + 1]) << 20;
+
+    head_len = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+                        "Content-Type: application/octet-stream\r\n"
+                        "Content-Length: %lu\r\n"
+                        "Cache-Control: max-age=3600\r\n\r\n",
+                        (unsigned long)size);
+    buf = Malloc(head_len + size);
+    memcpy(buf, head, head_len);
+    memset(buf + head_len, 'x', size);
+    memset(&meta, 0, sizeof(meta));
+    meta.status = 200;
+    meta.lifetime = 3600;
+    meta.expires = time(NULL) + 3600;
+    meta.etag = meta.last_modified = "";
+
+    if(snapshot_open(&out, argv[optind]) < 0)
+        unix_error("can't create snapshot");
+    for(i = 0; out.bytes < total; i++)
+    {
+        snprintf(key, sizeof(key), "http://localhost:%d/warm/%lu", port, i);
+        //the cache keeps the head's length up to its blank line
+        snapshot_put(&out, key, strlen(key), buf, head_len + size,
+                     head_len - 2, 1, &meta);
+    }
+    if(snapshot_close(&out) < 0) unix_error("can't write snapshot");
+    if(cold && (fd = open(argv[optind], O_RDONLY)) >= 0)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    printf("%s: %lu objects, %lu bytes\n", argv[optind], out.records,
+           out.bytes);
+    Free(buf);
+    return 0;
+}
@@ -0,0 +1,331 @@
+/*cache snapshots for warm restarts.
+ * A snapshot is the memory tier written out most recently used object
+ * first:
+ *   header | record | record | ...
+ * each record a header, the key, the validators and the response bytes,
+ * padded to 8 bytes like the disk tier's. The shards are interleaved by rank, so
+ * any prefix of the file holds the hottest objects of every shard.
+ * Loading maps the file and walks it only until every shard's arena is
+ * spoken for, then inserts what it took least recent first, so the
+ * eviction policy sees the objects in the order they were used. A
+ * snapshot far larger than the cache costs no more to load than one
+ * that just fits. The disk tier is not part of it, it keeps itself
+ * across restarts.*/
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC 0x50534e4150534835UL     //version 5
+#define RECORD_MAGIC 0x534e4150U
+
+struct header{
+    unsigned long magic;
+    unsigned long records;
+    unsigned long bytes;            //response bytes of all records
+};
+
+struct record{
+    unsigned int magic;
+    unsigned int keylen;            //including the '\0'
+    unsigned long size;
+    unsigned long head_len;
+    unsigned int framed;
+    unsigned int etag_len;          //validators with their '\0's, they
+    unsigned int lm_len;            //follow the key, not kept in meta
+    unsigned int pad;
+    cache_meta meta;
+    unsigned long sum;              //over key, validators and response
+};
+
+//a block pinned while it is written and its place in its shard
+struct pinned{
+    cache_block *block;
+    unsigned long used;
+};
+
+static long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+//FNV-1a, the record checksum
+static unsigned long fnv(unsigned long h, const char *p, size_t n)
+{
+    while(n-- > 0)
+    {
+        h ^= (unsigned char)*p++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+#define FNV_INIT 14695981039346656037UL
+
+//bytes of a record whose key and validators take keylen bytes
+static size_t record_len(size_t keylen, size_t size)
+{
+    return (sizeof(struct record) + keylen + size + 7) & ~(size_t)7;
+}
+
+//bytes of a validator in a record, NULL stands for ""
+static size_t validator_len(const char *v)
+{
+    return v == NULL ? 1 : strnlen(v, CACHE_VALIDATOR_LEN - 1) + 1;
+}
+
+//checksum a validator as it is written, its '\0' included
+static unsigned long sum_validator(unsigned long h, const char *v,
+                                   size_t len)
+{
+    static const char nul;
+
+    if(len > 1) h = fnv(h, v, len - 1);
+    return fnv(h, &nul, 1);
+}
+
+static void put_validator(snapshot_out *out, const char *v, size_t len)
+{
+    static const char nul;
+
+    if(len > 1) fwrite(v, 1, len - 1, out->fp);
+    fwrite(&nul, 1, 1, out->fp);
+}
+
+//start writing a snapshot to path. returns -1 if the file can't be made
+int snapshot_open(snapshot_out *out, char *path)
+{
+    struct header h;
+
+    snprintf(out->path, sizeof(out->path), "%s", path);
+    snprintf(out->tmp, sizeof(out->tmp), "%s.tmp", path);
+    out->records = out->bytes = 0;
+    if((out->fp = fopen(out->tmp, "w")) == NULL) return -1;
+    //the real header goes in once the counts are known
+    memset(&h, 0, sizeof(h));
+    fwrite(&h, sizeof(h), 1, out->fp);
+    return 0;
+}
+
+//append one object. write errors stick to the stream and are reported
+//by snapshot_close
+void snapshot_put(snapshot_out *out, char *key, size_t key_len, char *buf,
+                  size_t size, size_t head_len, int framed,
+                  cache_meta *meta)
+{
+    static const char pad[8];
+    struct record r;
+    size_t len, head;
+    unsigned long sum;
+
+    memset(&r, 0, sizeof(r));
+    r.magic = RECORD_MAGIC;
+    r.keylen = key_len + 1;
+    r.size = size;
+    r.head_len = head_len;
+    r.framed = framed;
+    r.etag_len = validator_len(meta->etag);
+    r.lm_len = validator_len(meta->last_modified);
+    r.meta = *meta;
+    r.meta.etag = r.meta.last_modified = NULL;
+    head = r.keylen + r.etag_len + r.lm_len;
+    len = record_len(head, size);
+    sum = fnv(FNV_INIT, key, key_len + 1);
+    sum = sum_validator(sum, meta->etag, r.etag_len);
+    sum = sum_validator(sum, meta->last_modified, r.lm_len);
+    r.sum = fnv(sum, buf, size);
+    fwrite(&r, sizeof(r), 1, out->fp);
+    fwrite(key, 1, key_len + 1, out->fp);
+    put_validator(out, meta->etag, r.etag_len);
+    put_validator(out, meta->last_modified, r.lm_len);
+    fwrite(buf, 1, size, out->fp);
+    fwrite(pad, 1, len - sizeof(r) - head - size, out->fp);
+    out->records++;
+    out->bytes += size;
+}
+
+//finish the file and put it in place of the old snapshot, which is left
+//alone if anything failed. returns -1 then
+int snapshot_close(snapshot_out *out)
+{
+    struct header h;
+    int rc = 0;
+
+    h.magic = SNAPSHOT_MAGIC;
+    h.records = out->records;
+    h.bytes = out->bytes;
+    if(fseek(out->fp, 0, SEEK_SET) < 0 ||
+       fwrite(&h, sizeof(h), 1, out->fp) != 1 || fflush(out->fp) != 0 ||
+       fsync(fileno(out->fp)) < 0)
+        rc = -1;
+    if(fclose(out->fp) != 0) rc = -1;
+    if(rc == 0 && rename(out->tmp, out->path) < 0) rc = -1;
+    if(rc < 0) unlink(out->tmp);
+    return rc;
+}
+
+static int by_recency(const void *a, const void *b)
+{
+    unsigned long x = ((struct pinned *)a)->used;
+    unsigned long y = ((struct pinned *)b)->used;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+//write every object of the memory tier to path. the shards are only
+//locked while their blocks are pinned, the writing happens after.
+//returns -1 if the snapshot couldn't be written
+int snapshot_save(cache_t *cache, char *path, snapshot_stats *st)
+{
+    struct pinned *pins[CACHE_NSHARDS];
+    size_t n[CACHE_NSHARDS], rank, i;
+    struct cache_shard *shard;
+    cache_block *block;
+    snapshot_out out;
+    long start = now_us();
+    int s, more, rc;
+
+    if(snapshot_open(&out, path) < 0) return -1;
+    for(s = 0; s < CACHE_NSHARDS; s++)
+    {
+        shard = &cache->shards[s];
+        pthread_rwlock_rdlock(&shard->lock);
+        pins[s] = Malloc((shard->count + 1) * sizeof(struct pinned));
+        n[s] = 0;
+        for(i = 0; i < shard->nbuckets; i++)
+        {
+            for(block = shard->buckets[i]; block != NULL; block = block->hnext)
+            {
+                __atomic_add_fetch(&block->refcnt, 1, __ATOMIC_RELAXED);
+                pins[s][n[s]].block = block;
+                pins[s][n[s]].used = __atomic_load_n(&block->used,
+                                                     __ATOMIC_RELAXED);
+                n[s]++;
+            }
+        }
+        pthread_rwlock_unlock(&shard->lock);
+        qsort(pins[s], n[s], sizeof(struct pinned), by_recency);
+    }
+    //the most recent block of every shard, then the next ones
+    for(rank = 0, more = 1; more; rank++)
+    {
+        more = 0;
+        for(s = 0; s < CACHE_NSHARDS; s++)
+        {
+            if(rank >= n[s]) continue;
+            more = 1;
+            block = pins[s][rank].block;
+            snapshot_put(&out, block->key, block->key_len, block->buf,
+                         block->size, block->head_len, block->framed,
+                         &block->meta);
+            cache_release(block);
+        }
+    }
+    for(s = 0; s < CACHE_NSHARDS; s++) Free(pins[s]);
+
+    st->records = st->loaded = out.records;
+    st->bytes = out.bytes;
+    rc = snapshot_close(&out);
+    st->us = now_us() - start;
+    return rc;
+}
+
+//fill an empty cache from the snapshot at path, taking the most recent
+//objects that fit. a damaged record ends the walk, what came before it
+//is still loaded. returns -1 if the file can't be read or isn't a
+//snapshot
+int snapshot_load(cache_t *cache, char *path, snapshot_stats *st)
+{
+    size_t budget[CACHE_NSHARDS], size, off, len, slot, ntaken = 0, cap;
+    size_t head;
+    int full[CACHE_NSHARDS], nfull = 0, fd, s;
+    struct record *r, **taken;
+    struct header *h;
+    struct stat sb;
+    cache_key key;
+    cache_meta meta;
+    char *base, *v;
+    long start = now_us();
+
+    memset(st, 0, sizeof(snapshot_stats));
+    if((fd = open(path, O_RDONLY)) < 0) return -1;
+    if(fstat(fd, &sb) < 0 || sb.st_size < sizeof(struct header))
+    {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    size = sb.st_size;
+    base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) return -1;
+    madvise(base, size, MADV_SEQUENTIAL);
+    h = (struct header *)base;
+    if(h->magic != SNAPSHOT_MAGIC)
+    {
+        munmap(base, size);
+        errno = EINVAL;
+        return -1;
+    }
+    st->records = h->records;
+
+    for(s = 0; s < CACHE_NSHARDS; s++)
+    {
+        budget[s] = cache->shards[s].capacity;
+        full[s] = 0;
+    }
+    cap = 1024;
+    taken = Malloc(cap * sizeof(struct record *));
+    //take records until every shard is full: one is once the next
+    //object for it doesn't fit in what is left
+    for(off = sizeof(struct header);
+        nfull < CACHE_NSHARDS && size - off >= sizeof(struct record);
+        off += len)
+    {
+        r = (struct record *)(base + off);
+        if(r->magic != RECORD_MAGIC || r->keylen == 0 || r->size > size ||
+           r->keylen > size || r->etag_len == 0 || r->lm_len == 0 ||
+           r->etag_len > CACHE_VALIDATOR_LEN ||
+           r->lm_len > CACHE_VALIDATOR_LEN)
+            break;
+        head = r->keylen + r->etag_len + r->lm_len;
+        v = (char *)(r + 1) + r->keylen;
+        if((len = record_len(head, r->size)) > size - off ||
+           ((char *)(r + 1))[r->keylen - 1] != '\0' ||
+           v[r->etag_len - 1] != '\0' ||
+           v[r->etag_len + r->lm_len - 1] != '\0')
+            break;
+        cache_key_init(&key, (char *)(r + 1));
+        if(key.len != r->keylen - 1) break;
+        if(r->size > MAX_OBJECT_SIZE || r->head_len > r->size) continue;
+        s = cache_shard_for(cache, key.hash) - cache->shards;
+        if(full[s]) continue;
+        slot = slab_slot_size(sizeof(cache_block) + head + r->size);
+        if(slot > budget[s])
+        {
+            full[s] = 1;
+            nfull++;
+            continue;
+        }
+        if(fnv(FNV_INIT, key.str, head + r->size) != r->sum) break;
+        budget[s] -= slot;
+        if(ntaken == cap) taken = Realloc(taken, (cap *= 2) *
+                                          sizeof(struct record *));
+        taken[ntaken++] = r;
+    }
+    //least recent first, the most recent end up in front
+    while(ntaken > 0)
+    {
+        r = taken[--ntaken];
+        cache_key_init(&key, (char *)(r + 1));
+        meta = r->meta;
+        meta.etag = key.str + r->keylen;
+        meta.last_modified = meta.etag + r->etag_len;
+        cache_insert(&key, key.str + r->keylen + r->etag_len + r->lm_len,
+                     r->size, r->head_len, r->framed, &meta, cache);
+        st->loaded++;
+        st->bytes += r->size;
+    }
+    Free(taken);
+    munmap(base, size);
+    st->us = now_us() - start;
+    return 0;
+}
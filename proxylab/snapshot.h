@@ -0,0 +1,32 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+//snapshot being written: records go to path.tmp, which takes the place
+//of path once it is complete
+typedef struct {
+    FILE *fp;
+    char path[MAXLINE];
+    char tmp[MAXLINE + 8];
+    unsigned long records, bytes;
+} snapshot_out;
+
+//what a save or a load did
+typedef struct {
+    unsigned long records;      //in the file
+    unsigned long loaded;       //of those, now in the cache
+    unsigned long bytes;        //response bytes of the loaded ones
+    long us;                    //time it took
+} snapshot_stats;
+
+int snapshot_open(snapshot_out *out, char *path);
+void snapshot_put(snapshot_out *out, char *key, size_t key_len, char *buf,
+                  size_t size, size_t head_len, int framed,
+                  cache_meta *meta);
+int snapshot_close(snapshot_out *out);
+int snapshot_save(cache_t *cache, char *path, snapshot_stats *st);
+int snapshot_load(cache_t *cache, char *path, snapshot_stats *st);
+
+#endif /* __SNAPSHOT_H__ */
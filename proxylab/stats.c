@@ -0,0 +1,273 @@
+/*request statistics: counters and latency histograms.
+ * Every thread that records gets a slot of its own, so recording is a
+ * few plain stores without locks or atomic read-modify-writes; the
+ * stores are relaxed atomics only so a concurrent reader sees whole
+ * values. Readers sum the slots. A slot outlives its thread: when the
+ * thread exits the slot goes to a free list and the next new thread
+ * keeps counting in it, so the thread-per-connection front end doesn't
+ * grow the list without bound.
+ * Histograms are log-linear like HdrHistogram: below 2^STATS_SUB_BITS
+ * every value has a bucket, above that each power of two is split into
+ * 2^STATS_SUB_BITS buckets.*/
+#include "stats.h"
+
+struct stats_slot{
+    unsigned long counters[STATS_NCOUNTERS];
+    stats_hist ttfb, total;
+    struct stats_slot *next;        //all slots ever made
+    struct stats_slot *next_free;
+};
+
+static struct stats_slot *slots, *free_slots;
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key;
+static __thread struct stats_slot *my_slot;
+
+static const char *counter_names[STATS_NCOUNTERS] = {
+    "hits", "disk_hits", "revalidated", "misses", "coalesced", "failed",
+    "bad_requests", "upstream_failures", "bytes_cache", "bytes_origin",
+    "tunnels", "bytes_tunneled"
+};
+
+static long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+//the thread is gone, its slot waits for the next one
+static void slot_exit(void *arg)
+{
+    struct stats_slot *s = arg;
+    pthread_mutex_lock(&slots_lock);
+    s->next_free = free_slots;
+    free_slots = s;
+    pthread_mutex_unlock(&slots_lock);
+}
+
+static void make_key(void)
+{
+    pthread_key_create(&slot_key, slot_exit);
+}
+
+static struct stats_slot *slot(void)
+{
+    struct stats_slot *s;
+
+    if((s = my_slot) != NULL) return s;
+    pthread_once(&key_once, make_key);
+    pthread_mutex_lock(&slots_lock);
+    if((s = free_slots) != NULL) free_slots = s->next_free;
+    else
+    {
+        s = Calloc(1, sizeof(struct stats_slot));
+        s->next = slots;
+        __atomic_store_n(&slots, s, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&slots_lock);
+    pthread_setspecific(slot_key, s);
+    return my_slot = s;
+}
+
+//only the slot's thread writes it
+static void bump(unsigned long *c, unsigned long n)
+{
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+static int bucket_of(unsigned long v)
+{
+    int e;
+    if(v < (1UL << STATS_SUB_BITS)) return v;
+    e = 63 - __builtin_clzl(v);
+    if(e >= STATS_MAX_EXP) return STATS_BUCKETS - 1;
+    return ((e - STATS_SUB_BITS + 1) << STATS_SUB_BITS) |
+           ((v >> (e - STATS_SUB_BITS)) & ((1UL << STATS_SUB_BITS) - 1));
+}
+
+//largest value that falls into bucket i
+static unsigned long bucket_top(int i)
+{
+    int shift;
+    if(i < (1 << STATS_SUB_BITS)) return i;
+    shift = (i >> STATS_SUB_BITS) - 1;
+    return (((unsigned long)(i & ((1 << STATS_SUB_BITS) - 1)) +
+             (1UL << STATS_SUB_BITS) + 1) << shift) - 1;
+}
+
+static void record(stats_hist *h, long v)
+{
+    if(v < 0) v = 0;
+    bump(&h->count, 1);
+    bump(&h->sum, v);
+    bump(&h->buckets[bucket_of(v)], 1);
+    if((unsigned long)v > h->max)
+        __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+void stats_count(enum stats_counter counter, unsigned long n)
+{
+    bump(&slot()->counters[counter], n);
+}
+
+void stats_start(stats_req *r)
+{
+    r->start = now_us();
+    r->first_byte = 0;
+}
+
+//the first response byte is about to go out, later calls do nothing
+void stats_first_byte(stats_req *r)
+{
+    if(r->first_byte) return;
+    r->first_byte = 1;
+    record(&slot()->ttfb, now_us() - r->start);
+}
+
+//the request is answered: outcome tells how and bytes is what the
+//client got, counted as from the cache or from the origin
+void stats_done(stats_req *r, enum stats_counter outcome, size_t bytes)
+{
+    struct stats_slot *s = slot();
+
+    if(outcome != STATS_FAILED) stats_first_byte(r);
+    bump(&s->counters[outcome], 1);
+    //a failed request's bytes came from neither, they aren't counted
+    switch(outcome)
+    {
+    case STATS_MISSES:
+    case STATS_COALESCED:
+        bump(&s->counters[STATS_BYTES_ORIGIN], bytes);
+        break;
+    case STATS_HITS:
+    case STATS_DISK_HITS:
+    case STATS_REVALIDATED:
+        bump(&s->counters[STATS_BYTES_CACHE], bytes);
+        break;
+    default:
+        break;
+    }
+    record(&s->total, now_us() - r->start);
+}
+
+//1 if req asks for the statistics page, json tells which format
+int stats_request(http_request *req, int *json)
+{
+    size_t len = strlen(STATS_PATH);
+
+    if(req->authority.len != 0 || req->path.len < len ||
+       strncmp(req->path.p, STATS_PATH, len) != 0 ||
+       (req->path.p[len] != '\0' && req->path.p[len] != '?'))
+        return 0;
+    *json = strstr(req->path.p + len, "format=json") != NULL;
+    return 1;
+}
+
+static void add_hist(stats_hist *to, stats_hist *from)
+{
+    unsigned long max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    int i;
+
+    to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+    to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+    if(max > to->max) to->max = max;
+    for(i = 0; i < STATS_BUCKETS; i++)
+        to->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+}
+
+//the value below which a fraction p of the recorded values fall
+static unsigned long percentile(stats_hist *h, double p)
+{
+    unsigned long want = (unsigned long)(p * h->count + 0.5), seen = 0;
+    int i;
+
+    if(want == 0) want = 1;
+    for(i = 0; i < STATS_BUCKETS; i++)
+        if((seen += h->buckets[i]) >= want)
+            return bucket_top(i) < h->max ? bucket_top(i) : h->max;
+    return h->max;
+}
+
+static const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char *percentile_names[] = { "p50", "p90", "p99", "p999" };
+#define NPERCENTILES 4
+
+static size_t print_hist(char *buf, size_t cap, const char *name,
+                         stats_hist *h, int json)
+{
+    size_t n;
+    int i;
+
+    n = snprintf(buf, cap, json ? "\"%s_us\": {\"count\": %lu, "
+                 "\"mean\": %lu" : "%s_us count %lu mean %lu",
+                 name, h->count, h->count ? h->sum / h->count : 0);
+    for(i = 0; i < NPERCENTILES && n < cap; i++)
+        n += snprintf(buf + n, cap - n, json ? ", \"%s\": %lu" : " %s %lu",
+                      percentile_names[i],
+                      h->count ? percentile(h, percentiles[i]) : 0);
+    if(n < cap)
+        n += snprintf(buf + n, cap - n, json ? ", \"max\": %lu}" :
+                      " max %lu\n", h->max);
+    return n;
+}
+
+//the statistics page as a whole HTTP response, truncated to cap bytes.
+//returns its length
+size_t stats_response(char *buf, size_t cap, cache_t *cache, int json)
+{
+    unsigned long counters[STATS_NCOUNTERS] = { 0 }, requests = 0;
+    stats_hist ttfb, total;
+    struct stats_slot *s;
+    cache_totals t;
+    char body[MAXBUF];
+    size_t n = 0, len;
+    int i;
+
+    memset(&ttfb, 0, sizeof(ttfb));
+    memset(&total, 0, sizeof(total));
+    for(s = __atomic_load_n(&slots, __ATOMIC_ACQUIRE); s != NULL; s = s->next)
+    {
+        for(i = 0; i < STATS_NCOUNTERS; i++)
+            counters[i] += __atomic_load_n(&s->counters[i], __ATOMIC_RELAXED);
+        add_hist(&ttfb, &s->ttfb);
+        add_hist(&total, &s->total);
+    }
+    for(i = STATS_HITS; i <= STATS_FAILED; i++) requests += counters[i];
+    cache_stats(cache, &t);
+
+    n += snprintf(body + n, MAXBUF - n, json ? "{\"requests\": %lu" :
+                  "requests %lu\n", requests);
+    for(i = 0; i < STATS_NCOUNTERS && n < MAXBUF; i++)
+        n += snprintf(body + n, MAXBUF - n, json ? ", \"%s\": %lu" :
+                      "%s %lu\n", counter_names[i], counters[i]);
+    if(n < MAXBUF)
+        n += snprintf(body + n, MAXBUF - n, json ?
+                      ", \"cache\": {\"objects\": %lu, \"bytes\": %lu, "
+                      "\"lookups\": %lu, \"hits\": %lu, \"evictions\": %lu, "
+                      "\"rejected\": %lu}, " :
+                      "cache_objects %lu\ncache_bytes %lu\n"
+                      "cache_lookups %lu\ncache_hits %lu\n"
+                      "cache_evictions %lu\ncache_rejected %lu\n",
+                      (unsigned long)t.count, (unsigned long)t.size,
+                      t.lookups, t.hits, t.evictions, t.rejected);
+    if(n < MAXBUF) n += print_hist(body + n, MAXBUF - n, "ttfb", &ttfb, json);
+    if(json && n < MAXBUF) n += snprintf(body + n, MAXBUF - n, ", ");
+    if(n < MAXBUF)
+        n += print_hist(body + n, MAXBUF - n, "total", &total, json);
+    if(json && n < MAXBUF) n += snprintf(body + n, MAXBUF - n, "}\n");
+    if(n > MAXBUF - 1) n = MAXBUF - 1;
+
+    //a body cut short also shortens its Content-Length
+    while((len = snprintf(buf, cap, "HTTP/1.1 200 OK\r\n"
+                          "Content-Type: %s\r\nContent-Length: %lu\r\n"
+                          "Cache-Control: no-store\r\n\r\n",
+                          json ? "application/json" : "text/plain",
+                          (unsigned long)n)) < cap && len + n > cap)
+        n = cap - len;
+    if(len >= cap) return 0;
+    memcpy(buf + len, body, n);
+    return len + n;
+}
@@ -0,0 +1,56 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "http.h"
+
+//proxy-local page with the statistics, asked for with an origin-form
+//request like "GET /__proxy/stats HTTP/1.1"; ?format=json for JSON
+#define STATS_PATH "/__proxy/stats"
+//histogram resolution: each power of two is split into 2^STATS_SUB_BITS
+//buckets, so a recorded value is off by less than 1/16
+#define STATS_SUB_BITS 4
+//values are microseconds, anything from 2^STATS_MAX_EXP on (about 19
+//hours) lands in the last bucket
+#define STATS_MAX_EXP 36
+#define STATS_BUCKETS ((STATS_MAX_EXP - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+enum stats_counter{
+    //how requests were answered, one of these per finished request
+    STATS_HITS,                 //from the memory cache
+    STATS_DISK_HITS,            //from the disk tier
+    STATS_REVALIDATED,          //stale copy the server confirmed
+    STATS_MISSES,               //fetched from the server
+    STATS_COALESCED,            //streamed from another request's fetch
+    STATS_FAILED,               //the server couldn't be reached
+    //other events
+    STATS_BAD_REQUESTS,
+    STATS_UPSTREAM_FAILURES,    //connects or fetches that failed
+    STATS_BYTES_CACHE,          //response bytes sent from a cached copy
+    STATS_BYTES_ORIGIN,         //response bytes relayed from servers
+    STATS_TUNNELS,              //CONNECT tunnels opened
+    STATS_BYTES_TUNNELED,       //bytes tunnels moved, both ways
+    STATS_NCOUNTERS
+};
+
+//latency histogram in microseconds, log-linear like HdrHistogram
+typedef struct {
+    unsigned long count, sum, max;
+    unsigned long buckets[STATS_BUCKETS];
+} stats_hist;
+
+//timing of one request in flight
+typedef struct {
+    long start;                 //microseconds, monotonic
+    int first_byte;             //time to first byte already recorded
+} stats_req;
+
+void stats_count(enum stats_counter counter, unsigned long n);
+void stats_start(stats_req *r);
+void stats_first_byte(stats_req *r);
+void stats_done(stats_req *r, enum stats_counter outcome, size_t bytes);
+int stats_request(http_request *req, int *json);
+size_t stats_response(char *buf, size_t cap, cache_t *cache, int json);
+
+#endif /* __STATS_H__ */
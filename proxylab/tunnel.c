@@ -0,0 +1,198 @@
+/*CONNECT tunnels.
+ * Once the proxy has connected to the target it answers the client with
+ * a 200 and from then on only moves bytes between the two sockets, in
+ * both directions at once and without looking at them. Each direction
+ * is a tunnel_half that moves as much as the sockets allow without
+ * blocking and says which socket it waits for, so the same code serves
+ * the poll loop of the threaded front ends (tunnel_relay) and the epoll
+ * loops of event.c. With splice the bytes go through a pipe of the half
+ * and never enter user space, otherwise through a buffer. When one side
+ * closes, the other is shut down for writing once everything before
+ * the close got there, so a half-closed connection keeps working the
+ * other way.*/
+#include <poll.h>
+#include "tunnel.h"
+
+//a half copying through buf, splice is off or can't be used
+static void use_copy(tunnel_half *h)
+{
+    if(h->pipefd[0] >= 0)
+    {
+        close(h->pipefd[0]);
+        close(h->pipefd[1]);
+        h->pipefd[0] = h->pipefd[1] = -1;
+    }
+    if(h->buf == NULL) h->buf = Malloc(TUNNEL_BUF_SIZE);
+}
+
+//set up the half moving bytes from from to to, both non-blocking,
+//through a pipe if zero_copy
+void tunnel_half_init(tunnel_half *h, int from, int to, int zero_copy)
+{
+    memset(h, 0, sizeof(tunnel_half));
+    h->from = from;
+    h->to = to;
+    h->pipefd[0] = h->pipefd[1] = -1;
+    if(zero_copy && pipe2(h->pipefd, O_NONBLOCK | O_CLOEXEC) == 0)
+    {
+        //a bigger pipe means fewer splices, best effort
+        fcntl(h->pipefd[1], F_SETPIPE_SZ, TUNNEL_BUF_SIZE);
+        return;
+    }
+    use_copy(h);
+}
+
+//queue bytes to be written to to before anything read from from.
+//returns -1 if they don't fit
+int tunnel_half_seed(tunnel_half *h, const char *data, size_t n)
+{
+    if(h->buf == NULL) h->buf = Malloc(TUNNEL_BUF_SIZE);
+    if(n > TUNNEL_BUF_SIZE - h->len) return -1;
+    memcpy(h->buf + h->len, data, n);
+    h->len += n;
+    return 0;
+}
+
+//move bytes until a socket would block. returns 0 then, 1 once from
+//is done and to has been shut down, -1 on an error on either socket
+int tunnel_move(tunnel_half *h)
+{
+    ssize_t n;
+
+    if(h->done) return 1;
+    while(1)
+    {
+        //what was read before goes out first
+        h->blocked_on_write = 1;
+        while(h->off < h->len)
+        {
+            if((n = write(h->to, h->buf + h->off, h->len - h->off)) < 0)
+            {
+                if(errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+            }
+            h->off += n;
+            h->moved += n;
+        }
+        h->off = h->len = 0;
+        while(h->piped > 0)
+        {
+            n = splice(h->pipefd[0], NULL, h->to, NULL, h->piped,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(n <= 0)
+            {
+                if(n < 0 && errno == EINTR) continue;
+                return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ?
+                       0 : -1;
+            }
+            h->piped -= n;
+            h->moved += n;
+        }
+        if(h->eof)
+        {
+            shutdown(h->to, SHUT_WR);
+            h->done = 1;
+            return 1;
+        }
+
+        h->blocked_on_write = 0;
+        if(h->pipefd[0] >= 0)
+        {
+            //the pipe is empty here, so it can't be what would block
+            n = splice(h->from, NULL, h->pipefd[1], NULL, TUNNEL_BUF_SIZE,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(n < 0 && errno == EINVAL)
+            {
+                use_copy(h);
+                continue;
+            }
+            if(n > 0) h->piped = n;
+        }
+        else if((n = read(h->from, h->buf, TUNNEL_BUF_SIZE)) > 0) h->len = n;
+        if(n == 0) h->eof = 1;
+        else if(n < 0)
+        {
+            if(errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+    }
+}
+
+//what the half waits for on fd, TUNNEL_WANT_READ, TUNNEL_WANT_WRITE or
+//0 if it doesn't wait for fd
+int tunnel_half_wants(tunnel_half *h, int fd)
+{
+    if(h->done) return 0;
+    if(h->blocked_on_write) return fd == h->to ? TUNNEL_WANT_WRITE : 0;
+    return fd == h->from ? TUNNEL_WANT_READ : 0;
+}
+
+void tunnel_half_free(tunnel_half *h)
+{
+    if(h->pipefd[0] >= 0)
+    {
+        close(h->pipefd[0]);
+        close(h->pipefd[1]);
+    }
+    Free(h->buf);
+}
+
+//the poll events the halves wait for on fd, -1 in place of fd if none
+static void want_events(tunnel_half *half, int fd, struct pollfd *p)
+{
+    int w = tunnel_half_wants(&half[0], fd) | tunnel_half_wants(&half[1], fd);
+
+    p->events = (w & TUNNEL_WANT_READ ? POLLIN : 0) |
+                (w & TUNNEL_WANT_WRITE ? POLLOUT : 0);
+    //a socket nobody waits for would still report a hangup at once
+    p->fd = p->events ? fd : -1;
+}
+
+//run a tunnel for the threaded front ends: answer the client with the
+//200, then relay both ways until both sides are done, either fails or
+//nothing moves for TUNNEL_IDLE_TIMEOUT. early holds bytes the client
+//sent right behind its request. returns the bytes written both ways
+unsigned long tunnel_relay(int clientfd, int serverfd, char *early,
+                           size_t n, int zero_copy)
+{
+    tunnel_half half[2];
+    struct pollfd pfd[2];
+    int ready[2] = { 1, 1 }, fds[2] = { clientfd, serverfd }, i, j, rc;
+    unsigned long moved;
+
+    for(i = 0; i < 2; i++)
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    tunnel_half_init(&half[0], clientfd, serverfd, zero_copy);
+    tunnel_half_init(&half[1], serverfd, clientfd, zero_copy);
+    tunnel_half_seed(&half[1], TUNNEL_ESTABLISHED, strlen(TUNNEL_ESTABLISHED));
+    if(tunnel_half_seed(&half[0], early, n) < 0) goto out;
+
+    while(1)
+    {
+        for(i = 0; i < 2; i++)
+            if(ready[i] && tunnel_move(&half[i]) < 0) goto out;
+        if(half[0].done && half[1].done) break;
+        for(j = 0; j < 2; j++) want_events(half, fds[j], &pfd[j]);
+        if((rc = poll(pfd, 2, TUNNEL_IDLE_TIMEOUT * 1000)) < 0)
+        {
+            if(errno != EINTR) break;
+            ready[0] = ready[1] = 0;
+            continue;
+        }
+        if(rc == 0) break;
+        //a half moves again once a socket it waits for is ready
+        for(i = 0; i < 2; i++)
+        {
+            ready[i] = 0;
+            for(j = 0; j < 2; j++)
+                if(pfd[j].fd >= 0 && pfd[j].revents != 0 &&
+                   tunnel_half_wants(&half[i], fds[j]))
+                    ready[i] = 1;
+        }
+    }
+ out:
+    moved = half[0].moved + half[1].moved;
+    tunnel_half_free(&half[0]);
+    tunnel_half_free(&half[1]);
+    return moved;
+}
@@ -0,0 +1,39 @@
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+#include "csapp.h"
+
+//what the proxy answers a CONNECT with once the target is reached
+#define TUNNEL_ESTABLISHED "HTTP/1.1 200 Connection Established\r\n\r\n"
+//bytes moved per read or splice, also the size asked for each pipe
+#define TUNNEL_BUF_SIZE (64*1024)
+//seconds a tunnel may go without a byte moving either way
+#define TUNNEL_IDLE_TIMEOUT 60
+//what a half waits for, from tunnel_half_wants
+#define TUNNEL_WANT_READ 1
+#define TUNNEL_WANT_WRITE 2
+
+//one direction of a tunnel: bytes read from from are written to to.
+//they pass through a pipe with splice, through buf otherwise, and buf
+//also holds bytes handed over with tunnel_half_seed
+typedef struct {
+    int from, to;
+    int pipefd[2];              //-1 when copying through buf
+    size_t piped;               //bytes waiting in the pipe
+    char *buf;
+    size_t off, len;            //bytes waiting in buf
+    int blocked_on_write;       //to is full, else from is empty
+    int eof;                    //from is done, to gets shut down
+    int done;
+    unsigned long moved;        //bytes written to to
+} tunnel_half;
+
+void tunnel_half_init(tunnel_half *h, int from, int to, int zero_copy);
+int tunnel_half_seed(tunnel_half *h, const char *data, size_t n);
+int tunnel_move(tunnel_half *h);
+int tunnel_half_wants(tunnel_half *h, int fd);
+void tunnel_half_free(tunnel_half *h);
+unsigned long tunnel_relay(int clientfd, int serverfd, char *early,
+                           size_t n, int zero_copy);
+
+#endif /* __TUNNEL_H__ */
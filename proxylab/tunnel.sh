@@ -0,0 +1,73 @@
+#!/bin/bash
+#
+# tunnel.sh - measures the throughput of CONNECT tunnels. tunnelgen
+#     streams bytes through the proxy to its own echo target and back,
+#     first without the proxy for a baseline, then through it with each
+#     front end relaying with splice and by copying.
+#
+#     usage: ./tunnel.sh [-c "conns ..."] [-t secs] [-- proxy options]
+#     e.g.   ./tunnel.sh -c "1 16" -t 10 -- -n 2
+#
+
+TIMEOUT=5
+CONNS="1 8"
+DURATION=5
+PROXY_ARGS=""
+CONFIGS=("-m thread -r splice" "-m thread -r copy" "-m epoll -r splice"
+         "-m epoll -r copy")
+
+#
+# free_port - prints a port nothing listens on, starting at a random one
+#
+function free_port {
+    port=$(( (RANDOM % 30000) + 20000 ))
+    while (exec 3<> /dev/tcp/localhost/${port}) 2> /dev/null
+    do
+        port=$((port + 1))
+    done
+    echo ${port}
+}
+
+function cleanup {
+    [ -n "${PROXY_PID}" ] && kill ${PROXY_PID} 2> /dev/null
+}
+
+while [ $# -gt 0 ]
+do
+    case "$1" in
+    -c) CONNS=$2; shift 2;;
+    -t) DURATION=$2; shift 2;;
+    --) shift; PROXY_ARGS="$*"; break;;
+    *)  echo "usage: $0 [-c \"conns ...\"] [-t secs] [-- proxy options]"
+        exit 1;;
+    esac
+done
+
+if [ ! -x ./proxy ] || [ ! -x ./tunnelgen ]
+then
+    echo "Error: build proxy and tunnelgen first (make)"
+    exit 1
+fi
+trap cleanup EXIT
+
+for conns in ${CONNS}
+do
+    echo "direct:"
+    echo "  `./tunnelgen -c ${conns} -t ${DURATION}`"
+    for config in "${CONFIGS[@]}"
+    do
+        port=`free_port`
+        ./proxy ${config} ${PROXY_ARGS} ${port} 2> /dev/null &
+        PROXY_PID=$!
+        for i in `seq $((TIMEOUT * 10))`
+        do
+            (exec 3<> /dev/tcp/localhost/${port}) 2> /dev/null && break
+            sleep 0.1
+        done
+        echo "${config}:"
+        echo "  `./tunnelgen -c ${conns} -t ${DURATION} localhost:${port}`"
+        kill ${PROXY_PID} 2> /dev/null
+        wait ${PROXY_PID} 2> /dev/null
+        PROXY_PID=""
+    done
+done
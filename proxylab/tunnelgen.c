@@ -0,0 +1,222 @@
+/*throughput of CONNECT tunnels through the proxy.
+ * tunnelgen runs its own echo target on a loopback port and opens
+ * connections to it through the proxy with CONNECT, or straight to it
+ * when no proxy is given, for a baseline. Every connection streams a
+ * byte pattern into the tunnel from one thread for the duration of the
+ * run and reads it back from another, checking every byte, so the
+ * tunnel carries the same load both ways. At the end the bytes that
+ * made the round trip per second are printed.*/
+#include "csapp.h"
+
+#define MAX_CONNS 256
+//the pattern repeats every PATTERN_LEN bytes, a prime so it doesn't
+//line up with any buffer size
+#define PATTERN_LEN 251
+//bytes per write, a whole number of patterns
+#define BLOCK_SIZE (PATTERN_LEN * 256)
+
+struct conn{
+    pthread_t reader, writer;
+    int fd;
+    unsigned long sent, received;
+    int bad;                        //an echoed byte didn't match
+};
+
+static char pattern[BLOCK_SIZE + PATTERN_LEN];
+static volatile int stop;
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-c conns] [-t secs] [proxy host:port]\n",
+            prog);
+    fprintf(stderr, "  -c  concurrent tunnels, 1 by default\n");
+    fprintf(stderr, "  -t  seconds the bytes flow, 5 by default\n");
+    fprintf(stderr, "  without a proxy the echo target is connected to "
+                    "directly\n");
+    exit(1);
+}
+
+static long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+//echo everything back until the other side closes
+static void *echo_thread(void *vargp)
+{
+    int fd = (int)(long)vargp;
+    char buf[65536];
+    ssize_t n;
+
+    Pthread_detach(pthread_self());
+    while((n = read(fd, buf, sizeof(buf))) > 0)
+        if(rio_writen(fd, buf, n) != n) break;
+    shutdown(fd, SHUT_WR);
+    close(fd);
+    return NULL;
+}
+
+static void *echo_server(void *vargp)
+{
+    int listenfd = (int)(long)vargp, connfd;
+    pthread_t tid;
+
+    while((connfd = accept(listenfd, NULL, NULL)) >= 0)
+        Pthread_create(&tid, NULL, echo_thread, (void *)(long)connfd);
+    return NULL;
+}
+
+//start the echo target on a free loopback port, returns the port
+static int start_echo(void)
+{
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    pthread_t tid;
+    int fd;
+
+    fd = Socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    Bind(fd, (SA *)&sa, sizeof(sa));
+    Listen(fd, LISTENQ);
+    getsockname(fd, (SA *)&sa, &len);
+    Pthread_create(&tid, NULL, echo_server, (void *)(long)fd);
+    return ntohs(sa.sin_port);
+}
+
+//connect to the echo target, through a proxy tunnel if proxy isn't
+//NULL. returns -1 if that fails
+static int open_conn(char *proxy, int echo_port)
+{
+    char host[MAXLINE], port[16], buf[MAXLINE], *colon;
+    size_t n = 0;
+    ssize_t r;
+    int fd;
+
+    snprintf(port, sizeof(port), "%d", echo_port);
+    if(proxy == NULL) return open_clientfd("127.0.0.1", port);
+
+    snprintf(host, sizeof(host), "%s", proxy);
+    if((colon = strrchr(host, ':')) == NULL) return -1;
+    *colon = '\0';
+    if((fd = open_clientfd(host, colon + 1)) < 0) return -1;
+    n = snprintf(buf, sizeof(buf), "CONNECT 127.0.0.1:%d HTTP/1.1\r\n"
+                 "Host: 127.0.0.1:%d\r\n\r\n", echo_port, echo_port);
+    if(rio_writen(fd, buf, n) != n) goto fail;
+    //the answer is read a byte at a time so none of the tunnel's is
+    n = 0;
+    while(n < 4 || memcmp(buf + n - 4, "\r\n\r\n", 4) != 0)
+    {
+        if(n == sizeof(buf) - 1 || (r = read(fd, buf + n, 1)) <= 0)
+            goto fail;
+        n++;
+    }
+    buf[n] = '\0';
+    if(strncmp(buf, "HTTP/1.1 200", 12) != 0 &&
+       strncmp(buf, "HTTP/1.0 200", 12) != 0)
+    {
+        fprintf(stderr, "proxy answered %.*s\n", (int)strcspn(buf, "\r"),
+                buf);
+        goto fail;
+    }
+    return fd;
+
+ fail:
+    close(fd);
+    return -1;
+}
+
+static void *writer_thread(void *vargp)
+{
+    struct conn *c = vargp;
+
+    while(!stop && rio_writen(c->fd, pattern, BLOCK_SIZE) == BLOCK_SIZE)
+        c->sent += BLOCK_SIZE;
+    shutdown(c->fd, SHUT_WR);
+    return NULL;
+}
+
+//read the echo until the tunnel closes, checking it against the pattern
+static void *reader_thread(void *vargp)
+{
+    struct conn *c = vargp;
+    char buf[BLOCK_SIZE];
+    ssize_t n;
+
+    while((n = read(c->fd, buf, sizeof(buf))) > 0)
+    {
+        if(memcmp(buf, pattern + c->received % PATTERN_LEN, n) != 0)
+            c->bad = 1;
+        c->received += n;
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct conn *conns;
+    char *proxy = NULL;
+    int opt, nconns = 1, duration = 5, echo_port, i, bad = 0;
+    unsigned long received = 0;
+    long start;
+    double secs;
+
+    while((opt = getopt(argc, argv, "c:t:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'c':
+            if((nconns = atoi(optarg)) <= 0 || nconns > MAX_CONNS)
+                usage(argv[0]);
+            break;
+        case 't':
+            if((duration = atoi(optarg)) <= 0) usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(optind < argc - 1) usage(argv[0]);
+    if(optind == argc - 1) proxy = argv[optind];
+    Signal(SIGPIPE, SIG_IGN);
+    for(i = 0; i < sizeof(pattern); i++)
+        pattern[i] = 'a' + i % PATTERN_LEN % 26;
+    echo_port = start_echo();
+
+    conns = Calloc(nconns, sizeof(struct conn));
+    for(i = 0; i < nconns; i++)
+    {
+        if((conns[i].fd = open_conn(proxy, echo_port)) < 0)
+        {
+            fprintf(stderr, "can't open connection %d%s\n", i,
+                    proxy ? " through the proxy" : "");
+            exit(1);
+        }
+    }
+    start = now_us();
+    for(i = 0; i < nconns; i++)
+    {
+        Pthread_create(&conns[i].reader, NULL, reader_thread, &conns[i]);
+        Pthread_create(&conns[i].writer, NULL, writer_thread, &conns[i]);
+    }
+    sleep(duration);
+    stop = 1;
+    for(i = 0; i < nconns; i++)
+    {
+        Pthread_join(conns[i].writer, NULL);
+        Pthread_join(conns[i].reader, NULL);
+        close(conns[i].fd);
+        received += conns[i].received;
+        bad |= conns[i].bad || conns[i].received != conns[i].sent;
+    }
+    secs = (now_us() - start) / 1e6;
+
+    printf("%d tunnels %s, %.1f s: %.1f MB/s each way, %s\n", nconns,
+           proxy ? "through the proxy" : "direct", secs,
+           received / secs / 1e6, bad ? "ECHO MISMATCH" : "echo checked");
+    Free(conns);
+    return bad;
+}
@@ -0,0 +1,308 @@
+/*pool of persistent connections to origin servers.
+ * Idle connections are kept per "host:port" so a miss can skip the TCP
+ * handshake. New ones are opened through the DNS cache (dns.c). A
+ * reaper thread closes the ones that have been idle for longer than
+ * the timeout. An origin's entry goes once it has no connections left
+ * and no fetch waiting for one, so the table only holds origins in use.
+ * Connections in use are capped per origin and overall; a fetch over
+ * the cap waits a little for a slot and then fails, so a server that
+ * stalls only ties up its own share of the proxy.*/
+#include "upstream.h"
+#include "dns.h"
+
+struct origin{
+    char *key;
+    upstream_conn *idle;        //most recently parked first
+    int nidle;
+    int active;                 //connections in use
+    int waiters;                //fetches waiting in admit
+    struct origin *next;
+};
+
+static struct origin *buckets[UPSTREAM_NBUCKETS];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static int idle_timeout = UPSTREAM_IDLE_TIMEOUT;
+static int max_per_origin = UPSTREAM_MAX_PER_ORIGIN;
+//slots in use over all origins, waiters sleep on slot_free
+static int active;
+static pthread_cond_t slot_free = PTHREAD_COND_INITIALIZER;
+//counters, updated under pool_lock
+static unsigned long admitted, waited, refused;
+
+static unsigned long hash_origin(const char *key)
+{
+    unsigned long h = 5381;
+    while(*key) h = h * 33 + (unsigned char)*key++;
+    return h;
+}
+
+//find or create the pool entry for key, pool_lock held
+static struct origin *find_origin(char *key)
+{
+    struct origin **slot = &buckets[hash_origin(key) % UPSTREAM_NBUCKETS];
+    struct origin *o;
+
+    for(o = *slot; o != NULL; o = o->next)
+        if(strcmp(o->key, key) == 0) return o;
+    o = Calloc(1, sizeof(struct origin));
+    o->key = Malloc(strlen(key) + 1);
+    strcpy(o->key, key);
+    o->next = *slot;
+    *slot = o;
+    return o;
+}
+
+//nothing refers to o any more, pool_lock held
+static int unused(struct origin *o)
+{
+    return o->active == 0 && o->nidle == 0 && o->waiters == 0;
+}
+
+//unlink o from its bucket and free it, pool_lock held
+static void drop_origin(struct origin *o)
+{
+    struct origin **slot = &buckets[hash_origin(o->key) % UPSTREAM_NBUCKETS];
+
+    while(*slot != o) slot = &(*slot)->next;
+    *slot = o->next;
+    Free(o->key);
+    Free(o);
+}
+
+//take a slot for a connection to o. with wait a full origin is waited
+//on for up to UPSTREAM_WAIT seconds. returns 0 if no slot is free,
+//and o may be gone then. pool_lock held
+static int admit(struct origin *o, int wait)
+{
+    struct timespec deadline;
+
+    if(active >= UPSTREAM_MAX_ACTIVE || o->active >= max_per_origin)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += UPSTREAM_WAIT;
+        if(wait) waited++;
+        //o stays while it is waited on
+        o->waiters++;
+        while(active >= UPSTREAM_MAX_ACTIVE || o->active >= max_per_origin)
+        {
+            if(!wait || pthread_cond_timedwait(&slot_free, &pool_lock,
+                                               &deadline) == ETIMEDOUT)
+            {
+                o->waiters--;
+                refused++;
+                if(unused(o)) drop_origin(o);
+                return 0;
+            }
+        }
+        o->waiters--;
+    }
+    active++;
+    o->active++;
+    admitted++;
+    return 1;
+}
+
+//give a slot back, o may be gone afterwards. pool_lock held
+static void leave(struct origin *o)
+{
+    active--;
+    o->active--;
+    pthread_cond_broadcast(&slot_free);
+    if(unused(o)) drop_origin(o);
+}
+
+//for callers that connect on their own, like the event loops: take a
+//slot for hostname:port without waiting. returns 0 if none is free
+int upstream_admit(char *hostname, char *port)
+{
+    char key[MAXLINE];
+    int ok;
+
+    snprintf(key, MAXLINE, "%s:%s", hostname, port);
+    pthread_mutex_lock(&pool_lock);
+    ok = admit(find_origin(key), 0);
+    pthread_mutex_unlock(&pool_lock);
+    return ok;
+}
+
+void upstream_leave(char *hostname, char *port)
+{
+    char key[MAXLINE];
+
+    snprintf(key, MAXLINE, "%s:%s", hostname, port);
+    pthread_mutex_lock(&pool_lock);
+    leave(find_origin(key));
+    pthread_mutex_unlock(&pool_lock);
+}
+
+//an idle connection the server has closed, or that has unexpected
+//bytes waiting, cannot be used for the next request
+static int still_open(upstream_conn *uc)
+{
+    char c;
+    ssize_t n;
+    if(uc->rio.rio_cnt > 0) return 0;
+    n = recv(uc->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+//close connections idle for longer than the timeout, once a second
+static void *reaper(void *vargp)
+{
+    int i;
+    time_t now;
+    struct origin **op, *o;
+    upstream_conn **pp, *uc, *dead;
+
+    Pthread_detach(pthread_self());
+    while(1)
+    {
+        sleep(1);
+        dead = NULL;
+        now = time(NULL);
+        pthread_mutex_lock(&pool_lock);
+        for(i = 0; i < UPSTREAM_NBUCKETS; i++)
+        {
+            op = &buckets[i];
+            while((o = *op) != NULL)
+            {
+                pp = &o->idle;
+                while((uc = *pp) != NULL)
+                {
+                    if(now - uc->idle_since >= idle_timeout)
+                    {
+                        *pp = uc->next;
+                        o->nidle--;
+                        uc->next = dead;
+                        dead = uc;
+                    }
+                    else pp = &uc->next;
+                }
+                //a dropped entry's successor moves up into *op
+                if(unused(o)) drop_origin(o);
+                else op = &o->next;
+            }
+        }
+        pthread_mutex_unlock(&pool_lock);
+        //close outside the lock
+        while((uc = dead) != NULL)
+        {
+            dead = uc->next;
+            upstream_close(uc);
+        }
+    }
+    return NULL;
+}
+
+void upstream_init(int timeout, int per_origin)
+{
+    pthread_t tid;
+    idle_timeout = timeout;
+    max_per_origin = per_origin;
+    Pthread_create(&tid, NULL, reaper, NULL);
+}
+
+//a pooled connection to hostname:port if there is a live one,
+//otherwise a new one, holding one of the origin's slots until it is
+//put back or closed. returns NULL if the server can't be reached, with
+//errno EBUSY if no slot got free in time
+upstream_conn *upstream_get(char *hostname, char *port)
+{
+    char key[MAXLINE];
+    struct origin *o;
+    upstream_conn *uc;
+    struct timeval timeout = { UPSTREAM_IO_TIMEOUT, 0 };
+    int fd;
+
+    snprintf(key, MAXLINE, "%s:%s", hostname, port);
+    pthread_mutex_lock(&pool_lock);
+    if(!admit(find_origin(key), 1))
+    {
+        pthread_mutex_unlock(&pool_lock);
+        errno = EBUSY;
+        return NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    while(1)
+    {
+        pthread_mutex_lock(&pool_lock);
+        o = find_origin(key);
+        if((uc = o->idle) != NULL)
+        {
+            o->idle = uc->next;
+            o->nidle--;
+        }
+        pthread_mutex_unlock(&pool_lock);
+        if(uc == NULL) break;
+        if(still_open(uc))
+        {
+            uc->reused = 1;
+            uc->active = 1;
+            return uc;
+        }
+        upstream_close(uc);
+    }
+
+    if((fd = dns_connect(hostname, port)) < 0)
+    {
+        upstream_leave(hostname, port);
+        return NULL;
+    }
+    //a server that stops reading or sending fails the fetch instead of
+    //holding the thread
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    uc = Malloc(sizeof(upstream_conn));
+    uc->fd = fd;
+    uc->reused = 0;
+    uc->active = 1;
+    uc->origin = Malloc(strlen(key) + 1);
+    strcpy(uc->origin, key);
+    uc->next = NULL;
+    rio_readinitb(&uc->rio, fd);
+    return uc;
+}
+
+//park a connection whose last response ended cleanly for reuse
+void upstream_put(upstream_conn *uc)
+{
+    struct origin *o;
+
+    pthread_mutex_lock(&pool_lock);
+    o = find_origin(uc->origin);
+    uc->active = 0;
+    if(o->nidle < UPSTREAM_MAX_IDLE)
+    {
+        uc->idle_since = time(NULL);
+        uc->next = o->idle;
+        o->idle = uc;
+        o->nidle++;
+        uc = NULL;
+    }
+    //parked first, so the entry doesn't go with the slot
+    leave(o);
+    pthread_mutex_unlock(&pool_lock);
+    if(uc != NULL) upstream_close(uc);
+}
+
+void upstream_close(upstream_conn *uc)
+{
+    if(uc->active)
+    {
+        pthread_mutex_lock(&pool_lock);
+        leave(find_origin(uc->origin));
+        pthread_mutex_unlock(&pool_lock);
+    }
+    close(uc->fd);
+    Free(uc->origin);
+    Free(uc);
+}
+
+void upstream_report(FILE *fp)
+{
+    pthread_mutex_lock(&pool_lock);
+    fprintf(fp, "upstream: %d connections in use, %lu admitted, "
+            "%lu waited for a slot, %lu refused\n",
+            active, admitted, waited, refused);
+    pthread_mutex_unlock(&pool_lock);
+}
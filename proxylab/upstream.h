@@ -0,0 +1,40 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include "csapp.h"
+
+//idle connections kept per origin
+#define UPSTREAM_MAX_IDLE 8
+//default seconds an idle connection is kept before it is reaped
+#define UPSTREAM_IDLE_TIMEOUT 30
+#define UPSTREAM_NBUCKETS 256
+//seconds a read or write on an origin connection may block
+#define UPSTREAM_IO_TIMEOUT 30
+//connections in use at once, over all origins and by default per
+//origin, so one slow server can't tie up every thread
+#define UPSTREAM_MAX_ACTIVE 256
+#define UPSTREAM_MAX_PER_ORIGIN 32
+//seconds a fetch waits for a free slot before it gives up
+#define UPSTREAM_WAIT 5
+
+//a connection to an origin server, either in use by one thread or
+//parked idle in the pool. rio keeps its read buffer across requests
+typedef struct upstream_conn {
+    int fd;
+    int reused;                 //came from the pool, may have gone stale
+    int active;                 //holds one of the origin's slots
+    time_t idle_since;
+    char *origin;               //"host:port" pool key
+    rio_t rio;
+    struct upstream_conn *next;
+} upstream_conn;
+
+void upstream_init(int idle_timeout, int max_per_origin);
+int upstream_admit(char *hostname, char *port);
+void upstream_leave(char *hostname, char *port);
+upstream_conn *upstream_get(char *hostname, char *port);
+void upstream_put(upstream_conn *uc);
+void upstream_close(upstream_conn *uc);
+void upstream_report(FILE *fp);
+
+#endif /* __UPSTREAM_H__ */
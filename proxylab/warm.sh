@@ -0,0 +1,108 @@
+#!/bin/bash
+#
+# warm.sh - measures how long the proxy takes to load a snapshot with
+#     --warm-from. For each size a synthetic snapshot is written with
+#     snapgen and loaded twice: first with the file out of the page
+#     cache, then again with whatever the first load read still in it.
+#     After each load an object is asked for through the proxy with no
+#     server behind it, so it only comes back if it was restored, and
+#     its body is checked against what snapgen wrote.
+#
+#     usage: ./warm.sh [-m "megabytes ..."] [-s object-size] [-f file]
+#                      [-- proxy options]
+#     e.g.   ./warm.sh -m "64 1024" -s 65536 -- -p s3fifo
+#
+
+TIMEOUT=5
+SIZES_MB="1 64 1024"
+OBJECT_SIZE=16384
+SNAPSHOT=""
+PROXY_ARGS=""
+
+#
+# free_port - prints a port nothing listens on, starting at a random one
+#
+function free_port {
+    port=$(( (RANDOM % 30000) + 20000 ))
+    while (exec 3<> /dev/tcp/localhost/${port}) 2> /dev/null
+    do
+        port=$((port + 1))
+    done
+    echo ${port}
+}
+
+function cleanup {
+    [ -n "${PROXY_PID}" ] && kill ${PROXY_PID} 2> /dev/null
+    rm -f ${SNAPSHOT} ${LOG} ${BODY}
+}
+
+#
+# load - starts the proxy on the snapshot, prints its warm start line
+#     and whether an object restored from it is served intact, then
+#     stops it
+#
+function load {
+    port=`free_port`
+    ./proxy --warm-from ${SNAPSHOT} ${PROXY_ARGS} ${port} 2> ${LOG} &
+    PROXY_PID=$!
+    for i in `seq $((TIMEOUT * 10))`
+    do
+        grep -q "warm start\|can't warm" ${LOG} && break
+        sleep 0.1
+    done
+    # the port opens right after the load
+    for i in `seq $((TIMEOUT * 10))`
+    do
+        (exec 3<> /dev/tcp/localhost/${port}) 2> /dev/null && break
+        sleep 0.1
+    done
+    status=`curl -s -o ${BODY} -w "%{http_code}" --max-time ${TIMEOUT} \
+            --proxy http://localhost:${port} \
+            http://localhost:${ORIGIN_PORT}/warm/0`
+    # snapgen's bodies are OBJECT_SIZE bytes of 'x'
+    if [ `stat -c %s ${BODY}` -eq ${OBJECT_SIZE} ] &&
+       [ `tr -d x < ${BODY} | wc -c` -eq 0 ]
+    then
+        body="intact"
+    else
+        body="CORRUPT"
+    fi
+    echo "  $1: `grep "warm start\|can't warm" ${LOG} | sed 's/.*: //'`," \
+         "/warm/0 answered ${status}, body ${body}"
+    kill ${PROXY_PID} 2> /dev/null
+    wait ${PROXY_PID} 2> /dev/null
+    PROXY_PID=""
+}
+
+while [ $# -gt 0 ]
+do
+    case "$1" in
+    -m) SIZES_MB=$2; shift 2;;
+    -s) OBJECT_SIZE=$2; shift 2;;
+    -f) SNAPSHOT=$2; shift 2;;
+    --) shift; PROXY_ARGS="$*"; break;;
+    *)  echo "usage: $0 [-m \"megabytes ...\"] [-s object-size] [-f file]" \
+             "[-- proxy options]"; exit 1;;
+    esac
+done
+
+if [ ! -x ./proxy ] || [ ! -x ./snapgen ]
+then
+    echo "Error: build proxy and snapgen first (make)"
+    exit 1
+fi
+
+[ -z "${SNAPSHOT}" ] && SNAPSHOT=`mktemp /tmp/warm.XXXXXX`
+LOG=`mktemp`
+BODY=`mktemp`
+trap cleanup EXIT
+# keys name a port nothing listens on, so a miss can't be fetched
+ORIGIN_PORT=`free_port`
+
+for mb in ${SIZES_MB}
+do
+    ./snapgen -c -s ${OBJECT_SIZE} -p ${ORIGIN_PORT} ${SNAPSHOT} ${mb} ||
+        exit 1
+    load "from disk"
+    load "page cache"
+done